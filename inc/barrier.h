@@ -0,0 +1,87 @@
+#ifndef BARRIER_H
+#define BARRIER_H
+
+#include <vector>
+#include <unordered_map>
+
+#ifndef VOLK_HH
+#define VOLK_HH
+#define VK_NO_PROTOTYPES
+#include <volk.h>
+#endif // VOLK_HH
+
+namespace runtime
+{
+
+/**
+ * @brief A single buffer range touched by a dispatch or copy
+ */
+struct BufferAccess
+{
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+};
+
+/**
+ * @brief A timeline semaphore value another submission must wait for
+ */
+struct TimelinePoint
+{
+    VkSemaphore semaphore;
+    uint64_t value;
+};
+
+/**
+ * @brief Tracks the last writer and readers of buffer ranges within one command buffer
+ *
+ * Each access is checked against the recorded state of every overlapping range and the
+ * resulting read-after-write, write-after-write and write-after-read dependencies are
+ * queued. flush() emits everything queued so far as one vkCmdPipelineBarrier2, so
+ * independent dispatches between two flushes never wait on each other.
+ */
+class BarrierTracker
+{
+  public:
+    // Record an access; returns true if it depends on earlier work and needs a flush first
+    bool access(const BufferAccess &access);
+    bool access(const std::vector<BufferAccess> &accesses);
+
+    // Queue a barrier produced outside the tracker, e.g. by a host upload
+    void addBarrier(const VkBufferMemoryBarrier2 &barrier);
+
+    bool hasPending() const;
+    // Emit all queued barriers into cmd; returns false if there was nothing to emit
+    bool flush(VkCommandBuffer cmd);
+    // Hand the queued barriers to the caller instead of recording them
+    std::vector<VkBufferMemoryBarrier2> takePending();
+    void reset();
+
+    static bool isWrite(VkAccessFlags2 access);
+    // Pipeline stages that can perform the given accesses
+    static VkPipelineStageFlags2 stageForAccess(VkAccessFlags2 access);
+
+  private:
+    struct RangeState
+    {
+        VkDeviceSize begin;
+        VkDeviceSize end;
+        VkPipelineStageFlags2 writeStage;
+        VkAccessFlags2 writeAccess;
+        VkPipelineStageFlags2 readStages;
+        VkAccessFlags2 readAccess;
+    };
+
+    void queueBarrier(VkBuffer buffer, VkDeviceSize begin, VkDeviceSize end, VkPipelineStageFlags2 srcStage,
+                      VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess);
+
+    // Non-overlapping ranges per buffer, sorted by begin
+    std::unordered_map<VkBuffer, std::vector<RangeState>> m_ranges;
+    std::vector<VkBufferMemoryBarrier2> m_pending;
+};
+
+} // namespace runtime
+
+#endif // BARRIER_H
@@ -0,0 +1,70 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "storage.h"
+
+namespace runtime
+{
+
+/**
+ * @brief Caching buffer allocator with power-of-two size classes
+ *
+ * Buffers are placed in VMA custom pools, one per memory type, so many of them share a
+ * single vkAllocateMemory block. Releasing the last reference to a pooled buffer puts it
+ * back on the free list of its size class; the next acquire of that class pops it instead
+ * of calling vmaCreateBuffer. As with any Buffer, the last reference must not be dropped
+ * while the device is still using it.
+ */
+class BufferPool : public std::enable_shared_from_this<BufferPool>
+{
+  public:
+    static std::shared_ptr<BufferPool> create(std::shared_ptr<MemoryManager> &memory_manager);
+
+    BufferPool(std::shared_ptr<MemoryManager> &memory_manager);
+    ~BufferPool();
+
+    // True if acquire() serves requests of this size
+    static bool accepts(size_t size);
+    // Returns nullptr if size is not accepted, or if a new buffer is needed and the memory
+    // budget rejects it or the allocation fails. Only the first case should be retried with a
+    // direct allocation; a rejected request would just wait on the budget a second time.
+    std::shared_ptr<Buffer> acquire(size_t size, VkBufferUsageFlags usage, VmaAllocationCreateFlags flags);
+
+    // Destroy cached buffers, largest size class first, until at least bytes are freed;
+    // returns the bytes released
+    size_t trim(size_t bytes = SIZE_MAX);
+
+    size_t getCachedBytes() const;
+    size_t getHitCount() const;
+    size_t getMissCount() const;
+
+    static size_t sizeClass(size_t size);
+
+  private:
+    using BucketKey = std::tuple<VkBufferUsageFlags, VmaAllocationCreateFlags, size_t>;
+    using PoolKey = std::pair<VkBufferUsageFlags, VmaAllocationCreateFlags>;
+
+    void cleanup();
+    void recycle(Buffer *buffer, const BucketKey &key);
+    VmaPool getPool(VkBufferUsageFlags usage, VmaAllocationCreateFlags flags);
+
+    std::shared_ptr<MemoryManager> &m_memory_manager;
+    mutable std::mutex m_mutex;
+    std::map<PoolKey, VmaPool> m_pools;
+    std::map<BucketKey, std::vector<Buffer *>> m_free;
+    size_t m_cachedBytes{0};
+    size_t m_outstanding{0};
+    size_t m_hits{0};
+    size_t m_misses{0};
+};
+
+} // namespace runtime
+
+#endif // BUFFER_POOL_H
@@ -11,6 +11,43 @@
 // Disable performance counters to avoid hanging or crashes
 #define DISABLE_PERFORMANCE_COUNTERS
 
+// Submission coalescing: pending work for the same queue family is flushed as a single
+// vkQueueSubmit2 once this many items are queued or the window has elapsed
+#define SUBMIT_BATCH_MAX_COUNT 32
+#define SUBMIT_BATCH_WINDOW_US 100
+
+// Size of the per-device persistently mapped staging ring used for host<->device copies
+#define STAGING_RING_SIZE (256ull << 20)
+
+// Buffer pool: requests up to BUFFER_POOL_MAX_SIZE are rounded up to a power of two and
+// recycled; each VMA pool grows in blocks of BUFFER_POOL_BLOCK_SIZE. 0 uses VMA's preferred
+// block size, which shrinks to an eighth of the heap on small heaps
+#define BUFFER_POOL_MAX_SIZE (64ull << 20)
+#define BUFFER_POOL_BLOCK_SIZE 0
+
+// Memory budget: new allocations are admitted while a heap's usage stays below this
+// fraction of its VK_EXT_memory_budget budget; a request that does not fit is queued for
+// up to MEMORY_BUDGET_WAIT_MS before it is rejected
+#define MEMORY_BUDGET_WATERMARK 0.9f
+#define MEMORY_BUDGET_WAIT_MS 100
+
+// Defragmentation: each pass moves at most DEFRAG_MAX_BYTES_PER_PASS; the background
+// worker spends DEFRAG_PASS_BUDGET_US per step and sleeps DEFRAG_PASS_INTERVAL_MS between steps
+#define DEFRAG_MAX_BYTES_PER_PASS (64ull << 20)
+#define DEFRAG_PASS_BUDGET_US 2000
+#define DEFRAG_PASS_INTERVAL_MS 10
+
+// Weight loading: tensors are uploaded in WEIGHT_LOADER_CHUNK_SIZE pieces by
+// WEIGHT_LOADER_READERS threads, with at most WEIGHT_LOADER_MAX_IN_FLIGHT bytes whose
+// device copies have not finished
+#define WEIGHT_LOADER_READERS 4
+#define WEIGHT_LOADER_CHUNK_SIZE (16ull << 20)
+#define WEIGHT_LOADER_MAX_IN_FLIGHT (128ull << 20)
+
+// Pipeline cache files live in this directory under the system temp directory unless
+// VKRT_PIPELINE_CACHE_DIR points elsewhere
+#define PIPELINE_CACHE_DIR "vkrt_pipeline_cache"
+
 //
 //#ifdef WIN32
 //#define VK_USE_PLATFORM_WIN32_KHR
@@ -19,6 +19,9 @@
 #include <mutex>
 #include <condition_variable>
 #include <future>
+#include <chrono>
+
+#include "specialization.h"
 
 
 namespace runtime {
@@ -28,10 +31,30 @@ class DeviceFeatures;
 class QueueManager;
 class MemoryManager;
 class Buffer;
+class BufferPool;
+class MemoryBudget;
+class BufferView;
+class SparseBuffer;
+class ChunkedBuffer;
+class AddressTable;
+class MemoryPlanner;
 class Program;
 class DescriptorAllocator;
 class DescriptorLayoutCache;
 class CommandPoolManager;
+class CommandGraph;
+class PipelineCache;
+class ProgramCache;
+
+struct ProgramDesc
+{
+    std::vector<uint32_t> shader;
+    uint32_t dim_x = 1;
+    uint32_t dim_y = 1;
+    uint32_t dim_z = 1;
+    Specialization specialization;
+    BindingMode mode = BindingMode::DescriptorSets;
+};
 
 class ThreadPool
 {
@@ -64,17 +87,60 @@ class Device
     std::shared_ptr<Buffer> createWorkingBuffer(size_t size, bool is_dedicated = false);
     std::shared_ptr<Buffer> createSrcTransferBuffer(size_t size, bool is_dedicated = true);
     std::shared_ptr<Buffer> createDstTransferBuffer(size_t size, bool is_dedicated = true);
+    // Virtual buffer that may exceed maxStorageBufferRange and the allocation limit. With
+    // sparseResidencyBuffer only committed pages use memory; otherwise it is fully resident.
+    std::shared_ptr<SparseBuffer> createSparseBuffer(size_t size);
+    // Tensor stored as consecutive working buffers that can each be bound to a shader.
+    // chunk_size 0 picks the largest chunk the device can bind and allocate; an explicit
+    // size should be a multiple of the element size so elements do not straddle chunks.
+    std::shared_ptr<ChunkedBuffer> createChunkedBuffer(size_t size, size_t chunk_size = 0);
+    // Wrap caller memory (e.g. an mmap) as a working buffer without copying it. Needs
+    // VK_EXT_external_memory_host and ptr/size aligned to minImportedHostPointerAlignment;
+    // otherwise the data is copied into a new working buffer, so results must be read back
+    // with copyDataTo rather than through ptr.
+    std::shared_ptr<Buffer> importHostBuffer(void *ptr, size_t size);
+    // Pack several tensors into one working buffer; each view starts on a storage buffer
+    // offset boundary so it can be bound directly
+    std::vector<std::shared_ptr<BufferView>> createPackedBuffers(const std::vector<size_t> &sizes);
+    // Plan the recorded steps and allocate a single arena; views are indexed by TensorId
+    std::vector<std::shared_ptr<BufferView>> createPlannedBuffers(MemoryPlanner &planner);
+    // Table of the buffers' device addresses for shaders that reach them through one
+    // buffer_reference pointer; null without bufferDeviceAddress. See AddressTable.
+    std::shared_ptr<AddressTable> createAddressTable(const std::vector<std::shared_ptr<Buffer>> &buffers);
     void copyData(void *src, void *dst, size_t size);
 
     // Program
+    // Each distinct specialization is its own pipeline; identical ones are shared.
+    // PushDescriptors falls back to DescriptorSets without VK_KHR_push_descriptor.
     std::shared_ptr<Program> createProgram(const std::vector<uint32_t> &shader, uint32_t dim_x=1, uint32_t dim_y=1,
-                                           uint32_t dim_z=1);
+                                           uint32_t dim_z=1, const Specialization &specialization = {},
+                                           BindingMode mode = BindingMode::DescriptorSets);
+    // Compile a batch of shaders concurrently on the thread pool. Each future carries the
+    // Program or the exception its construction threw; wait on them before destroying the Device.
+    std::vector<std::shared_future<std::shared_ptr<Program>>> createProgramsAsync(
+        const std::vector<ProgramDesc> &programs);
     std::shared_ptr<CommandPoolManager> getComputePoolManager(size_t idx, VkQueueFlagBits flags);
     
     // Getters
     const DeviceFeatures& getDeviceFeatures() const { return *m_features; }
+    std::shared_ptr<BufferPool> getBufferPool() const { return m_buffer_pool; }
+    // Allocator, staging ring and transfer engine behind this device's buffers
+    std::shared_ptr<MemoryManager> getMemoryManager() const { return m_memory_manager; }
+    // Saved on destruction; call save() on it to persist earlier
+    std::shared_ptr<PipelineCache> getPipelineCache() const { return m_pipeline_cache; }
+    // Programs created from identical SPIR-V share one pipeline
+    std::shared_ptr<ProgramCache> getProgramCache() const { return m_program_cache; }
+    // Per-heap usage and admission control for this device's allocations
+    std::shared_ptr<MemoryBudget> getMemoryBudget() const;
+
+    // Defragment device memory for up to budget; returns true once nothing is left to move
+    bool defragment(std::chrono::microseconds budget);
+    // Keep defragmenting on the thread pool, DEFRAG_PASS_BUDGET_US at a time, until done or stopped
+    void startDefragmentation();
+    void stopDefragmentation();
     VkDevice getDevice() const { return m_device; }
-    void submit(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPools, uint32_t i = 0);
+    std::shared_future<int> submit(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPools, uint32_t i = 0);
+    std::shared_future<int> submit(const std::shared_ptr<CommandGraph> &graph);
     
   private:
     // Initialize device
@@ -88,12 +154,19 @@ class Device
     std::unique_ptr<DeviceFeatures> m_features;
     std::shared_ptr<QueueManager> m_queue_manager;
     std::shared_ptr<MemoryManager> m_memory_manager;
+    std::shared_ptr<BufferPool> m_buffer_pool;
     std::shared_ptr<DescriptorAllocator> m_descriptorAllocator;
     std::shared_ptr<DescriptorLayoutCache> m_descriptorLayoutCache;
 
     VkDevice m_device{VK_NULL_HANDLE};
-    VkPipelineCache m_pipeline_cache{VK_NULL_HANDLE}; // Add this line
+    std::shared_ptr<PipelineCache> m_pipeline_cache;
+    std::shared_ptr<ProgramCache> m_program_cache;
     std::unordered_map<void*, std::shared_ptr<Buffer>> m_buffers;
+
+    std::mutex m_defrag_mutex;
+    std::condition_variable m_defrag_cv;
+    bool m_defrag_active{false};
+    bool m_defrag_stop{false};
 };
 
 } // namespace runtime
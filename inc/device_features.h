@@ -66,6 +66,12 @@ public:
             VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES};
         VkPhysicalDeviceVulkan13Properties device_vulkan13_properties = {
             VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_PROPERTIES};
+        // Only queried when VK_EXT_external_memory_host is available
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT external_memory_host_properties = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT};
+        // Only queried when VK_KHR_push_descriptor is available
+        VkPhysicalDevicePushDescriptorPropertiesKHR push_descriptor_properties = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PUSH_DESCRIPTOR_PROPERTIES_KHR};
     };
 
   
@@ -89,6 +95,14 @@ public:
         return &m_features.features13;
     }
 
+    /**
+     * @brief Feature chain passed to vkCreateDevice
+     *
+     * Only the features the runtime depends on are switched on, and only
+     * when the physical device reports them.
+     */
+    VkPhysicalDeviceFeatures2 *getEnabledFeatures2() noexcept;
+
     [[nodiscard]] const Features& getFeatures() const noexcept { return m_features; }
     [[nodiscard]] const Properties& getProperties() const noexcept { return m_properties; }
     [[nodiscard]] std::vector<std::string> getDeviceCapabilities() const;
@@ -98,14 +112,30 @@ public:
     [[nodiscard]] VendorID getVendorID() const noexcept;
     [[nodiscard]] std::vector<uint32_t> getResourceLimits() const;
     [[nodiscard]] size_t getMaxAllocationSize() const noexcept;
+    // Largest single VkDeviceMemory allocation (maxMemoryAllocationSize)
+    [[nodiscard]] size_t getMaxMemoryAllocationSize() const noexcept;
+    [[nodiscard]] size_t getMinStorageBufferOffsetAlignment() const noexcept;
     [[nodiscard]] size_t getSparseAllocationSize() const noexcept;
     [[nodiscard]] bool supportsSparseBinding() const noexcept;
     [[nodiscard]] bool supportsSparseResidency() const noexcept;
     [[nodiscard]] bool supportsSparseResidencyAliased() const noexcept;
+    [[nodiscard]] bool supportsTimelineSemaphore() const noexcept;
+    [[nodiscard]] bool supportsSynchronization2() const noexcept;
+    [[nodiscard]] bool supportsExtension(const char *name) const noexcept;
+    // VK_EXT_external_memory_host: host allocations can back a VkBuffer without a copy
+    [[nodiscard]] bool supportsExternalMemoryHost() const noexcept;
+    // Imported pointers and sizes must be multiples of this
+    [[nodiscard]] size_t getMinImportedHostPointerAlignment() const noexcept;
+    // Shaders can reach buffers through 64-bit pointers (buffer_reference)
+    [[nodiscard]] bool supportsBufferDeviceAddress() const noexcept;
+    // VK_KHR_push_descriptor: descriptors recorded into the command buffer, no descriptor sets
+    [[nodiscard]] bool supportsPushDescriptors() const noexcept;
+    [[nodiscard]] uint32_t getMaxPushDescriptors() const noexcept;
     [[nodiscard]] std::string getDeviceName() const;
 
 private:
     Features m_features;
+    Features m_enabled_features;
     Properties m_properties;
     std::vector<VkExtensionProperties> m_extensions;   
     std::vector<VkLayerProperties> m_layers;
@@ -0,0 +1,83 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "storage.h"
+
+namespace runtime
+{
+
+/**
+ * @brief Per-heap admission control on top of VK_EXT_memory_budget
+ *
+ * Every new device allocation asks reserve() first. If the heap's current usage plus the
+ * request would cross watermark * budget, the registered evictors are asked to release
+ * cached memory (e.g. BufferPool::trim) and the check is repeated. If the heap is still
+ * over the watermark the caller waits up to the wait timeout for other buffers to be
+ * destroyed, then the allocation is rejected instead of letting the driver page.
+ *
+ * The watermark is soft: concurrent reservations are not summed, so allocations racing on
+ * the same heap can overshoot it by at most their combined size.
+ */
+class MemoryBudget
+{
+  public:
+    struct HeapUsage
+    {
+        VkDeviceSize usage;     // bytes the process uses on the heap, as reported by the driver
+        VkDeviceSize budget;    // bytes the process can use before the driver starts paging
+        VkDeviceSize allocated; // bytes in VkDeviceMemory blocks owned by this allocator
+        bool deviceLocal;
+    };
+
+    // Frees up to the requested number of bytes of cached memory; returns what it released
+    using Evictor = std::function<size_t(size_t)>;
+
+    static std::shared_ptr<MemoryBudget> create(VmaAllocator allocator, float watermark);
+
+    MemoryBudget(VmaAllocator allocator, float watermark);
+
+    std::vector<HeapUsage> getHeapUsage() const;
+    HeapUsage getHeapUsage(uint32_t heapIndex) const;
+
+    // Fraction of each heap's budget that reserve() admits, in (0, 1]
+    void setWatermark(float watermark);
+    float getWatermark() const;
+    // How long reserve() queues a request that does not fit before rejecting it
+    void setWaitTimeout(std::chrono::milliseconds timeout);
+
+    size_t addEvictor(Evictor evictor);
+    void removeEvictor(size_t id);
+
+    // True if size more bytes fit under the heap's watermark, after evicting and waiting
+    bool reserve(uint32_t heapIndex, VkDeviceSize size);
+    // Called after memory is freed; wakes queued reservations
+    void notify();
+
+  private:
+    bool fits(uint32_t heapIndex, VkDeviceSize size) const;
+    size_t evict(size_t bytes);
+    // Make VMA fetch fresh numbers from the driver instead of its running estimate
+    void refresh();
+
+    VmaAllocator m_allocator;
+    const VkPhysicalDeviceMemoryProperties *m_memory_properties{nullptr};
+    std::atomic<float> m_watermark;
+    std::atomic<std::chrono::milliseconds> m_wait_timeout;
+    std::vector<std::pair<size_t, Evictor>> m_evictors;
+    size_t m_next_evictor{0};
+    std::atomic<uint32_t> m_frame{0};
+    mutable std::mutex m_mutex;
+    std::condition_variable m_freed;
+};
+
+} // namespace runtime
+
+#endif // MEMORY_BUDGET_H
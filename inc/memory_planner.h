@@ -0,0 +1,61 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <memory>
+#include <vector>
+
+namespace runtime
+{
+class Buffer;
+class BufferView;
+
+/**
+ * @brief Offline planner that lets tensors with disjoint lifetimes share memory
+ *
+ * Tensors are declared up front, then every Program invocation is recorded in execution
+ * order with the tensors it binds. A tensor is live from the first step that uses it to
+ * the last one; persistent tensors (model inputs and outputs) are live for the whole
+ * sequence. plan() places tensors greedily by decreasing size at the lowest offset that
+ * does not overlap any already placed tensor whose lifetime intersects its own, so the
+ * arena is usually far smaller than the sum of all intermediates.
+ */
+class MemoryPlanner
+{
+  public:
+    using TensorId = size_t;
+
+    TensorId addTensor(size_t size, bool persistent = false);
+    // Record one invocation; steps are numbered in the order they are added
+    void addStep(const std::vector<TensorId> &tensors);
+
+    // Assign offsets aligned to alignment; returns the arena size
+    size_t plan(size_t alignment = 1);
+
+    size_t getOffset(TensorId tensor) const;
+    size_t getSize(TensorId tensor) const;
+    size_t getArenaSize() const;
+    // Memory the tensors would need without aliasing
+    size_t getUnplannedSize() const;
+
+    // Views into arena, indexed by TensorId; arena must hold at least getArenaSize() bytes
+    std::vector<std::shared_ptr<BufferView>> materialize(const std::shared_ptr<Buffer> &arena) const;
+
+  private:
+    struct Tensor
+    {
+        size_t size;
+        bool persistent;
+        size_t firstUse;
+        size_t lastUse;
+        size_t offset;
+    };
+
+    std::vector<Tensor> m_tensors;
+    size_t m_stepCount{0};
+    size_t m_arenaSize{0};
+    bool m_planned{false};
+};
+
+} // namespace runtime
+
+#endif // MEMORY_PLANNER_H
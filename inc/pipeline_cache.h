@@ -0,0 +1,68 @@
+#ifndef PIPELINE_CACHE_H
+#define PIPELINE_CACHE_H
+
+#ifndef VOLK_HH
+#define VOLK_HH
+#define VK_NO_PROTOTYPES
+#include <volk.h>
+#endif // VOLK_HH
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace runtime
+{
+class DeviceFeatures;
+
+/**
+ * @brief VkPipelineCache persisted across runs
+ *
+ * The cache file is named after the device UUID, driver version and pipelineCacheUUID, so
+ * a driver update or another GPU starts from an empty cache instead of feeding the driver
+ * foreign data. On load the runtime's own header (magic, device UUID, driver version and
+ * payload size) and the Vulkan cache header (vendor, device, pipelineCacheUUID) must both
+ * match, otherwise the file is ignored. save() writes a temporary file and renames it over
+ * the old one, so a crash or a concurrent process never leaves a torn cache behind.
+ */
+class PipelineCache
+{
+  public:
+    // Empty directory: $VKRT_PIPELINE_CACHE_DIR, else PIPELINE_CACHE_DIR under the temp directory
+    static std::shared_ptr<PipelineCache> create(VkDevice device, const DeviceFeatures &features,
+                                                 const std::filesystem::path &directory = {});
+
+    PipelineCache(VkDevice device, const DeviceFeatures &features, const std::filesystem::path &directory);
+    // Saves, then destroys the cache
+    ~PipelineCache();
+
+    VkPipelineCache getHandle() const;
+    const std::filesystem::path &getPath() const;
+    // True if the cache was seeded from disk
+    bool isWarm() const;
+
+    bool save();
+
+  private:
+    void initialize(const DeviceFeatures &features, const std::filesystem::path &directory);
+    void cleanup();
+    std::vector<uint8_t> load() const;
+    bool validate(const std::vector<uint8_t> &file) const;
+
+    VkDevice m_device;
+    VkPipelineCache m_cache{VK_NULL_HANDLE};
+    std::filesystem::path m_path;
+    uint8_t m_device_uuid[VK_UUID_SIZE]{};
+    uint8_t m_cache_uuid[VK_UUID_SIZE]{};
+    uint32_t m_driver_version{0};
+    uint32_t m_vendor_id{0};
+    uint32_t m_device_id{0};
+    bool m_warm{false};
+    std::mutex m_mutex;
+};
+
+} // namespace runtime
+
+#endif // PIPELINE_CACHE_H
@@ -7,22 +7,156 @@
 #include <volk.h>
 #endif // VOLK_HH
 
-#include <vector>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 #ifndef SPIRV_REFLECT_INC_H
 #define SPIRV_REFLECT_INC_H
 #include <spirv_reflect.h>
 #endif // SPIRV_CROSS_INC_H
 
+#include "specialization.h"
+
 
 namespace runtime
 {
 class Buffer;
+class ChunkedBuffer;
+class AddressTable;
 class Device;
 class DescriptorAllocator;
 class DescriptorLayoutCache;
 class CommandPoolManager;
+struct PushConstants;
+struct BufferAccess;
+struct TimelinePoint;
+// Matches the declaration in queue.h
+using SubmitHook = std::function<void(const TimelinePoint &)>;
+
+/**
+ * @brief Everything built from one shader that does not depend on bound arguments
+ *
+ * Shader module, descriptor set layouts, pipeline layout and pipeline, plus the reflected
+ * binding layout Programs need to write and synchronize their descriptors. Immutable once
+ * created, so any number of Programs may share one.
+ */
+class PipelineState
+{
+  public:
+    // PushDescriptors needs a shader with at most one set of buffer bindings holding no more
+    // than max_push_descriptors (VkPhysicalDevicePushDescriptorPropertiesKHR) descriptors;
+    // other shaders fall back to DescriptorSets, which getBindingMode() reports.
+    static std::shared_ptr<PipelineState> create(VkDevice device, VkPipelineCache pipeline_cache,
+                                                 std::shared_ptr<DescriptorLayoutCache> &descCache,
+                                                 const std::vector<uint32_t> &shader_code,
+                                                 const Specialization &specialization = {},
+                                                 BindingMode mode = BindingMode::DescriptorSets,
+                                                 uint32_t max_push_descriptors = 0);
+    PipelineState(VkDevice device, VkPipelineCache pipeline_cache, std::shared_ptr<DescriptorLayoutCache> &descCache,
+                  const std::vector<uint32_t> &shader_code, const Specialization &specialization = {},
+                  BindingMode mode = BindingMode::DescriptorSets, uint32_t max_push_descriptors = 0);
+    ~PipelineState();
+
+    BindingMode getBindingMode() const { return m_mode; }
+    VkPipeline getPipeline() const { return m_pipeline; }
+    VkPipelineLayout getPipelineLayout() const { return m_pipelineLayout; }
+    const std::vector<VkDescriptorSetLayout> &getSetLayouts() const { return m_layouts; }
+    // Descriptor writes per set and binding, with dstSet and pBufferInfo left empty
+    const std::vector<std::vector<VkWriteDescriptorSet>> &getWriteTemplates() const { return m_writes; }
+    // Shader access to each binding, from NonWritable/NonReadable
+    const std::vector<std::vector<VkAccessFlags2>> &getBindingAccess() const { return m_bindingAccess; }
+    // One template per set writing every binding from a packed VkDescriptorBufferInfo array,
+    // indexed like the write templates; VK_NULL_HANDLE for sets with non-buffer bindings.
+    // With PushDescriptors the template for set 0 is a push-descriptor template.
+    const std::vector<VkDescriptorUpdateTemplate> &getUpdateTemplates() const { return m_updateTemplates; }
+    // Reflected push-constant block, size 0 if the shader has none
+    const VkPushConstantRange &getPushConstantRange() const { return m_pushRange; }
+
+  private:
+    void initialize(VkPipelineCache pipeline_cache, std::shared_ptr<DescriptorLayoutCache> &descCache,
+                    const std::vector<uint32_t> &shader_code, const Specialization &specialization,
+                    BindingMode mode, uint32_t max_push_descriptors);
+    void cleanup();
+
+    VkDevice m_device;
+    BindingMode m_mode{BindingMode::DescriptorSets};
+    VkShaderModule m_module{VK_NULL_HANDLE};
+    VkPipeline m_pipeline{VK_NULL_HANDLE};
+    VkPipelineLayout m_pipelineLayout{VK_NULL_HANDLE};
+    std::vector<VkDescriptorSetLayout> m_layouts;
+    std::vector<std::vector<VkWriteDescriptorSet>> m_writes;
+    std::vector<std::vector<VkAccessFlags2>> m_bindingAccess;
+    std::vector<VkDescriptorUpdateTemplate> m_updateTemplates;
+    VkPushConstantRange m_pushRange{0, 0, 0};
+};
+
+/**
+ * @brief Per-device cache of PipelineStates keyed by SPIR-V code and specialization
+ *
+ * Entries are looked up by a hash of the SPIR-V words and specialization values and
+ * confirmed by comparing both, so a collision never returns the wrong pipeline. Concurrent requests for a
+ * shader that is still being built wait for the first one instead of building it again.
+ * Entries live until clear() or the cache is destroyed.
+ */
+class ProgramCache
+{
+  public:
+    // max_push_descriptors is passed to every PipelineState built for PushDescriptors
+    static std::shared_ptr<ProgramCache> create(VkDevice device, VkPipelineCache pipeline_cache,
+                                                std::shared_ptr<DescriptorLayoutCache> &descCache,
+                                                uint32_t max_push_descriptors = 0);
+    ProgramCache(VkDevice device, VkPipelineCache pipeline_cache, std::shared_ptr<DescriptorLayoutCache> &descCache,
+                 uint32_t max_push_descriptors = 0);
+
+    // Rethrows whatever building the pipeline threw; failed builds are not cached
+    std::shared_ptr<PipelineState> getPipeline(const std::vector<uint32_t> &shader_code,
+                                               const Specialization &specialization = {},
+                                               BindingMode mode = BindingMode::DescriptorSets);
+
+    size_t size() const;
+    size_t getHitCount() const;
+    size_t getMissCount() const;
+    void clear();
+
+  private:
+    struct Key
+    {
+        std::vector<uint32_t> code;
+        Specialization specialization;
+        BindingMode mode;
+        size_t hash;
+
+        bool operator==(const Key &other) const
+        {
+            return hash == other.hash && mode == other.mode && code == other.code &&
+                   specialization == other.specialization;
+        }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            return key.hash;
+        }
+    };
+
+    VkDevice m_device;
+    VkPipelineCache m_pipeline_cache;
+    std::shared_ptr<DescriptorLayoutCache> m_descCache;
+    uint32_t m_maxPushDescriptors;
+    std::unordered_map<Key, std::shared_future<std::shared_ptr<PipelineState>>, KeyHash> m_entries;
+    size_t m_hits{0};
+    size_t m_misses{0};
+    mutable std::mutex m_mutex;
+};
 
 class Program
 {
@@ -31,33 +165,112 @@ class Program
                                            std::shared_ptr<DescriptorLayoutCache> &descCache,
                                            std::shared_ptr<DescriptorAllocator> &descAllocator,                                          
                                            const std::vector<uint32_t> &shader_code, uint32_t dim_x, uint32_t dim_y,
-                                           uint32_t dim_z);
-    
+                                           uint32_t dim_z, const Specialization &specialization = {},
+                                           BindingMode mode = BindingMode::DescriptorSets,
+                                           uint32_t max_push_descriptors = 0);
+    // Instance of an existing pipeline; only the descriptor sets are new
+    static std::shared_ptr<Program> create(VkDevice device, std::shared_ptr<PipelineState> pipeline,
+                                           std::shared_ptr<DescriptorAllocator> &descAllocator, uint32_t dim_x,
+                                           uint32_t dim_y, uint32_t dim_z);
 
-    Program(VkDevice device, VkPipelineCache pipeline_cache, 
-            std::shared_ptr<DescriptorLayoutCache> &descCache,
-            std::shared_ptr<DescriptorAllocator> &descAllocator,          
-            const std::vector<uint32_t> &shader_code,
+    Program(VkDevice device, std::shared_ptr<PipelineState> pipeline,
+            std::shared_ptr<DescriptorAllocator> &descAllocator,
             uint32_t dim_x, uint32_t dim_y, uint32_t dim_z);
 
     ~Program();
-    void Arg(std::shared_ptr<Buffer> &buffer, size_t binding_idx = 0,size_t set_idx = 0);
+    void Arg(const std::shared_ptr<Buffer> &buffer, size_t binding_idx = 0,size_t set_idx = 0);
+    // Bind a tensor split into chunks. setup() then dispatches once per chunk with every
+    // chunked argument bound to that chunk, so the shader sees each chunk as a whole tensor.
+    // The dispatch size is for one full chunk; x is scaled down for a shorter last chunk.
+    // Unchunked arguments are bound unchanged to every chunk's dispatch, so they must be
+    // read-only (NonWritable): binding a chunked buffer next to an unchunked writable one,
+    // or the other way round, is rejected with an error and leaves the binding as it was.
+    // bind() replacing every chunked argument at once is how a Program goes back to whole buffers.
+    void Arg(const std::shared_ptr<ChunkedBuffer> &buffer, size_t binding_idx = 0, size_t set_idx = 0);
+    // Bind one buffer per binding of the set, in binding-index order, with a single descriptor
+    // update. Null entries keep their current buffer.
+    void bind(const std::vector<std::shared_ptr<Buffer>> &buffers, size_t set_idx = 0);
+    // Pass the buffer's device address as the 64-bit pointer at push-constant offset
+    // 8 * slot, for shaders reading buffers through buffer_reference instead of descriptors.
+    // Slots outside the shader's push-constant range are rejected. The address is read on
+    // every dispatch, so moved buffers stay valid, and the buffer is synchronized as read and
+    // written. A dispatch captured into a CommandGraph keeps the address it was recorded
+    // with; the buffer stays pinned, so defragmentation leaves it there, until the graph is
+    // destroyed.
+    void ArgAddress(const std::shared_ptr<Buffer> &buffer, uint32_t slot);
+    // Pass the table's address; every buffer it points to is synchronized and pinned too
+    void ArgAddress(const std::shared_ptr<AddressTable> &table, uint32_t slot);
+    // Bytes for the shader's push-constant block at the given offset into the block. They are
+    // copied, so every later setup() records them until they are set again.
+    void setPushConstants(const void *data, size_t size, uint32_t offset = 0);
+    template <typename T> void setPushConstants(const T &value, uint32_t offset = 0)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "push constants must be trivially copyable");
+        setPushConstants(&value, sizeof(T), offset);
+    }
     void setup(std::shared_ptr<CommandPoolManager> cmd_pool);
+    // PushDescriptors mode: record a dispatch with buffers bound to set 0 for this dispatch
+    // only, in binding-index order, plus optional push-constant bytes overlaid on the ones
+    // set with setPushConstants. The Program is not modified, so threads may dispatch it
+    // concurrently with different buffers as long as each uses its own pool. Buffers bound
+    // with ArgAddress are shared by every dispatch.
+    void dispatch(const std::shared_ptr<CommandPoolManager> &cmd_pool, const std::vector<std::shared_ptr<Buffer>> &buffers,
+                  const void *push_data = nullptr, size_t push_size = 0, uint32_t push_offset = 0) const;
+
+    const std::shared_ptr<PipelineState> &getPipelineState() const { return m_state; }
   
   private:
-    void initialize(VkDevice device, VkPipelineCache pipeline_cache,
-                    std::shared_ptr<DescriptorLayoutCache> &descCache,
-                    std::shared_ptr<DescriptorAllocator> &descAllocator,  
-                    const std::vector<uint32_t> &shader_code);
+    void initialize(std::shared_ptr<DescriptorAllocator> &descAllocator);
     void cleanup();
+    // Push-constant bytes with the current address of every ArgAddress buffer patched in
+    PushConstants pushConstants() const;
+    // Accesses, barriers and waits of the buffers bound with ArgAddress and those their
+    // address tables point to
+    void trackAddressArgs(std::vector<BufferAccess> &accesses, std::vector<VkBufferMemoryBarrier2> &barriers,
+                          std::vector<TimelinePoint> &waits) const;
+    // Pin buffers and every ArgAddress buffer, tables' buffers included, before their
+    // handles or addresses are read;
+    // the hook unpins them once the dispatch has been submitted
+    SubmitHook pinBuffers(const std::vector<Buffer *> &buffers) const;
+    // Record one dispatch with buffers pushed as set 0; buffers must be pinned by onSubmit
+    void dispatchPushed(CommandPoolManager &cmd_pool, const std::vector<Buffer *> &buffers, uint32_t dim_x,
+                        const PushConstants &push, SubmitHook onSubmit) const;
+    // setup() when chunked arguments are bound
+    void dispatchChunks();
+    // Whether binding set_idx/binding_idx, chunked or not, would leave a writable unchunked
+    // argument next to a chunked one
+    bool conflictsWithChunks(size_t set_idx, size_t binding_idx, bool chunked) const;
+    // Write the set's bindings from m_templateData in one call
+    void updateSet(size_t set_idx);
 
     VkDevice m_device;
-    VkShaderModule m_module;
+    std::shared_ptr<PipelineState> m_state;
     VkPipeline m_pipeline{VK_NULL_HANDLE};
     VkPipelineLayout m_pipelineLayout{VK_NULL_HANDLE};
     uint32_t dims[3]{0, 0, 0};
     std::vector<VkDescriptorSet> sets; 
     std::vector<std::vector<VkWriteDescriptorSet>> writes;
+    // Shader access to each binding (from NonWritable/NonReadable) and the buffer bound to it
+    std::vector<std::vector<VkAccessFlags2>> m_bindingAccess;
+    std::vector<std::vector<std::shared_ptr<Buffer>>> m_args;
+    // Buffer generation each descriptor was written with; a mismatch means it was moved
+    std::vector<std::vector<uint64_t>> m_argGenerations;
+    std::vector<std::vector<std::shared_ptr<ChunkedBuffer>>> m_chunkedArgs;
+    // Packed descriptor data for each set's update template
+    std::vector<std::vector<VkDescriptorBufferInfo>> m_templateData;
+    // One copy of the descriptor sets per chunk, rewritten when an argument changes
+    std::vector<std::vector<VkDescriptorSet>> m_chunkSets;
+    // Generation of the buffer each chunk set binding was written with, indexed [chunk][set][binding]
+    std::vector<std::vector<std::vector<uint64_t>>> m_chunkGenerations;
+    bool m_chunkSetsDirty{true};
+    std::vector<VkDescriptorSetLayout> m_layouts;
+    // Contents of the push-constant range, zero until set
+    std::vector<uint8_t> m_pushData;
+    // Buffers passed by address, indexed by 8-byte push-constant slot, and the address table
+    // each slot's buffer belongs to, if any
+    std::vector<std::shared_ptr<Buffer>> m_addressArgs;
+    std::vector<std::shared_ptr<AddressTable>> m_addressTables;
+    std::shared_ptr<DescriptorAllocator> m_descAllocator;
     std::shared_ptr<CommandPoolManager> m_cmdPoolManager;
 };
 
@@ -6,12 +6,13 @@
 #include <memory>
 #include <functional>
 #include <thread>
-#include <bitset>
+#include <atomic>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <future>
 #include <queue>
-#include <unordered_map>
+#include <chrono>
 
 #ifndef VOLK_HH
 #define VOLK_HH
@@ -20,7 +21,7 @@
 #include <volk.h>
 #endif // VOLK_HH
 
-#define SECONDARY_BUFFER 8
+#include "barrier.h"
 
 namespace runtime
 {
@@ -35,6 +36,7 @@ class DescriptorLayoutCache
     DescriptorLayoutCache(VkDevice device);
     ~DescriptorLayoutCache();
 
+    // Thread-safe: Programs may be created concurrently
     VkDescriptorSetLayout getDescriptorSetLayout(uint32_t set, VkDescriptorSetLayoutCreateInfo *createInfo);
 
 
@@ -43,14 +45,16 @@ class DescriptorLayoutCache
     void cleanup();
 
     VkDevice m_device;
+    std::mutex m_mutex;
     struct DescriptorLayoutInfo
     {
         std::vector<VkDescriptorSetLayoutBinding> bindings;
         uint32_t setNumber = UINT32_MAX;
+        VkDescriptorSetLayoutCreateFlags flags = 0;
 
         bool operator==(const DescriptorLayoutInfo &other) const
         {
-            if (other.setNumber != setNumber || other.bindings.size() != bindings.size())
+            if (other.setNumber != setNumber || other.flags != flags || other.bindings.size() != bindings.size())
             {
                 return false;
             }
@@ -72,7 +76,7 @@ class DescriptorLayoutCache
 
         size_t hash() const
         {
-            size_t result = std::hash<uint32_t>()(setNumber);
+            size_t result = std::hash<uint32_t>()(setNumber) ^ (static_cast<size_t>(flags) << 4);
 
             // Combine hashes of all bindings
             for (const auto &binding : bindings)
@@ -113,11 +117,13 @@ class DescriptorAllocator
     ~DescriptorAllocator();
   
     void resetPools();
+    // Thread-safe: Programs may be created concurrently
     bool allocate(size_t n_sets, VkDescriptorSet *set, VkDescriptorSetLayout *layout);
     
   private:
     void initialize(VkDevice device, const std::vector<VkDescriptorPoolSize>& pool_sizes);
     void cleanup();
+    std::mutex m_mutex;
     VkDescriptorPool currentPool{VK_NULL_HANDLE};
     std::vector<VkDescriptorPool> usedPools;
     std::vector<VkDescriptorPool> freePools;
@@ -128,14 +134,97 @@ class DescriptorAllocator
     VkDescriptorPool grabPool();
 };
 
+/**
+ * @brief Push-constant bytes recorded with one dispatch
+ */
+struct PushConstants
+{
+    VkShaderStageFlags stages{0};
+    uint32_t offset{0};
+    std::vector<uint8_t> data;
+};
+
+/**
+ * @brief Set 0 of a dispatch written with vkCmdPushDescriptorSetWithTemplateKHR
+ */
+struct PushDescriptors
+{
+    VkDescriptorUpdateTemplate updateTemplate{VK_NULL_HANDLE};
+    std::vector<VkDescriptorBufferInfo> data;
+};
+
+/**
+ * @brief Called once for recorded work: with the timeline point of the submission that
+ * carries it, or with a null point if the work is dropped or was captured into a graph
+ * that has been destroyed. Runs without the recorder's locks held.
+ */
+using SubmitHook = std::function<void(const TimelinePoint &)>;
+
 class Program;
 struct QueueData
 {
     VkQueue queue;
-    VkFence fence;
+    VkSemaphore timeline;     // signalled once per submission with timelineValue
     uint32_t queueFamilyIndex;
     uint32_t queueIndex;
-    std::promise<int> promise;
+    uint64_t timelineValue;   // last value handed to a submission on this queue
+};
+
+/**
+ * @brief Pre-recorded dispatch sequence that can be resubmitted without re-recording
+ *
+ * Produced by CommandPoolManager::beginCapture / endCapture. Dispatches are recorded
+ * inline into a single primary command buffer marked for simultaneous use, so replaying
+ * costs one submit and no CPU-side recording. Descriptor sets are captured by handle:
+ * rebinding a Program's arguments after capture, or a defragmentation pass moving one of
+ * them, requires capturing again.
+ */
+class CommandGraph
+{
+  public:
+    static std::shared_ptr<CommandGraph> create(VkDevice device, uint32_t queueFamilyIndex);
+    CommandGraph(VkDevice device, uint32_t queueFamilyIndex);
+    ~CommandGraph();
+
+    VkCommandBuffer getCommandBuffer() const;
+    uint32_t getQueueFamilyIndex() const;
+    uint32_t getDispatchCount() const;
+    // Track one more replay; replays may run on different queues at the same time
+    void set_future(const std::shared_future<int> &fut);
+    // Wait for every replay that has not finished yet
+    void wait();
+    // Semaphore waits for the next submission of the graph
+    void addWaits(const std::vector<TimelinePoint> &waits);
+    std::vector<TimelinePoint> takeWaits();
+
+  private:
+    friend class CommandPoolManager;
+
+    void initialize(VkDevice device, uint32_t queueFamilyIndex);
+    void cleanup();
+    void begin();
+    void end();
+    void recordDispatch(VkPipeline pipeline, VkPipelineLayout layout, uint32_t n_sets,
+                        const VkDescriptorSet *pDescriptors, VkPipelineBindPoint bindPoint,
+                        uint32_t dim_x, uint32_t dim_y, uint32_t dim_z, const std::vector<BufferAccess> &accesses,
+                        const std::vector<VkBufferMemoryBarrier2> &barriers, const PushConstants &push,
+                        const PushDescriptors &descriptors, SubmitHook onSubmit);
+    void recordCopy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                    const std::vector<BufferAccess> &accesses, const std::vector<VkBufferMemoryBarrier2> &barriers);
+
+    std::mutex m_mutex;
+    VkDevice m_device;
+    uint32_t m_queueFamilyIndex;
+    VkCommandPool m_commandPool{VK_NULL_HANDLE};
+    VkCommandBuffer m_commandBuffer{VK_NULL_HANDLE};
+    uint32_t m_dispatchCount{0};
+    BarrierTracker m_tracker;
+    // One future per replay still pending; the buffer must not be freed before all are ready
+    std::vector<std::shared_future<int>> m_futs;
+    std::vector<TimelinePoint> m_waits;
+    // Hooks of captured dispatches; the graph can be replayed at any time, so they only run
+    // once it is destroyed
+    std::vector<SubmitHook> m_hooks;
 };
 
 class CommandPoolManager
@@ -148,12 +237,38 @@ class CommandPoolManager
     ~CommandPoolManager();
     
     VkCommandPool getCommandPool();
+    // Primary of the oldest recorded epoch not yet handed to the queue, or VK_NULL_HANDLE
     VkCommandBuffer getPrimaryCommandBuffer();
+    // Primaries of every epoch recorded since the last call, oldest first. They are reused
+    // once fut is ready, so fut must cover their submission. The submit hooks of the work in
+    // them are appended to hooks; the caller runs them once the submission is made.
+    std::vector<VkCommandBuffer> takePrimaryCommandBuffers(const std::shared_future<int> &fut,
+                                                           std::vector<SubmitHook> &hooks);
+    // Timeline point signalled by the last submission of this manager's primaries. Epochs
+    // rely on submission order for the barriers between them, so a submission on another
+    // queue must wait on it first.
+    TimelinePoint getLastSubmission();
+    void setLastSubmission(const TimelinePoint &point);
     std::vector<VkCommandBuffer> getSecondaryCommandBuffer();
     VkQueueFamilyProperties getQueueFamilyProperties() const;
     uint32_t getQueueFamilyIndex() const;
+    // accesses describe the buffer ranges the dispatch reads and writes; barriers are already
+    // pending on those buffers (e.g. host uploads) and are emitted ahead of the dispatch.
+    // push is copied and recorded with vkCmdPushConstants before the dispatch; descriptors,
+    // if it has a template, is copied and pushed as set 0 instead of binding pDescriptors.
+    // onSubmit runs once the epoch holding the dispatch has been submitted.
     void submitCompute(VkPipeline pipeline, VkPipelineLayout layout, uint32_t n_sets, const VkDescriptorSet *pDescriptors,
-                VkPipelineBindPoint bindPoint, uint32_t dim_x, uint32_t dim_y, uint32_t dim_z);
+                VkPipelineBindPoint bindPoint, uint32_t dim_x, uint32_t dim_y, uint32_t dim_z,
+                const std::vector<BufferAccess> &accesses = {},
+                const std::vector<VkBufferMemoryBarrier2> &barriers = {}, const PushConstants &push = {},
+                const PushDescriptors &descriptors = {}, SubmitHook onSubmit = {});
+    // Record a multi-region vkCmdCopyBuffer; ordered and synchronized like submitCompute
+    void submitCopy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                    const std::vector<VkBufferMemoryBarrier2> &barriers = {});
+    // Semaphore waits for the next submission, e.g. uploads finishing on another queue
+    void addWaits(const std::vector<TimelinePoint> &waits);
+    std::vector<TimelinePoint> takeWaits();
+    // True once everything handed to submitCompute/submitCopy has been recorded into the primary
     bool is_ready();
     void set_future(const std::shared_future<int> &fut);
     void wait();
@@ -161,38 +276,126 @@ class CommandPoolManager
     // New methods
     void setPromise(std::shared_ptr<std::promise<int>> promise);
     bool waitForReady(std::chrono::duration<int64_t> timeout);
+    // Called, without locks held, each time recording finishes and the manager becomes ready
+    void setReadyCallback(std::function<void()> callback);
+
+    // Capture: while active, submitCompute records into a CommandGraph instead of the
+    // per-submit secondaries. endCapture returns the graph for replay via Device::submit.
+    void beginCapture();
+    std::shared_ptr<CommandGraph> endCapture();
+    bool isCapturing();
 
   private:
+    /**
+     * @brief Secondary command buffers owned by a single recording thread
+     *
+     * Command pools are externally synchronized, so each thread that records into this
+     * manager gets its own pool and only that thread ever touches it. Buffers recorded in
+     * an epoch are parked in `retired` and reused once that epoch's submission completes.
+     */
+    struct ThreadArena
+    {
+        VkCommandPool pool{VK_NULL_HANDLE};
+        std::vector<VkCommandBuffer> allocated;
+        std::vector<VkCommandBuffer> free;
+        std::deque<std::pair<uint64_t, VkCommandBuffer>> retired;
+    };
+
+    // A recorded secondary, the order in which submitCompute was called for it and the
+    // buffer ranges it touches
+    struct RecordedCommand
+    {
+        uint64_t slot;
+        VkCommandBuffer commandBuffer;
+        std::vector<BufferAccess> accesses;
+        std::vector<VkBufferMemoryBarrier2> barriers;
+        SubmitHook onSubmit;
+    };
+
+    // An epoch recorded into its primary and waiting to be handed to the queue
+    struct ClosedEpoch
+    {
+        uint64_t epoch;
+        VkCommandBuffer primary;
+        std::vector<SubmitHook> hooks;
+    };
+
     void initialize(VkDevice device, uint32_t queueIndex);
     void cleanup();
     static void secondaryCommandBufferRecord(VkCommandBuffer commandBuffer, VkPipeline pipeline,
                                              VkPipelineLayout layout, uint32_t n_sets,
                                              const VkDescriptorSet *pDescriptors, VkPipelineBindPoint bindPoint,
-                                             uint32_t dim_x, uint32_t dim_y, uint32_t dim_z);
-    static void primaryCommandBufferRecord(VkCommandBuffer commandBuffer, uint32_t n_cmds,
-                                           const VkCommandBuffer *pCmdBuffers);
-    size_t findAvailableCommandBuffer();
-  
+                                             uint32_t dim_x, uint32_t dim_y, uint32_t dim_z, const PushConstants &push,
+                                             const PushDescriptors &descriptors);
+    static void secondaryCopyRecord(VkCommandBuffer commandBuffer, VkBuffer src, VkBuffer dst,
+                                    const std::vector<VkBufferCopy> &regions);
+    static void beginSecondary(VkCommandBuffer commandBuffer);
+    static void primaryCommandBufferRecord(VkCommandBuffer commandBuffer, const std::vector<RecordedCommand> &recorded,
+                                           BarrierTracker &tracker);
+    // Record on a pool thread into a secondary from that thread's arena
+    void enqueueRecord(std::function<void(VkCommandBuffer)> record, const std::vector<BufferAccess> &accesses,
+                       const std::vector<VkBufferMemoryBarrier2> &barriers, SubmitHook onSubmit = {});
+    ThreadArena &getThreadArena();
+    VkCommandBuffer acquireSecondary(ThreadArena &arena);
+    void finishRecording(RecordedCommand &&recorded);
+    void recordPrimary();
+    void collectRetiredEpochs();
 
-    // Rename mutex and condition variable for clarity
     std::mutex m_mutex;
     std::condition_variable m_cv;
     bool ready;
     VkDevice m_device;
     VkQueueFamilyProperties m_queueFamilyProperties;
     VkCommandPool m_commandPool;
-    VkCommandBuffer m_primaryCommandBuffer;
     uint32_t m_queueFamilyIndex;
-    std::bitset<SECONDARY_BUFFER> used_buffers;
-    std::vector<VkCommandBuffer> m_secondaryCommandBuffers;
-    std::shared_ptr<ThreadPool> m_threadPool;    std::shared_future<int> m_fut;
+    std::shared_ptr<ThreadPool> m_threadPool;
+    std::shared_future<int> m_fut;
     bool m_hasFuture = false;  // Flag to track if future has been set
 
     // Add shared promise for coordination
     std::shared_ptr<std::promise<int>> m_promise;
+
+    // Per-thread arenas, keyed by the recording thread; m_arenaM only guards registration
+    const uint64_t m_id;
+    std::mutex m_arenaM;
+    std::unordered_map<std::thread::id, std::unique_ptr<ThreadArena>> m_arenas;
+
+    // Recording state for the currently open epoch
+    std::atomic<uint64_t> m_nextSlot{0};
+    std::atomic<uint32_t> m_pendingRecords{0};
+    std::vector<RecordedCommand> m_recorded;
+    std::vector<VkCommandBuffer> m_executed;
+
+    // Primaries handed to the queue together and the future of that submission
+    struct InflightEpochs
+    {
+        uint64_t epoch;  // newest epoch among the primaries
+        std::shared_future<int> fut;
+        std::vector<VkCommandBuffer> primaries;
+    };
+
+    // Epoch bookkeeping: m_epoch is the epoch currently being recorded, m_retiredEpoch is
+    // the newest epoch whose submission has finished on the device. Each closed epoch gets
+    // its own primary from a ring that grows with the number of epochs in flight, so
+    // recording never waits for an earlier submission. All guarded by m_mutex.
+    std::atomic<uint64_t> m_epoch{1};
+    std::atomic<uint64_t> m_retiredEpoch{0};
+    std::vector<VkCommandBuffer> m_primaries;
+    std::vector<VkCommandBuffer> m_freePrimaries;
+    std::deque<ClosedEpoch> m_closed;
+    std::deque<InflightEpochs> m_inflight;
+    // Hazards carried from one epoch into the next while earlier epochs may still run
+    BarrierTracker m_tracker;
+    TimelinePoint m_lastSubmission{VK_NULL_HANDLE, 0};
+
+    // Graph being captured, if any
+    std::shared_ptr<CommandGraph> m_capture;
+    // Cross-queue waits for the next submission, guarded by m_mutex
+    std::vector<TimelinePoint> m_waits;
+    std::function<void()> m_onReady;
 };
 
-class QueueManager
+class QueueManager : public std::enable_shared_from_this<QueueManager>
 {
   public:
     static std::shared_ptr<QueueManager> create(VkPhysicalDevice &pDevice, const std::vector<uint32_t> &queue_count);
@@ -205,23 +408,78 @@ class QueueManager
         return m_queueCreateInfos;
     }
 
+    // i-th queue of the sparse-binding family; use bindSparse() rather than binding on it directly
     VkQueue getSparseQueue(uint32_t i = 0) const;
     void start(std::shared_ptr<ThreadPool> , VkPhysicalDevice &pDevice, VkDevice &device);
-    void run(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPoolManagers,
+    std::shared_future<int> run(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPoolManagers,
                                 uint32_t i = 0);
+    std::shared_future<int> run(const std::shared_ptr<CommandGraph> &graph);
     uint32_t getQueueFamilyIndex(VkQueueFlagBits queue_flags) const;
     VkQueueFamilyProperties getQueueFamilyProperties(uint32_t i) const;
+    std::shared_ptr<CommandPoolManager> createCommandPoolManager(VkQueueFlagBits queue_flags);
+    // Family with the requested capability and as few other capabilities as possible, so
+    // transfers land on a DMA-only family when the device exposes one
+    uint32_t getDedicatedQueueFamilyIndex(VkQueueFlagBits queue_flags) const;
+    // Submit one primary right away, bypassing the coalescing thread; signalled receives
+    // the timeline point later submissions can wait on
+    std::shared_future<int> submitDirect(uint32_t queueFamilyIndex, VkCommandBuffer commandBuffer,
+                                         const std::vector<TimelinePoint> &waits, TimelinePoint &signalled);
+    // vkQueueBindSparse on a sparse-binding queue, ordered with the rest of the work through
+    // the queue's timeline; signalled receives the point that later submissions wait on
+    std::shared_future<int> bindSparse(VkBuffer buffer, const std::vector<VkSparseMemoryBind> &binds,
+                                       const std::vector<TimelinePoint> &waits, TimelinePoint &signalled);
+    // Coalescing window for the submission thread; a batch is flushed once max_count items
+    // are pending or window has elapsed since the first one arrived.
+    void setSubmitBatchWindow(uint32_t max_count, std::chrono::microseconds window);
+    // Block until everything handed to run() or submitDirect() so far has executed
+    void waitIdle();
 
   private:
-    static void submitQueue(VkFence fence, VkQueue queue, uint32_t n_cmds, const VkCommandBuffer *pCmdBuffers,
-        const VkPipelineStageFlags *pWaitDstStageMask = nullptr,
-        uint32_t n_wait_semaphores = 0, 
-        const VkSemaphore* wait_semaphore = nullptr,
-        uint32_t n_signal_semaphores = 0, 
-        const VkSemaphore* signal_semaphores = nullptr);
+    // Work handed to the submission thread by run()
+    struct SubmitWork
+    {
+        std::vector<std::shared_ptr<CommandPoolManager>> cmdPools;
+        std::shared_ptr<CommandGraph> graph;
+        std::shared_ptr<std::promise<int>> promise;
+        std::shared_future<int> future;
+        uint32_t queueFamilyIndex;
+        std::vector<TimelinePoint> waits;
+    };
+
+    // A submission whose timeline value has not been observed yet
+    struct PendingCompletion
+    {
+        VkSemaphore semaphore;
+        uint64_t value;
+        std::shared_ptr<std::promise<int>> promise;
+    };
+
+    static void submitQueue(VkQueue queue, uint32_t n_submits, const VkSubmitInfo2 *pSubmits);
+    static VkSemaphore createTimelineSemaphore(VkDevice device);
     // Initialize queue families
     bool initialize(VkPhysicalDevice& pDevice, const std::vector<uint32_t> &queue_count);
     void cleanup();
+
+    // Completion watcher: a single thread blocks on every outstanding timeline value at once
+    // and fulfils the matching promises as values retire.
+    void trackCompletion(std::vector<PendingCompletion> &&completions);
+    void wakeCompletionThread();
+    void completionLoop();
+    void retireCompleted();
+    void failPending(VkResult result);
+    // Work accepted by run()/submitDirect() that is not yet in m_pending
+    void beginSubmits(size_t count);
+    void finishSubmits(size_t count);
+
+    // Submission thread: drains m_cmdPoolQueue in batches and issues one vkQueueSubmit2 per family.
+    // Work whose pools are still recording is moved to deferred and retried once a pool
+    // reports ready; later work sharing one of those pools is deferred with it.
+    void submitLoop();
+    void submitBatch(std::vector<SubmitWork> &batch, std::vector<SubmitWork> &deferred);
+    void wakeSubmitThread();
+    bool acquireQueue(uint32_t queueFamilyIndex, uint32_t &queuePacketindex);
+    void releaseQueue(uint32_t queuePacketindex);
+
     std::vector<VkDeviceQueueCreateInfo> m_queueCreateInfos;
     std::vector<VkQueueFamilyProperties> m_queueFamilies; 
 
@@ -232,8 +490,24 @@ class QueueManager
 
     std::mutex m_workPoolM;
     std::condition_variable m_workPoolC;
-    std::queue<std::pair<std::vector<std::shared_ptr<CommandPoolManager>>, 
-                         std::shared_ptr<std::promise<int>>>> m_cmdPoolQueue;
+    std::queue<SubmitWork> m_cmdPoolQueue;
+    std::thread m_submitThread;
+    uint32_t m_batchMaxCount;
+    std::chrono::microseconds m_batchWindow;
+    bool m_submitStopping{false};
+    // Set when a command pool finishes recording, so deferred work is retried
+    bool m_poolReady{false};
+
+    std::mutex m_completionM;
+    std::condition_variable m_completionC;
+    std::vector<PendingCompletion> m_pending;
+    size_t m_unsubmitted{0};
+    std::condition_variable m_idleC;
+    std::thread m_completionThread;
+    // Host-signalled timeline used to interrupt vkWaitSemaphores when new work is tracked
+    VkSemaphore m_wakeSemaphore{VK_NULL_HANDLE};
+    uint64_t m_wakeValue{0};
+    bool m_stopping{false};
 
     //std::unordered_multimap<VkQueueFlagBits, QueuePacket> m_queuePackets;
     VkDevice m_device{VK_NULL_HANDLE};
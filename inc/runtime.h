@@ -81,8 +81,11 @@ namespace runtime {
         VkInstance getInstance() const { return m_instance; }
         std::shared_ptr<Buffer> createDeviceBuffer(size_t size, uint32_t device_id);
         std::shared_ptr<Buffer> createHostBuffer(size_t size, uint32_t device_id);
-        void copyData(std::shared_ptr<Buffer> src, std::shared_ptr<Buffer> dst, size_t size);
-        void copyData(void *src, std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset, size_t src_offset);
+        // Zero-copy where the device supports it; see Device::importHostBuffer
+        std::shared_ptr<Buffer> importHostBuffer(void *ptr, size_t size, uint32_t device_id);
+        std::shared_future<int> copyData(std::shared_ptr<Buffer> src, std::shared_ptr<Buffer> dst, size_t size);
+        std::shared_future<int> copyData(void *src, std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset,
+                                         size_t src_offset);
         void copyData(std::shared_ptr<Buffer> src, void *dst, size_t size, size_t dst_offset, size_t src_offset);
         std::shared_ptr<Program> createProgram(std::shared_ptr<Device> &device,
                                                const std::vector<uint32_t> &shader_code);
@@ -0,0 +1,77 @@
+#ifndef SPECIALIZATION_H
+#define SPECIALIZATION_H
+
+#ifndef VOLK_HH
+#define VOLK_HH
+#define VK_NO_PROTOTYPES
+#include <volk.h>
+#endif // VOLK_HH
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <type_traits>
+
+namespace runtime
+{
+
+/**
+ * @brief Values for a shader's specialization constants
+ *
+ * Constants are addressed by SpecId (constant_id in GLSL) or by name as recorded in the
+ * module. Names are resolved through reflection when the pipeline is built, which needs
+ * the module to keep its debug names. Constants left unset keep the shader's default.
+ * Every value is 32 bits wide: int, uint, float or bool (stored as VkBool32).
+ */
+class Specialization
+{
+  public:
+    template <typename T> Specialization &set(uint32_t id, T value)
+    {
+        m_ids[id] = toWord(value);
+        return *this;
+    }
+    template <typename T> Specialization &set(const std::string &name, T value)
+    {
+        m_names[name] = toWord(value);
+        return *this;
+    }
+
+    bool empty() const { return m_ids.empty() && m_names.empty(); }
+    const std::map<uint32_t, uint32_t> &getIds() const { return m_ids; }
+    const std::map<std::string, uint32_t> &getNames() const { return m_names; }
+
+    bool operator==(const Specialization &other) const = default;
+
+  private:
+    template <typename T> static uint32_t toWord(T value)
+    {
+        if constexpr (std::is_same_v<T, bool>)
+            return value ? VK_TRUE : VK_FALSE;
+        else
+        {
+            static_assert(sizeof(T) == sizeof(uint32_t) && std::is_trivially_copyable_v<T>,
+                          "specialization constants must be 32-bit scalars");
+            uint32_t word;
+            std::memcpy(&word, &value, sizeof(word));
+            return word;
+        }
+    }
+
+    std::map<uint32_t, uint32_t> m_ids;
+    std::map<std::string, uint32_t> m_names;
+};
+
+// How a Program's buffers reach the shader
+enum class BindingMode
+{
+    // Descriptor sets allocated with the Program and rewritten by Arg/bind
+    DescriptorSets,
+    // Set 0 recorded into each dispatch with VK_KHR_push_descriptor; no sets are allocated
+    PushDescriptors,
+};
+
+} // namespace runtime
+
+#endif // SPECIALIZATION_H
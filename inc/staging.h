@@ -0,0 +1,80 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+
+#include "storage.h"
+
+namespace runtime
+{
+
+/**
+ * @brief Persistently mapped host buffer that sub-allocates staging regions in FIFO order
+ *
+ * Uploads and readbacks take a region with acquire(), record their copy and hand the
+ * submission's future back through release(). A region is reused once that future is
+ * ready, so steady-state transfers never allocate device memory.
+ */
+class StagingRing
+{
+  public:
+    struct Region
+    {
+        VkBuffer buffer;
+        VkDeviceSize offset;
+        VkDeviceSize size;
+        void *ptr;
+        uint64_t id;
+    };
+
+    static std::shared_ptr<StagingRing> create(MemoryManager *memory_manager, VkDeviceSize capacity);
+
+    StagingRing(MemoryManager *memory_manager, VkDeviceSize capacity);
+    ~StagingRing();
+
+    // Blocks until size bytes are free; size must not exceed capacity()
+    Region acquire(VkDeviceSize size);
+    // The region is recycled once fut is ready; an invalid future recycles it immediately
+    void release(const Region &region, std::shared_future<int> fut = {});
+
+    // Make host writes visible to the device, or device writes visible to the host
+    void flush(const Region &region);
+    void invalidate(const Region &region);
+
+    // The requested capacity rounded up to the region alignment
+    VkDeviceSize capacity() const;
+
+  private:
+    struct Inflight
+    {
+        uint64_t id;
+        VkDeviceSize consumed;
+        std::shared_future<int> fut;
+        bool released;
+    };
+
+    bool initialize();
+    void cleanup();
+    // Pops completed regions off the front; called with m_mutex held
+    void reclaim();
+
+    MemoryManager *m_memory_manager;
+    VkBuffer m_buffer{VK_NULL_HANDLE};
+    VmaAllocation m_allocation{VK_NULL_HANDLE};
+    VmaAllocationInfo m_allocation_info{};
+    VkDeviceSize m_capacity;
+    VkDeviceSize m_head{0};
+    VkDeviceSize m_used{0};
+    uint64_t m_nextId{1};
+    std::deque<Inflight> m_inflight;
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+};
+
+} // namespace runtime
+
+#endif // STAGING_H
@@ -25,21 +25,35 @@
 
 #endif // VMA_HH
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include "logging.h" // Ensure LOG_ERROR macro is available
+#include "barrier.h"
 
 namespace runtime
 {
 class Buffer;
 class SparseBuffer;
 class BufferView;
+class ChunkedBuffer;
+class HostBuffer;
+class AddressTable;
 class Image;
 class SparseImage;
 class ImageView;
 
 class QueueManager;
+class StagingRing;
+class BufferPool;
+class TransferEngine;
+class MemoryBudget;
     
     typedef struct buffer_memory
     {
@@ -53,22 +67,39 @@ class QueueManager;
 	class MemoryManager
 	{
       public:
+        // With buffer_device_address every storage and uniform buffer gets a device address
         static std::shared_ptr<MemoryManager> create(std::shared_ptr<QueueManager> &queue_manager,
                                                      VkPhysicalDevice &pDevice, VkDevice &device,
-                                                     size_t max_allocation_size);
+                                                     size_t max_allocation_size, bool buffer_device_address = false);
 
-        void buildBuffer(VkBufferCreateInfo &bufferInfo, VmaAllocationCreateInfo &allocInfo, VkBuffer &buffer,
+        // Returns false, leaving buffer null, if the memory budget rejects the request or
+        // the allocation fails
+        bool buildBuffer(VkBufferCreateInfo &bufferInfo, VmaAllocationCreateInfo &allocInfo, VkBuffer &buffer,
                          VmaAllocation &allocation, VmaAllocationInfo &allocationInfo);
+        // No-ops for buffers without a VMA allocation, which are host-coherent
         void flushMemory(VmaAllocation &allocation, VkDeviceSize size, VkDeviceSize offset);
+        void invalidateMemory(VmaAllocation &allocation, VkDeviceSize size, VkDeviceSize offset);
         void mapMemory(VkBuffer& buffer, VmaAllocation& allocation, void** mappedData);
         void unmapMemory(VmaAllocation &buffer);
         void destroyBuffer(VkBuffer &buffer, VmaAllocation &allocation);
+        // Custom pool for buffers matching bufferInfo/allocInfo, growing in blockSize blocks;
+        // 0 lets VMA pick the block size from the heap size
+        VmaPool createPool(VkBufferCreateInfo &bufferInfo, VmaAllocationCreateInfo &allocInfo, VkDeviceSize blockSize);
+        void destroyPool(VmaPool &pool);
 
         void buildImage(VkImageCreateInfo &imageInfo, VmaAllocationCreateInfo &allocInfo, VkImage &image,
                         VmaAllocation &allocation);
         void destroyImage(VkImage &image, VmaAllocation &allocation);
 
         void copyBuffer(VkCommandBuffer &cmd, VkBuffer &src, VkBuffer &dst, VkDeviceSize size);
+        // Record the regions on the transfer engine and submit them; resources, normally the
+        // Buffers owning src and dst, are held until the copy has executed. signalled, if
+        // given, receives the timeline point of the copy.
+        std::shared_future<int> submitCopy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                                           const std::vector<VkBufferMemoryBarrier2> &barriers = {},
+                                           const std::vector<TimelinePoint> &waits = {},
+                                           std::vector<std::shared_ptr<const void>> resources = {},
+                                           TimelinePoint *signalled = nullptr);
         void copyImage(VkCommandBuffer &cmd, VkImage &src, VkImage &dst, uint32_t width, uint32_t height,
                        uint32_t depth);
 
@@ -79,26 +110,87 @@ class QueueManager;
             uint32_t depth);
 
         MemoryManager(std::shared_ptr<QueueManager> &queue_manager, VkPhysicalDevice &pDevice, VkDevice &device,
-                      size_t max_allocation_size);
+                      size_t max_allocation_size, bool buffer_device_address = false);
 
         void getVmaAllocationInfo(VmaAllocation &allocation, VmaAllocationInfo *allocationInfo) const;
         void getVmaMemoryAllocationProperotys(VmaAllocation &allocation,
                                               VkMemoryPropertyFlags *memoryPropertyFlags) const;
         VkQueue getSparseQueue() const;
+        bool supportsBufferDeviceAddress() const { return m_buffer_device_address; }
+        // 0 unless the buffer was created with VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+        VkDeviceAddress getBufferDeviceAddress(VkBuffer buffer) const;
+
+        // Sparse buffers own no allocation; pages are allocated and bound separately
+        void buildSparseBuffer(VkBufferCreateInfo &bufferInfo, VkBuffer &buffer, VkMemoryRequirements &requirements);
+        void destroySparseBuffer(VkBuffer &buffer);
+        // count device-local pages of requirements.alignment bytes; false if the budget or the
+        // driver refuses them
+        bool allocatePages(const VkMemoryRequirements &requirements, size_t count, VmaAllocation *pages,
+                           VmaAllocationInfo *pageInfos);
+        void freePages(size_t count, const VmaAllocation *pages);
+        std::shared_future<int> bindSparse(VkBuffer buffer, const std::vector<VkSparseMemoryBind> &binds,
+                                           const std::vector<TimelinePoint> &waits, TimelinePoint &signalled);
+
+        // Bind caller-owned host memory to a new buffer through VK_EXT_external_memory_host.
+        // Only host-coherent memory types are used, so the result needs no flushes. Returns
+        // false, leaving buffer and memory null, if the driver cannot import the pointer or the
+        // buffer needs more memory than bufferInfo.size bytes of it.
+        bool importHostMemory(void *ptr, VkBufferCreateInfo &bufferInfo, VkBuffer &buffer, VkDeviceMemory &memory,
+                              VkMemoryPropertyFlags &propertyFlags);
+        void releaseHostMemory(VkBuffer &buffer, VkDeviceMemory &memory);
+
+        // The ring is created on first use; resizing only takes effect before that
+        std::shared_ptr<StagingRing> getStagingRing();
+        std::shared_ptr<TransferEngine> getTransferEngine() const;
+        void setStagingRingSize(VkDeviceSize size);
+        std::shared_ptr<MemoryBudget> getMemoryBudget() const;
+
+        // Incremental defragmentation of the default VMA pools. Runs passes until the time
+        // budget is spent and returns true once VMA reports nothing left to move. Pinned and
+        // host-visible Buffers stay in place; the others are copied once their last submitted use has
+        // finished and pointed at their new VkBuffer. Programs rewrite their descriptors on
+        // the next setup().
+        bool defragment(std::chrono::microseconds budget);
+        // Allocations tagged with an owner may be moved by defragment()
+        void setAllocationOwner(VmaAllocation allocation, Buffer *owner);
 
         ~MemoryManager();
 	private:
         bool initialize(VkPhysicalDevice &pDevice, VkDevice &device,
                         size_t max_allocation_size);
         void cleanup();
+        // Heap that an allocation with these parameters would be placed in
+        uint32_t getHeapIndex(const VkBufferCreateInfo &bufferInfo, const VmaAllocationCreateInfo &allocInfo);
+        // Adds VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT to buffers shaders can bind
+        void addDeviceAddressUsage(VkBufferCreateInfo &bufferInfo) const;
         VmaAllocator m_allocator;
+        bool m_buffer_device_address{false};
         VkDevice m_device;
         VkPhysicalDevice m_physical_device;
         std::shared_ptr<QueueManager> m_queue_manager{nullptr};
 
+        std::shared_ptr<TransferEngine> m_transfer_engine{nullptr};
+        std::mutex m_transfer_mutex;
+
+        std::shared_ptr<StagingRing> m_staging_ring{nullptr};
+        VkDeviceSize m_staging_ring_size;
+
+        std::shared_ptr<MemoryBudget> m_budget{nullptr};
+        // Memory type of each custom pool, for budget checks on pooled allocations
+        std::unordered_map<VmaPool, uint32_t> m_pool_memory_types;
+        std::mutex m_pool_mutex;
+
+        // Guards the defragmentation context and the sources of the current pass; it is not
+        // held while the pass's copies run. Allocations freed meanwhile that are sources of
+        // the pass are released after vmaEndDefragmentationPass.
+        std::mutex m_defrag_mutex;
+        VmaDefragmentationContext m_defrag_context{VK_NULL_HANDLE};
+        bool m_defrag_in_pass{false};
+        std::unordered_set<VmaAllocation> m_defrag_sources;
+        std::vector<std::pair<VkBuffer, VmaAllocation>> m_defrag_deferred;
 	};
 
-    class Buffer
+    class Buffer : public std::enable_shared_from_this<Buffer>
     {
       public:
         static std::shared_ptr<Buffer> create(std::shared_ptr<MemoryManager> &device, size_t size,
@@ -107,7 +199,10 @@ class QueueManager;
 
         Buffer(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage,
                VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags = 1);
-        ~Buffer();
+        // Allocate from a VMA custom pool instead of letting VMA pick the memory type
+        Buffer(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage, VmaPool pool,
+               VmaAllocationCreateFlags flags = 1);
+        virtual ~Buffer();
 
         VkBuffer getBuffer() const;
         VmaAllocation getAllocation() const;
@@ -118,7 +213,8 @@ class QueueManager;
             return dPtr;
         }
 
-        void *getPtr()
+        // Host pointer to the start of this buffer's range
+        virtual void *getPtr()
         {
             void* hHostPtr = nullptr;
             if (m_allocation_info.pMappedData == nullptr)
@@ -140,12 +236,18 @@ class QueueManager;
             return hHostPtr;
         }
 
-        void copyDataFrom(void *src, size_t size, size_t dst_offset = 0, size_t src_offset = 0,
+        // Host-visible memory is written directly; otherwise the data goes through the staging
+        // ring and the returned future is ready once the device-side copy has executed
+        std::shared_future<int> copyDataFrom(void *src, size_t size, size_t dst_offset = 0, size_t src_offset = 0,
                           uint32_t dst_access_flag = VK_ACCESS_SHADER_READ_BIT, uint32_t src_access_flag = VK_ACCESS_HOST_WRITE_BIT);
-        void copyDataFrom(std::shared_ptr<Buffer> src, size_t size, size_t dst_offset = 0, size_t src_offset = 0);
+        // Device-side copies; the future is ready once the copy has executed
+        std::shared_future<int> copyDataFrom(std::shared_ptr<Buffer> src, size_t size, size_t dst_offset = 0,
+                                             size_t src_offset = 0);
         void copyDataTo(void *dst, size_t size, size_t src_offset = 0, size_t dst_offset = 0,
                         uint32_t src_access_flag = VK_ACCESS_SHADER_WRITE_BIT, uint32_t dst_access_flag = VK_ACCESS_HOST_READ_BIT);
-        void copyDataTo(std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset = 0, size_t src_offset = 0);
+        std::shared_future<int> copyDataTo(std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset = 0,
+                                           size_t src_offset = 0);
+        std::shared_future<int> copyDataTo(std::shared_ptr<Buffer> dst, const std::vector<VkBufferCopy> &regions);
         VkMemoryPropertyFlags getMemoryPropertyFlags() const
         {
             return m_memory_property_flags;
@@ -161,33 +263,245 @@ class QueueManager;
             return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
         }
 
+        // Barriers produced by host-side copies that the next command buffer using this
+        // buffer must emit; ownership of the list passes to the caller, which records them on
+        // the compute family. From then on staged uploads stay on that family too.
+        std::vector<VkBufferMemoryBarrier2> takePendingBarriers();
+        // Timeline points of uploads, sparse binds and moves that may still be running on
+        // another queue. They stay in place so every submission touching the buffer waits on
+        // them, whichever queue it goes to; only the newest point per timeline is kept.
+        std::vector<TimelinePoint> getPendingWaits();
+
+        // Work recorded against the buffer but not yet submitted, or captured in a graph, pins
+        // it so defragmentation leaves it in place. pin() waits for a move in progress, so the
+        // handle and offsets read after it stay valid until unpin(), which takes the timeline
+        // point of the submission that carried the work; a later move waits on it.
+        void pin();
+        void unpin(const TimelinePoint &point);
+
+        // Offset of this buffer's range inside the VkBuffer; non-zero only for views
+        VkDeviceSize getOffset() const
+        {
+            return m_offset;
+        }
+
+        // Address of the start of this buffer's range for buffer_reference access from
+        // shaders; 0 if the device lacks bufferDeviceAddress. Changes with getGeneration().
+        VkDeviceAddress getDeviceAddress() const;
+
+        // Bumped whenever defragmentation moves the buffer to a new VkBuffer; descriptors
+        // written before that must be rewritten
+        uint64_t getGeneration() const
+        {
+            return m_generation.load();
+        }
+
       protected:
+        friend class BufferPool;
+        friend class BufferView;
+        friend class SparseBuffer;
+        friend class HostBuffer;
+        friend class MemoryManager;
+        // Wraps storage owned by another Buffer; used by BufferView
+        Buffer(std::shared_ptr<MemoryManager> &mem_mamanger);
         virtual void initialize(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage,
                                 VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags = 1);
         virtual void cleanup();
+        // Starts a move if the buffer is movable and unpinned; uses receives the points the
+        // defragmentation copy has to wait on. Ended by relocate() or cancelMove().
+        bool beginMove(std::vector<TimelinePoint> &uses);
+        void cancelMove();
+        // Defragmentation has bound the allocation to buffer, written by a copy that signals
+        // copied; the old VkBuffer is destroyed by the caller
+        void relocate(VkBuffer buffer, const TimelinePoint &copied);
+        // Only device-only buffers that own their storage, can be copied, have no views and are
+        // not waiting for an ownership transfer from the DMA family may be moved; host-visible
+        // ones are skipped since callers may hold getPtr(). m_use_mutex held
+        bool isMovable() const;
+        // Queue synchronization for the next use; both lock m_use_mutex of m_sync
+        void addPendingBarriers(const std::vector<VkBufferMemoryBarrier2> &barriers);
+        void addPendingWait(const TimelinePoint &point);
         VkBuffer m_buffer{VK_NULL_HANDLE};
         VmaAllocation m_allocation{VK_NULL_HANDLE};
         VmaAllocationInfo m_allocation_info{};
+        VmaPool m_pool{VK_NULL_HANDLE};
+        VkDeviceSize m_offset{0};
         VkMemoryPropertyFlags m_memory_property_flags{0};
         VkDescriptorBufferInfo m_write_descriptor_set{};
         std::shared_ptr<MemoryManager> &m_memory_manager;
-        std::vector<VkBufferMemoryBarrier> m_buffer_memory_barriers;
+        // Guarded by m_use_mutex of m_sync
+        std::vector<VkBufferMemoryBarrier2> m_buffer_memory_barriers;
+        std::vector<TimelinePoint> m_pending_waits;
+        // Holder of the pending barriers and waits: the buffer itself, or a view's parent so
+        // that every view of one VkBuffer sees the same synchronization state
+        Buffer *m_sync{this};
+        VkBufferUsageFlags m_usage{0};
+        VkDeviceSize m_size{0};
+        std::atomic<uint64_t> m_generation{0};
+        // Live views sharing this buffer's VkBuffer handle; they pin it in place
+        std::atomic<uint32_t> m_views{0};
+        // Set once the compute family has used the buffer; only read through m_sync
+        std::atomic<bool> m_compute_owned{false};
+        // Defragmentation state of the storage owner, only used through m_sync
+        std::mutex m_use_mutex;
+        std::condition_variable m_moved;
+        uint32_t m_pins{0};
+        bool m_moving{false};
+        // Newest submitted use per timeline semaphore
+        std::vector<TimelinePoint> m_last_use;
     };
 
+    /**
+     * @brief A range inside a parent Buffer that can be bound and copied like a Buffer
+     *
+     * The view shares the parent's VkBuffer and allocation and keeps the parent alive. Its
+     * descriptor info carries the range's offset, so dispatches that bind it are tracked
+     * for hazards on that range only. Offsets passed to the copy functions are relative to
+     * the start of the view.
+     */
+    class BufferView : public Buffer
+    {
+      public:
+        // offset must respect minStorageBufferOffsetAlignment if the view is bound to a shader
+        static std::shared_ptr<BufferView> create(std::shared_ptr<Buffer> parent, VkDeviceSize offset,
+                                                  VkDeviceSize range);
+        BufferView(std::shared_ptr<Buffer> parent, VkDeviceSize offset, VkDeviceSize range);
+        ~BufferView() override;
+
+        void *getPtr() override;
+
+        std::shared_ptr<Buffer> getParent() const;
+
+      private:
+        void cleanup() override;
+        std::shared_ptr<Buffer> m_parent;
+    };
+
+    /**
+     * @brief Buffer whose range is backed page by page through vkQueueBindSparse
+     *
+     * The VkBuffer is created with no memory. commit() allocates device-local pages from VMA
+     * and binds them on the sparse-binding queue; the bind's timeline point becomes a pending
+     * wait, so the next copy or dispatch touching the buffer runs after it. Without
+     * sparseResidencyBuffer the whole range is committed at creation and stays resident.
+     */
     class SparseBuffer : public Buffer
     {
       public:
+        // resident_on_demand needs sparseResidencyBuffer; pages are then committed explicitly
         static std::shared_ptr<SparseBuffer> create(std::shared_ptr<MemoryManager> &device, size_t size,
-                                                    VkBufferUsageFlags usage, VmaMemoryUsage memory_usage,
-                                                    VmaAllocationCreateFlags flags = 1);
+                                                    VkBufferUsageFlags usage, bool resident_on_demand = false);
         SparseBuffer(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage,
-                     VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags = 1);
+                     bool resident_on_demand = false);
+        ~SparseBuffer() override;
+
+        // Back every page overlapping [offset, offset + size) with device memory
+        std::shared_future<int> commit(VkDeviceSize offset, VkDeviceSize size);
+        // Unbind and free those pages; the device must no longer be using them
+        void decommit(VkDeviceSize offset, VkDeviceSize size);
+        bool isCommitted(VkDeviceSize offset, VkDeviceSize size) const;
+
+        VkDeviceSize getPageSize() const;
+        VkDeviceSize getCommittedBytes() const;
 
       private:
-        void initialize(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage,
-                        VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags = 1) override;
+        void initialize(size_t size, VkBufferUsageFlags usage);
         void cleanup() override;
-        VkQueue m_queue;
+        std::pair<size_t, size_t> pageRange(VkDeviceSize offset, VkDeviceSize size) const;
+
+        bool m_resident_on_demand;
+        VkMemoryRequirements m_requirements{};
+        std::vector<VmaAllocation> m_pages;
+        size_t m_committed{0};
+        std::shared_future<int> m_last_bind;
+        mutable std::mutex m_mutex;
+    };
+
+    /**
+     * @brief Buffer over caller-owned host memory imported with VK_EXT_external_memory_host
+     *
+     * Nothing is copied: the device reads and writes the caller's pages directly, and
+     * getPtr() returns the caller's pointer. The memory must stay valid, and an mmap must
+     * stay mapped, for as long as the buffer or any work using it is alive.
+     */
+    class HostBuffer : public Buffer
+    {
+      public:
+        // ptr and size must be multiples of minImportedHostPointerAlignment
+        static std::shared_ptr<HostBuffer> create(std::shared_ptr<MemoryManager> &mem_mamanger, void *ptr,
+                                                  size_t size, VkBufferUsageFlags usage);
+        HostBuffer(std::shared_ptr<MemoryManager> &mem_mamanger, void *ptr, size_t size, VkBufferUsageFlags usage);
+        ~HostBuffer() override;
+
+        void *getPtr() override;
+
+      private:
+        void initialize(void *ptr, size_t size, VkBufferUsageFlags usage);
+        void cleanup() override;
+
+        void *m_host_ptr{nullptr};
+        VkDeviceMemory m_memory{VK_NULL_HANDLE};
+    };
+
+    /**
+     * @brief One logical tensor split across several Buffers of at most chunk size bytes
+     *
+     * A single descriptor can address at most maxStorageBufferRange bytes, so tensors above
+     * that are stored as consecutive chunks, each its own VkBuffer. Byte offsets passed to the
+     * copy functions are logical; copies crossing a chunk boundary are split. A Program bound
+     * to a ChunkedBuffer dispatches once per chunk (see Program::Arg).
+     */
+    class ChunkedBuffer
+    {
+      public:
+        // Every chunk but the last must hold exactly chunk_size bytes
+        static std::shared_ptr<ChunkedBuffer> create(std::vector<std::shared_ptr<Buffer>> chunks,
+                                                     VkDeviceSize chunk_size, VkDeviceSize size);
+        ChunkedBuffer(std::vector<std::shared_ptr<Buffer>> chunks, VkDeviceSize chunk_size, VkDeviceSize size);
+
+        // The future is ready once every chunk's copy has executed
+        std::shared_future<int> copyDataFrom(void *src, size_t size, size_t dst_offset = 0);
+        void copyDataTo(void *dst, size_t size, size_t src_offset = 0);
+
+        size_t getChunkCount() const;
+        const std::shared_ptr<Buffer> &getChunk(size_t idx) const;
+        // Bytes in a full chunk and in chunk idx; only the last chunk may be shorter
+        VkDeviceSize getChunkSize() const;
+        VkDeviceSize getChunkSize(size_t idx) const;
+        VkDeviceSize getSize() const;
+
+      private:
+        // Calls fn(chunk, offset in chunk, offset in the span, bytes) for each chunk [offset, offset + size) touches
+        template <typename Fn> void forEachSpan(size_t offset, size_t size, Fn &&fn) const;
+
+        std::vector<std::shared_ptr<Buffer>> m_chunks;
+        VkDeviceSize m_chunk_size;
+        VkDeviceSize m_size;
+    };
+
+    /**
+     * @brief Buffer of device addresses, one per referenced Buffer, for buffer_reference shaders
+     *
+     * Lets a shader reach any number of buffers through one 64-bit push constant. Bound with
+     * Program::ArgAddress, every referenced buffer is synchronized along with the table. The
+     * addresses are written once, so the referenced buffers stay pinned, and defragmentation
+     * leaves them in place, for as long as the table exists. Null entries hold address 0.
+     */
+    class AddressTable
+    {
+      public:
+        // table must hold at least 8 bytes per buffer
+        static std::shared_ptr<AddressTable> create(std::shared_ptr<Buffer> table,
+                                                    std::vector<std::shared_ptr<Buffer>> buffers);
+        AddressTable(std::shared_ptr<Buffer> table, std::vector<std::shared_ptr<Buffer>> buffers);
+        ~AddressTable();
+
+        const std::shared_ptr<Buffer> &getTable() const;
+        const std::vector<std::shared_ptr<Buffer>> &getBuffers() const;
+
+      private:
+        std::shared_ptr<Buffer> m_table;
+        std::vector<std::shared_ptr<Buffer>> m_buffers;
     };
 
     
@@ -0,0 +1,98 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "barrier.h"
+
+namespace runtime
+{
+class QueueManager;
+
+/**
+ * @brief Records and submits buffer copies outside the compute command pools
+ *
+ * Uploads go to the family with the fewest capabilities beyond transfer, which on most
+ * discrete GPUs is a DMA-only family that runs concurrently with kernels on the compute
+ * queue. When that family differs from the compute family the copied ranges are released
+ * to compute at the end of the upload; the returned ticket carries the matching acquire
+ * barriers and the timeline point the consuming submission has to wait on.
+ *
+ * Copies that read buffers written by kernels stay on the compute family, which owns them.
+ *
+ * Objects passed as resources are held until the copy has executed, so callers can hand in
+ * the Buffers behind src and dst and drop their own references right away.
+ */
+class TransferEngine
+{
+  public:
+    struct Ticket
+    {
+        std::shared_future<int> fut;
+        TimelinePoint signal;
+        std::vector<VkBufferMemoryBarrier2> acquires;
+    };
+
+    static std::shared_ptr<TransferEngine> create(std::shared_ptr<QueueManager> &queue_manager, VkDevice device);
+
+    TransferEngine(std::shared_ptr<QueueManager> &queue_manager, VkDevice device);
+    ~TransferEngine();
+
+    // Host staging memory into a device buffer, on the transfer family
+    Ticket upload(VkBuffer staging, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                  const std::vector<VkBufferMemoryBarrier2> &barriers = {},
+                  const std::vector<TimelinePoint> &waits = {},
+                  std::vector<std::shared_ptr<const void>> resources = {});
+    // Any other buffer copy, on the compute family
+    Ticket copy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                const std::vector<VkBufferMemoryBarrier2> &barriers = {},
+                const std::vector<TimelinePoint> &waits = {},
+                std::vector<std::shared_ptr<const void>> resources = {});
+
+    uint32_t getTransferQueueFamilyIndex() const;
+    uint32_t getComputeQueueFamilyIndex() const;
+    bool hasDedicatedTransferQueue() const;
+
+  private:
+    // A submitted copy and the objects it keeps alive
+    struct Inflight
+    {
+        VkCommandBuffer commandBuffer;
+        std::shared_future<int> fut;
+        std::vector<std::shared_ptr<const void>> resources;
+    };
+
+    // Command pool and recycled primaries for one queue family
+    struct Lane
+    {
+        uint32_t queueFamilyIndex{UINT32_MAX};
+        VkCommandPool pool{VK_NULL_HANDLE};
+        std::vector<VkCommandBuffer> free;
+        std::deque<Inflight> inflight;
+        std::mutex mutex;
+    };
+
+    bool initialize();
+    void cleanup();
+    void initializeLane(Lane &lane, uint32_t queueFamilyIndex);
+    void cleanupLane(Lane &lane);
+    // Called with lane.mutex held; resources of retired copies are moved to retired so the
+    // caller can drop them after unlocking, as destroying a Buffer takes the allocator's locks
+    VkCommandBuffer beginCommandBuffer(Lane &lane, std::vector<std::shared_ptr<const void>> &retired);
+    Ticket record(Lane &lane, VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                  const std::vector<VkBufferMemoryBarrier2> &barriers, const std::vector<TimelinePoint> &waits,
+                  std::vector<std::shared_ptr<const void>> resources, bool release);
+
+    std::shared_ptr<QueueManager> m_queue_manager;
+    VkDevice m_device;
+    Lane m_transfer;
+    Lane m_compute;
+};
+
+} // namespace runtime
+
+#endif // TRANSFER_H
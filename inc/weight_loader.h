@@ -0,0 +1,81 @@
+#ifndef WEIGHT_LOADER_H
+#define WEIGHT_LOADER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace runtime
+{
+class Buffer;
+class Device;
+
+/**
+ * @brief Memory-mapped safetensors file streamed into device buffers
+ *
+ * The file is mapped read-only and its JSON header parsed once. load() creates one
+ * dedicated working buffer per tensor and splits the tensor data into chunks that a set
+ * of reader threads copy through Buffer::copyDataFrom, i.e. straight into mapped memory
+ * or through the staging ring. Readers fault their chunk in before taking the per-tensor
+ * lock, so disk reads overlap even within one large tensor, and the bytes whose device
+ * copies have not finished are capped so the staging ring is never oversubscribed.
+ */
+class WeightLoader
+{
+  public:
+    struct TensorInfo
+    {
+        std::string dtype;
+        std::vector<int64_t> shape;
+        size_t offset; // from the start of the file
+        size_t size;
+    };
+
+    static std::shared_ptr<WeightLoader> create(const std::string &path);
+
+    WeightLoader(const std::string &path);
+    ~WeightLoader();
+
+    // False if the file could not be mapped or its header is malformed
+    bool isOpen() const;
+    const std::map<std::string, TensorInfo> &getTensors() const;
+    // Tensor bytes inside the mapping; valid while the loader is alive
+    const void *getData(const std::string &name) const;
+
+    void setReaderCount(size_t readers);
+    void setChunkSize(size_t bytes);
+    void setMaxInFlight(size_t bytes);
+
+    // Upload the named tensors, or all of them, and return once every copy has executed.
+    // A tensor whose buffer could not be allocated or whose upload failed maps to nullptr.
+    // Errors outside the copies are rethrown after every reader thread has been joined.
+    std::unordered_map<std::string, std::shared_ptr<Buffer>> load(const std::shared_ptr<Device> &device,
+                                                                  const std::vector<std::string> &names = {});
+
+  private:
+    bool initialize(const std::string &path);
+    void cleanup();
+    bool parseHeader(std::string_view header, size_t dataOffset);
+
+    std::string m_path;
+    const uint8_t *m_data{nullptr};
+    size_t m_size{0};
+#ifdef _WIN32
+    void *m_file{nullptr};
+    void *m_mapping{nullptr};
+#else
+    int m_fd{-1};
+#endif
+    std::map<std::string, TensorInfo> m_tensors;
+    size_t m_readers;
+    size_t m_chunk_size;
+    size_t m_max_in_flight;
+};
+
+} // namespace runtime
+
+#endif // WEIGHT_LOADER_H
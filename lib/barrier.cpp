@@ -0,0 +1,212 @@
+#include "barrier.h"
+
+#include <algorithm>
+
+namespace runtime
+{
+    static constexpr VkAccessFlags2 kWriteAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT |
+                                                       VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+                                                       VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT |
+                                                       VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+    bool BarrierTracker::isWrite(VkAccessFlags2 access)
+    {
+        return (access & kWriteAccessMask) != 0;
+    }
+
+    VkPipelineStageFlags2 BarrierTracker::stageForAccess(VkAccessFlags2 access)
+    {
+        VkPipelineStageFlags2 stage = 0;
+        if (access & (VK_ACCESS_2_HOST_READ_BIT | VK_ACCESS_2_HOST_WRITE_BIT))
+            stage |= VK_PIPELINE_STAGE_2_HOST_BIT;
+        if (access & (VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT))
+            stage |= VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+        if (access & (VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+                      VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_UNIFORM_READ_BIT))
+            stage |= VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        return stage ? stage : VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    }
+
+    bool BarrierTracker::access(const std::vector<BufferAccess> &accesses)
+    {
+        bool needsBarrier = false;
+        for (const auto &a : accesses)
+            needsBarrier |= access(a);
+        return needsBarrier;
+    }
+
+    bool BarrierTracker::access(const BufferAccess &a)
+    {
+        if (a.buffer == VK_NULL_HANDLE || a.size == 0)
+            return false;
+
+        const bool write = isWrite(a.access);
+        const VkDeviceSize begin = a.offset;
+        const VkDeviceSize end = (a.size == VK_WHOLE_SIZE) ? VK_WHOLE_SIZE : a.offset + a.size;
+        bool needsBarrier = false;
+
+        auto &ranges = m_ranges[a.buffer];
+        std::vector<RangeState> updated;
+        updated.reserve(ranges.size() + 2);
+
+        VkDeviceSize cursor = begin;
+        for (const auto &range : ranges)
+        {
+            if (range.end <= begin || range.begin >= end)
+            {
+                updated.push_back(range);
+                continue;
+            }
+
+            // Split off the parts of the old range outside this access
+            if (range.begin < begin)
+                updated.push_back({range.begin, begin, range.writeStage, range.writeAccess, range.readStages,
+                                   range.readAccess});
+
+            // Untouched gap before this range: first access, nothing to wait on
+            if (cursor < range.begin)
+            {
+                updated.push_back({cursor, range.begin, write ? a.stage : VkPipelineStageFlags2(0),
+                                   write ? a.access : VkAccessFlags2(0), write ? VkPipelineStageFlags2(0) : a.stage,
+                                   write ? VkAccessFlags2(0) : a.access});
+            }
+
+            RangeState overlap = range;
+            overlap.begin = std::max(range.begin, begin);
+            overlap.end = std::min(range.end, end);
+
+            if (overlap.writeAccess != 0 && !write && (a.stage & ~overlap.readStages) == 0 &&
+                (a.access & ~overlap.readAccess) == 0)
+            {
+                // An earlier read since the write already waited on it for these stages
+            }
+            else if (overlap.writeAccess != 0)
+            {
+                // Read-after-write or write-after-write; a write also waits for the reads since
+                // the last write, which may have run in other stages
+                const VkPipelineStageFlags2 srcStage = overlap.writeStage | (write ? overlap.readStages : 0);
+                queueBarrier(a.buffer, overlap.begin, overlap.end, srcStage, overlap.writeAccess, a.stage, a.access);
+                needsBarrier = true;
+            }
+            else if (write && overlap.readStages != 0)
+            {
+                // Write-after-read only needs an execution dependency
+                queueBarrier(a.buffer, overlap.begin, overlap.end, overlap.readStages, VK_ACCESS_2_NONE, a.stage,
+                             a.access);
+                needsBarrier = true;
+            }
+
+            if (write)
+            {
+                overlap.writeStage = a.stage;
+                overlap.writeAccess = a.access;
+                overlap.readStages = 0;
+                overlap.readAccess = 0;
+            }
+            else
+            {
+                overlap.readStages |= a.stage;
+                overlap.readAccess |= a.access;
+            }
+            updated.push_back(overlap);
+            cursor = overlap.end;
+
+            if (range.end > end)
+                updated.push_back({end, range.end, range.writeStage, range.writeAccess, range.readStages,
+                                   range.readAccess});
+        }
+
+        if (cursor < end)
+        {
+            updated.push_back({cursor, end, write ? a.stage : VkPipelineStageFlags2(0),
+                               write ? a.access : VkAccessFlags2(0), write ? VkPipelineStageFlags2(0) : a.stage,
+                               write ? VkAccessFlags2(0) : a.access});
+        }
+
+        std::sort(updated.begin(), updated.end(),
+                  [](const RangeState &l, const RangeState &r) { return l.begin < r.begin; });
+        ranges.swap(updated);
+
+        // A barrier merged into one already queued still orders this access
+        return needsBarrier;
+    }
+
+    void BarrierTracker::queueBarrier(VkBuffer buffer, VkDeviceSize begin, VkDeviceSize end,
+                                      VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess,
+                                      VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+    {
+        // Widen an already queued barrier on the same buffer rather than adding another one
+        for (auto &barrier : m_pending)
+        {
+            if (barrier.buffer != buffer || barrier.srcQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED)
+                continue;
+            VkDeviceSize barrierEnd = (barrier.size == VK_WHOLE_SIZE) ? VK_WHOLE_SIZE : barrier.offset + barrier.size;
+            VkDeviceSize newBegin = std::min(barrier.offset, begin);
+            VkDeviceSize newEnd = std::max(barrierEnd, end);
+            barrier.offset = newBegin;
+            barrier.size = (newEnd == VK_WHOLE_SIZE) ? VK_WHOLE_SIZE : newEnd - newBegin;
+            barrier.srcStageMask |= srcStage;
+            barrier.srcAccessMask |= srcAccess;
+            barrier.dstStageMask |= dstStage;
+            barrier.dstAccessMask |= dstAccess;
+            return;
+        }
+
+        VkBufferMemoryBarrier2 barrier = {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2};
+        barrier.pNext = nullptr;
+        barrier.srcStageMask = srcStage;
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstStageMask = dstStage;
+        barrier.dstAccessMask = dstAccess;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.buffer = buffer;
+        barrier.offset = begin;
+        barrier.size = (end == VK_WHOLE_SIZE) ? VK_WHOLE_SIZE : end - begin;
+        m_pending.push_back(barrier);
+    }
+
+    void BarrierTracker::addBarrier(const VkBufferMemoryBarrier2 &barrier)
+    {
+        m_pending.push_back(barrier);
+    }
+
+    bool BarrierTracker::hasPending() const
+    {
+        return !m_pending.empty();
+    }
+
+    bool BarrierTracker::flush(VkCommandBuffer cmd)
+    {
+        if (m_pending.empty())
+            return false;
+
+        VkDependencyInfo dependencyInfo = {VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+        dependencyInfo.pNext = nullptr;
+        dependencyInfo.dependencyFlags = 0;
+        dependencyInfo.memoryBarrierCount = 0;
+        dependencyInfo.pMemoryBarriers = nullptr;
+        dependencyInfo.bufferMemoryBarrierCount = static_cast<uint32_t>(m_pending.size());
+        dependencyInfo.pBufferMemoryBarriers = m_pending.data();
+        dependencyInfo.imageMemoryBarrierCount = 0;
+        dependencyInfo.pImageMemoryBarriers = nullptr;
+        vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+
+        m_pending.clear();
+        return true;
+    }
+
+    std::vector<VkBufferMemoryBarrier2> BarrierTracker::takePending()
+    {
+        std::vector<VkBufferMemoryBarrier2> pending;
+        pending.swap(m_pending);
+        return pending;
+    }
+
+    void BarrierTracker::reset()
+    {
+        m_ranges.clear();
+        m_pending.clear();
+    }
+
+} // namespace runtime
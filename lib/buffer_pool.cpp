@@ -0,0 +1,197 @@
+#include "buffer_pool.h"
+
+#include "config.h"
+#include "error_handling.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace runtime
+{
+
+static constexpr size_t kMinSizeClass = 256;
+
+std::shared_ptr<BufferPool> BufferPool::create(std::shared_ptr<MemoryManager> &memory_manager)
+{
+    return std::make_shared<BufferPool>(memory_manager);
+}
+
+BufferPool::BufferPool(std::shared_ptr<MemoryManager> &memory_manager) : m_memory_manager(memory_manager)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    cleanup();
+}
+
+size_t BufferPool::sizeClass(size_t size)
+{
+    return std::max(kMinSizeClass, std::bit_ceil(size));
+}
+
+bool BufferPool::accepts(size_t size)
+{
+    return size != 0 && size <= BUFFER_POOL_MAX_SIZE;
+}
+
+std::shared_ptr<Buffer> BufferPool::acquire(size_t size, VkBufferUsageFlags usage, VmaAllocationCreateFlags flags)
+{
+    if (!accepts(size))
+        return nullptr;
+
+    // Pools pick one memory type up front; a dedicated allocation would defeat them
+    flags &= ~VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT;
+    const BucketKey key{usage, flags, sizeClass(size)};
+
+    Buffer *buffer = nullptr;
+    VmaPool pool = VK_NULL_HANDLE;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto it = m_free.find(key);
+        if (it != m_free.end() && !it->second.empty())
+        {
+            buffer = it->second.back();
+            it->second.pop_back();
+            m_cachedBytes -= std::get<2>(key);
+            ++m_hits;
+        }
+        else
+        {
+            pool = getPool(usage, flags);
+            ++m_misses;
+        }
+    }
+
+    if (!buffer)
+    {
+        // Allocated unlocked: the memory budget may call trim() to make room
+        buffer = new Buffer(m_memory_manager, std::get<2>(key), usage, pool, flags);
+        if (buffer->getBuffer() == VK_NULL_HANDLE)
+        {
+            delete buffer;
+            return nullptr;
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_outstanding;
+    }
+
+    // Descriptors and barriers only cover what was asked for
+    buffer->m_write_descriptor_set.range = size;
+
+    std::weak_ptr<BufferPool> weak = weak_from_this();
+    return std::shared_ptr<Buffer>(buffer, [weak, key](Buffer *released) {
+        if (auto pool = weak.lock())
+            pool->recycle(released, key);
+        else
+            delete released;
+    });
+}
+
+void BufferPool::recycle(Buffer *buffer, const BucketKey &key)
+{
+    buffer->m_buffer_memory_barriers.clear();
+    buffer->m_pending_waits.clear();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_free[key].push_back(buffer);
+    m_cachedBytes += std::get<2>(key);
+    --m_outstanding;
+}
+
+size_t BufferPool::trim(size_t bytes)
+{
+    std::vector<Buffer *> released;
+    size_t freed = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Largest size classes first, whatever their usage, so few evictions free the most
+        std::vector<std::map<BucketKey, std::vector<Buffer *>>::iterator> buckets;
+        for (auto it = m_free.begin(); it != m_free.end(); ++it)
+        {
+            if (!it->second.empty())
+                buckets.push_back(it);
+        }
+        std::stable_sort(buckets.begin(), buckets.end(),
+                         [](const auto &a, const auto &b) { return std::get<2>(a->first) > std::get<2>(b->first); });
+        for (auto it : buckets)
+        {
+            auto &list = it->second;
+            while (!list.empty() && freed < bytes)
+            {
+                released.push_back(list.back());
+                list.pop_back();
+                freed += std::get<2>(it->first);
+            }
+            if (freed >= bytes)
+                break;
+        }
+        m_cachedBytes -= freed;
+    }
+
+    for (auto *buffer : released)
+        delete buffer;
+    return freed;
+}
+
+size_t BufferPool::getCachedBytes() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_cachedBytes;
+}
+
+size_t BufferPool::getHitCount() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_hits;
+}
+
+size_t BufferPool::getMissCount() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_misses;
+}
+
+VmaPool BufferPool::getPool(VkBufferUsageFlags usage, VmaAllocationCreateFlags flags)
+{
+    auto it = m_pools.find({usage, flags});
+    if (it != m_pools.end())
+        return it->second;
+
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = kMinSizeClass;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.flags = flags;
+    bool mapping_required = flags & (VMA_ALLOCATION_CREATE_MAPPED_BIT |
+                                     VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                                     VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT);
+    allocInfo.usage = mapping_required ? VMA_MEMORY_USAGE_AUTO_PREFER_HOST : VMA_MEMORY_USAGE_AUTO;
+    if (mapping_required && !(flags & (VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                                       VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT)))
+        allocInfo.flags |= VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
+
+    VmaPool pool = m_memory_manager->createPool(bufferInfo, allocInfo, BUFFER_POOL_BLOCK_SIZE);
+    m_pools.emplace(PoolKey{usage, flags}, pool);
+    return pool;
+}
+
+void BufferPool::cleanup()
+{
+    trim();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_outstanding != 0)
+        LOG_ERROR("BufferPool destroyed with %zu buffers still in use", m_outstanding);
+    for (auto &entry : m_pools)
+        m_memory_manager->destroyPool(entry.second);
+    m_pools.clear();
+    m_free.clear();
+}
+
+} // namespace runtime
@@ -4,13 +4,20 @@
 #include "device_features.h"
 #include "queue.h"
 #include "storage.h"
+#include "buffer_pool.h"
+#include "memory_budget.h"
+#include "memory_planner.h"
+#include "config.h"
 #include "program.h"
+#include "pipeline_cache.h"
 
 #ifndef VOLK_HH
 #define VOLK_HH
 #include <volk.h>
 #endif // VOLK_HH
 
+#include <cstdint>
+
 
 namespace runtime
 {
@@ -79,7 +86,7 @@ namespace runtime
     
     Device::Device(std::shared_ptr<ThreadPool> pool, VkInstance instance, VkPhysicalDevice pd,
                    const std::vector<uint32_t> &queue_counts)
-        : m_pool(pool), m_device(VK_NULL_HANDLE), m_pipeline_cache(VK_NULL_HANDLE), m_memory_manager(nullptr),
+        : m_pool(pool), m_device(VK_NULL_HANDLE), m_memory_manager(nullptr),
           m_queue_manager(nullptr), m_descriptorLayoutCache(nullptr), m_descriptorAllocator(nullptr)
     {
         initialize(instance, pd, queue_counts);
@@ -96,13 +103,26 @@ namespace runtime
             LOG_ERROR("Invalid buffer size");
         if (m_memory_manager && size < m_features->getMaxAllocationSize())
         {
-            return Buffer::create(m_memory_manager, size, usage, VMA_MEMORY_USAGE_AUTO, flags);
+            auto buffer = Buffer::create(m_memory_manager, size, usage, VMA_MEMORY_USAGE_AUTO, flags);
+            if (buffer->getBuffer() == VK_NULL_HANDLE)
+            {
+                LOG_ERROR("Failed to allocate buffer of %zu bytes", size);
+                return nullptr;
+            }
+            return buffer;
         }
-        else if (m_memory_manager)
+        else if (m_memory_manager && m_features->supportsSparseBinding())
         {
-            return SparseBuffer::create(m_memory_manager, size, usage, VMA_MEMORY_USAGE_AUTO, flags);
+            // Too large for one allocation: back it page by page, fully resident
+            auto buffer = SparseBuffer::create(m_memory_manager, size, usage);
+            if (buffer->getBuffer() == VK_NULL_HANDLE)
+            {
+                LOG_ERROR("Failed to create sparse buffer of %zu bytes", size);
+                return nullptr;
+            }
+            return buffer;
         }
-        LOG_ERROR("Memory manager is not initialized or size exceeds max allocation size, cannot create buffer");
+        LOG_ERROR("Memory manager is not initialized or size exceeds max allocation size, cannot create buffer; use createChunkedBuffer");
         return nullptr;
     }
 
@@ -119,10 +139,21 @@ namespace runtime
         // Add VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT flag to allow
         // fallback to transfers if memory mapping is not supported
         flags |= VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT;
-        
-        return createBuffer(size, 
-                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
-                           flags);
+
+        const VkBufferUsageFlags usage =
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+        // Temporaries come from the size-class pool; only oversized requests hit vmaCreateBuffer.
+        // A pooled request the budget rejects stays rejected rather than being retried directly.
+        if (!is_dedicated && m_buffer_pool && BufferPool::accepts(size))
+        {
+            auto buffer = m_buffer_pool->acquire(size, usage, flags);
+            if (!buffer)
+                LOG_ERROR("Failed to allocate pooled buffer of %zu bytes", size);
+            return buffer;
+        }
+
+        return createBuffer(size, usage, flags);
     }
 
     std::shared_ptr<Buffer> Device::createSrcTransferBuffer(size_t size, bool is_dedicated)
@@ -145,6 +176,176 @@ namespace runtime
                                 VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT);
     }
 
+    std::shared_ptr<SparseBuffer> Device::createSparseBuffer(size_t size)
+    {
+        if (!m_memory_manager || !m_features->supportsSparseBinding())
+        {
+            LOG_ERROR("Device does not support sparse binding");
+            return nullptr;
+        }
+        const VkBufferUsageFlags usage =
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        auto buffer = SparseBuffer::create(m_memory_manager, size, usage, m_features->supportsSparseResidency());
+        if (buffer->getBuffer() == VK_NULL_HANDLE)
+        {
+            LOG_ERROR("Failed to create sparse buffer of %zu bytes", size);
+            return nullptr;
+        }
+        return buffer;
+    }
+
+    std::shared_ptr<ChunkedBuffer> Device::createChunkedBuffer(size_t size, size_t chunk_size)
+    {
+        if (!size)
+        {
+            LOG_ERROR("Invalid buffer size");
+            return nullptr;
+        }
+        const size_t alignment = std::max<size_t>(16, m_features->getMinStorageBufferOffsetAlignment());
+        size_t limit = m_features->getMaxAllocationSize() - 1;
+        if (m_features->getMaxMemoryAllocationSize())
+            limit = std::min(limit, m_features->getMaxMemoryAllocationSize());
+        limit = limit / alignment * alignment;
+        if (chunk_size == 0 || chunk_size > limit)
+            chunk_size = limit;
+
+        const size_t count = (size + chunk_size - 1) / chunk_size;
+        std::vector<std::shared_ptr<Buffer>> chunks;
+        chunks.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const size_t bytes = i + 1 < count ? chunk_size : size - chunk_size * i;
+            auto chunk = createWorkingBuffer(bytes, true);
+            if (!chunk)
+            {
+                LOG_ERROR("Failed to allocate chunk %zu of %zu for a %zu byte buffer", i, count, size);
+                return nullptr;
+            }
+            chunks.push_back(std::move(chunk));
+        }
+        return ChunkedBuffer::create(std::move(chunks), chunk_size, size);
+    }
+
+    std::shared_ptr<Buffer> Device::importHostBuffer(void *ptr, size_t size)
+    {
+        if (!ptr || !size)
+        {
+            LOG_ERROR("Invalid host buffer");
+            return nullptr;
+        }
+        const size_t alignment = std::max<size_t>(1, m_features->getMinImportedHostPointerAlignment());
+        if (m_memory_manager && m_features->supportsExternalMemoryHost() &&
+            reinterpret_cast<uintptr_t>(ptr) % alignment == 0 && size % alignment == 0)
+        {
+            const VkBufferUsageFlags usage =
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+            auto buffer = HostBuffer::create(m_memory_manager, ptr, size, usage);
+            if (buffer->getBuffer() != VK_NULL_HANDLE)
+                return buffer;
+            LOG_WARNING("Host pointer import failed, copying %zu bytes instead", size);
+        }
+
+        auto buffer = createWorkingBuffer(size, true);
+        if (buffer)
+            buffer->copyDataFrom(ptr, size).wait();
+        return buffer;
+    }
+
+    std::vector<std::shared_ptr<BufferView>> Device::createPackedBuffers(const std::vector<size_t> &sizes)
+    {
+        const size_t alignment = std::max<size_t>(1, m_features->getMinStorageBufferOffsetAlignment());
+        std::vector<size_t> offsets;
+        offsets.reserve(sizes.size());
+        size_t total = 0;
+        for (size_t size : sizes)
+        {
+            offsets.push_back(total);
+            total += (size + alignment - 1) / alignment * alignment;
+        }
+
+        std::vector<std::shared_ptr<BufferView>> views;
+        if (total == 0)
+            return views;
+
+        auto parent = createWorkingBuffer(total);
+        check_condition(parent != nullptr, "Device::createPackedBuffers: allocation failed");
+        views.reserve(sizes.size());
+        for (size_t i = 0; i < sizes.size(); ++i)
+            views.push_back(BufferView::create(parent, offsets[i], sizes[i]));
+        return views;
+    }
+
+    std::vector<std::shared_ptr<BufferView>> Device::createPlannedBuffers(MemoryPlanner &planner)
+    {
+        size_t arena_size = planner.plan(std::max<size_t>(1, m_features->getMinStorageBufferOffsetAlignment()));
+        if (arena_size == 0)
+            return planner.materialize(nullptr);
+
+        auto arena = createWorkingBuffer(arena_size);
+        check_condition(arena != nullptr, "Device::createPlannedBuffers: arena allocation failed");
+        return planner.materialize(arena);
+    }
+
+    std::shared_ptr<AddressTable> Device::createAddressTable(const std::vector<std::shared_ptr<Buffer>> &buffers)
+    {
+        if (!m_features->supportsBufferDeviceAddress())
+        {
+            LOG_ERROR("Address tables need bufferDeviceAddress");
+            return nullptr;
+        }
+        auto table = createWorkingBuffer(std::max<size_t>(1, buffers.size()) * sizeof(VkDeviceAddress));
+        if (!table)
+            return nullptr;
+        return AddressTable::create(table, buffers);
+    }
+
+    std::shared_ptr<MemoryBudget> Device::getMemoryBudget() const
+    {
+        return m_memory_manager ? m_memory_manager->getMemoryBudget() : nullptr;
+    }
+
+    bool Device::defragment(std::chrono::microseconds budget)
+    {
+        return m_memory_manager ? m_memory_manager->defragment(budget) : true;
+    }
+
+    void Device::startDefragmentation()
+    {
+        const std::chrono::microseconds budget(DEFRAG_PASS_BUDGET_US);
+        {
+            std::unique_lock<std::mutex> lock(m_defrag_mutex);
+            if (m_defrag_active)
+                return;
+            m_defrag_active = true;
+            m_defrag_stop = false;
+        }
+
+        m_pool->enqueue([this, budget]() {
+            std::unique_lock<std::mutex> lock(m_defrag_mutex);
+            while (!m_defrag_stop)
+            {
+                lock.unlock();
+                bool done = m_memory_manager->defragment(budget);
+                lock.lock();
+                if (done)
+                    break;
+                // Leave the queues to real work between passes
+                m_defrag_cv.wait_for(lock, std::chrono::milliseconds(DEFRAG_PASS_INTERVAL_MS),
+                                     [this]() { return m_defrag_stop; });
+            }
+            m_defrag_active = false;
+            m_defrag_cv.notify_all();
+        });
+    }
+
+    void Device::stopDefragmentation()
+    {
+        std::unique_lock<std::mutex> lock(m_defrag_mutex);
+        m_defrag_stop = true;
+        m_defrag_cv.notify_all();
+        m_defrag_cv.wait(lock, [this]() { return !m_defrag_active; });
+    }
+
     void Device::copyData(void *src, void *dst, size_t size)
     {
         bool is_src_runtime_managed = m_buffers.find(src) != m_buffers.end();
@@ -155,21 +356,66 @@ namespace runtime
         }
     }
 
+    static BindingMode supportedBindingMode(const DeviceFeatures &features, BindingMode mode)
+    {
+        if (mode == BindingMode::PushDescriptors && !features.supportsPushDescriptors())
+        {
+            LOG_WARNING("VK_KHR_push_descriptor not supported, falling back to descriptor sets");
+            return BindingMode::DescriptorSets;
+        }
+        return mode;
+    }
+
     std::shared_ptr<Program> Device::createProgram(const std::vector<uint32_t> &shader, uint32_t dim_x, uint32_t dim_y,
-                                                   uint32_t dim_z)
+                                                   uint32_t dim_z, const Specialization &specialization,
+                                                   BindingMode mode)
+    {
+        auto pipeline = m_program_cache->getPipeline(shader, specialization, supportedBindingMode(*m_features, mode));
+        return Program::create(m_device, pipeline, m_descriptorAllocator, dim_x, dim_y, dim_z);
+    }
+
+    std::vector<std::shared_future<std::shared_ptr<Program>>> Device::createProgramsAsync(
+        const std::vector<ProgramDesc> &programs)
     {
-        return Program::create(m_device, m_pipeline_cache, m_descriptorLayoutCache, m_descriptorAllocator, shader, dim_x, dim_y, dim_z);
+        std::vector<std::shared_future<std::shared_ptr<Program>>> futures;
+        futures.reserve(programs.size());
+        for (const auto &desc : programs)
+        {
+            auto promise = std::make_shared<std::promise<std::shared_ptr<Program>>>();
+            futures.push_back(promise->get_future().share());
+            // The VkDevice must outlive the task: wait on the futures before destroying the Device
+            m_pool->enqueue([promise, desc, device = m_device, cache = m_program_cache,
+                             allocator = m_descriptorAllocator,
+                             mode = supportedBindingMode(*m_features, desc.mode)]() mutable {
+                try
+                {
+                    auto pipeline = cache->getPipeline(desc.shader, desc.specialization, mode);
+                    promise->set_value(
+                        Program::create(device, pipeline, allocator, desc.dim_x, desc.dim_y, desc.dim_z));
+                }
+                catch (...)
+                {
+                    promise->set_exception(std::current_exception());
+                }
+            });
+        }
+        return futures;
     }
 
     std::shared_ptr<CommandPoolManager> runtime::Device::getComputePoolManager(size_t idx, VkQueueFlagBits flags)
     {
         auto qidx = m_queue_manager->getQueueFamilyIndex(flags);
-        return CommandPoolManager::create(m_pool, m_device, idx, m_queue_manager->getQueueFamilyProperties(qidx));
+        return CommandPoolManager::create(m_pool, m_device, qidx, m_queue_manager->getQueueFamilyProperties(qidx));
     }
 
-    void Device::submit(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPools, uint32_t i)
+    std::shared_future<int> Device::submit(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPools, uint32_t i)
     {
-        m_queue_manager->run(cmdPools, i);
+        return m_queue_manager->run(cmdPools, i);
+    }
+
+    std::shared_future<int> Device::submit(const std::shared_ptr<CommandGraph> &graph)
+    {
+        return m_queue_manager->run(graph);
     }    
        
     bool Device::initialize(VkInstance &instance, VkPhysicalDevice &pd, const std::vector<uint32_t> &queue_counts)
@@ -180,8 +426,9 @@ namespace runtime
         // Create the logical device
         VkDeviceCreateInfo createInfo = {};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-        createInfo.pNext = nullptr;
-        m_features->getFeatures2();
+        check_condition(m_features->supportsTimelineSemaphore(), "device does not support timeline semaphores");
+        check_condition(m_features->supportsSynchronization2(), "device does not support synchronization2");
+        createInfo.pNext = m_features->getEnabledFeatures2();
         auto queueCreateInfos = m_queue_manager->getQueueCreateInfos();
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
@@ -230,11 +477,17 @@ namespace runtime
         check_result(vkCreateDevice(pd, &createInfo, nullptr, &m_device), "error in creating device");
         volkLoadDevice(m_device);
         m_queue_manager->start(m_pool, pd, m_device);
-        VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
-        pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-        vkCreatePipelineCache(m_device, &pipelineCacheCreateInfo, nullptr, &m_pipeline_cache);
+        m_pipeline_cache = PipelineCache::create(m_device, *m_features);
 
-        m_memory_manager = MemoryManager::create(m_queue_manager, pd, m_device, m_features->getMaxAllocationSize());
+        m_memory_manager = MemoryManager::create(m_queue_manager, pd, m_device, m_features->getMaxAllocationSize(),
+                                                 m_features->supportsBufferDeviceAddress());
+        m_buffer_pool = BufferPool::create(m_memory_manager);
+        // Cached pool buffers hold no live data, so they are the first thing to give back
+        std::weak_ptr<BufferPool> weak_pool = m_buffer_pool;
+        getMemoryBudget()->addEvictor([weak_pool](size_t bytes) -> size_t {
+            auto pool = weak_pool.lock();
+            return pool ? pool->trim(bytes) : 0;
+        });
 
         m_descriptorAllocator = DescriptorAllocator::create(m_device, {
                                                                           {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 64},
@@ -243,12 +496,15 @@ namespace runtime
                                                                           {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2},
                                                                       });
         m_descriptorLayoutCache = DescriptorLayoutCache::create(m_device);
+        m_program_cache = ProgramCache::create(m_device, m_pipeline_cache->getHandle(), m_descriptorLayoutCache,
+                                               m_features->getMaxPushDescriptors());
 
         return true;
     }
 
     void Device::cleanup()
     {
+        stopDefragmentation();
         if (m_buffers.size() > 0)
         {
             for (auto &buffer : m_buffers)
@@ -260,17 +516,16 @@ namespace runtime
             }
             m_buffers.clear();
         }
+        m_buffer_pool.reset();
         m_memory_manager.reset();
         m_queue_manager.reset();
 
+        // Cached pipelines reference layouts from the layout cache
+        m_program_cache.reset();
         m_descriptorLayoutCache.reset();
         m_descriptorAllocator.reset();
 
-        if (m_pipeline_cache != VK_NULL_HANDLE)
-        {
-            vkDestroyPipelineCache(m_device, m_pipeline_cache, nullptr);
-            m_pipeline_cache = VK_NULL_HANDLE;
-        }
+        m_pipeline_cache.reset();
 
         if (m_device != VK_NULL_HANDLE)
         {
@@ -6,6 +6,8 @@
 #include <volk.h>
 #endif // VOLK_HH
 
+#include <cstring>
+
 
 namespace runtime {
     DeviceFeatures::DeviceFeatures(VkPhysicalDevice& pd)
@@ -33,9 +35,32 @@ namespace runtime {
         m_properties.device_vulkan11_properties.pNext = &m_properties.device_vulkan12_properties;
         m_properties.device_vulkan12_properties.pNext = &m_properties.device_vulkan13_properties;
         m_properties.device_vulkan13_properties.pNext = &m_properties.subgroup_properties;
+        void **next = &m_properties.subgroup_properties.pNext;
+        if (supportsExternalMemoryHost())
+        {
+            *next = &m_properties.external_memory_host_properties;
+            next = &m_properties.external_memory_host_properties.pNext;
+        }
+        if (supportsPushDescriptors())
+            *next = &m_properties.push_descriptor_properties;
         vkGetPhysicalDeviceProperties2(pd, &m_properties.device_properties_2);
     }
 
+    VkPhysicalDeviceFeatures2 *DeviceFeatures::getEnabledFeatures2() noexcept
+    {
+        m_enabled_features.features2.pNext = &m_enabled_features.features11;
+        m_enabled_features.features11.pNext = &m_enabled_features.features12;
+        m_enabled_features.features12.pNext = &m_enabled_features.features13;
+        m_enabled_features.features13.pNext = nullptr;
+
+        m_enabled_features.features12.timelineSemaphore = m_features.features12.timelineSemaphore;
+        m_enabled_features.features12.bufferDeviceAddress = supportsBufferDeviceAddress();
+        m_enabled_features.features13.synchronization2 = m_features.features13.synchronization2;
+        m_enabled_features.features2.features.sparseBinding = supportsSparseBinding();
+        m_enabled_features.features2.features.sparseResidencyBuffer = supportsSparseResidency();
+        return &m_enabled_features.features2;
+    }
+
     std::vector<std::string> DeviceFeatures::getDeviceCapabilities() const
     {
         std::vector<std::string> capabilities;
@@ -204,6 +229,51 @@ namespace runtime {
         return m_properties.device_properties_2.properties.limits.maxStorageBufferRange;
     }
 
+    size_t DeviceFeatures::getMaxMemoryAllocationSize() const noexcept
+    {
+        return m_properties.device_vulkan11_properties.maxMemoryAllocationSize;
+    }
+
+    bool DeviceFeatures::supportsExtension(const char *name) const noexcept
+    {
+        for (const auto &extension : m_extensions)
+        {
+            if (strcmp(extension.extensionName, name) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool DeviceFeatures::supportsExternalMemoryHost() const noexcept
+    {
+        return supportsExtension(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+    }
+
+    size_t DeviceFeatures::getMinImportedHostPointerAlignment() const noexcept
+    {
+        return m_properties.external_memory_host_properties.minImportedHostPointerAlignment;
+    }
+
+    bool DeviceFeatures::supportsBufferDeviceAddress() const noexcept
+    {
+        return m_features.features12.bufferDeviceAddress;
+    }
+
+    bool DeviceFeatures::supportsPushDescriptors() const noexcept
+    {
+        return supportsExtension(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    }
+
+    uint32_t DeviceFeatures::getMaxPushDescriptors() const noexcept
+    {
+        return m_properties.push_descriptor_properties.maxPushDescriptors;
+    }
+
+    size_t DeviceFeatures::getMinStorageBufferOffsetAlignment() const noexcept
+    {
+        return m_properties.device_properties_2.properties.limits.minStorageBufferOffsetAlignment;
+    }
+
     size_t DeviceFeatures::getSparseAllocationSize() const noexcept
     {
         return m_properties.device_properties_2.properties.limits.sparseAddressSpaceSize;
@@ -211,17 +281,27 @@ namespace runtime {
 
     bool DeviceFeatures::supportsSparseBinding() const noexcept
     {
-        return m_features.coo_matrix_features.cooperativeMatrix;
+        return m_features.features2.features.sparseBinding;
     }
 
     bool DeviceFeatures::supportsSparseResidency() const noexcept
     {
-        return false;
+        return m_features.features2.features.sparseBinding && m_features.features2.features.sparseResidencyBuffer;
     }
 
     bool DeviceFeatures::supportsSparseResidencyAliased() const noexcept
     {
-        return false;
+        return supportsSparseResidency() && m_features.features2.features.sparseResidencyAliased;
+    }
+
+    bool DeviceFeatures::supportsTimelineSemaphore() const noexcept
+    {
+        return m_features.features12.timelineSemaphore;
+    }
+
+    bool DeviceFeatures::supportsSynchronization2() const noexcept
+    {
+        return m_features.features13.synchronization2;
     }
 
     std::string DeviceFeatures::getDeviceName() const
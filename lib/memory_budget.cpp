@@ -0,0 +1,154 @@
+#include "memory_budget.h"
+
+#include "config.h"
+#include "error_handling.h"
+
+#include <algorithm>
+
+namespace runtime
+{
+
+std::shared_ptr<MemoryBudget> MemoryBudget::create(VmaAllocator allocator, float watermark)
+{
+    return std::make_shared<MemoryBudget>(allocator, watermark);
+}
+
+MemoryBudget::MemoryBudget(VmaAllocator allocator, float watermark)
+    : m_allocator(allocator), m_watermark(watermark),
+      m_wait_timeout(std::chrono::milliseconds(MEMORY_BUDGET_WAIT_MS))
+{
+    vmaGetMemoryProperties(m_allocator, &m_memory_properties);
+    setWatermark(watermark);
+}
+
+std::vector<MemoryBudget::HeapUsage> MemoryBudget::getHeapUsage() const
+{
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS] = {};
+    vmaGetHeapBudgets(m_allocator, budgets);
+
+    std::vector<HeapUsage> heaps;
+    heaps.reserve(m_memory_properties->memoryHeapCount);
+    for (uint32_t i = 0; i < m_memory_properties->memoryHeapCount; ++i)
+    {
+        bool deviceLocal = m_memory_properties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+        heaps.push_back({budgets[i].usage, budgets[i].budget, budgets[i].statistics.blockBytes, deviceLocal});
+    }
+    return heaps;
+}
+
+MemoryBudget::HeapUsage MemoryBudget::getHeapUsage(uint32_t heapIndex) const
+{
+    check_condition(heapIndex < m_memory_properties->memoryHeapCount, "MemoryBudget: heap index out of range");
+    return getHeapUsage()[heapIndex];
+}
+
+void MemoryBudget::setWatermark(float watermark)
+{
+    if (watermark <= 0.0f || watermark > 1.0f)
+    {
+        LOG_WARNING("Memory budget watermark %f out of range, clamping to (0, 1]", watermark);
+        watermark = std::clamp(watermark, 0.01f, 1.0f);
+    }
+    m_watermark = watermark;
+}
+
+float MemoryBudget::getWatermark() const
+{
+    return m_watermark;
+}
+
+void MemoryBudget::setWaitTimeout(std::chrono::milliseconds timeout)
+{
+    m_wait_timeout = timeout;
+}
+
+size_t MemoryBudget::addEvictor(Evictor evictor)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_evictors.emplace_back(m_next_evictor, std::move(evictor));
+    return m_next_evictor++;
+}
+
+void MemoryBudget::removeEvictor(size_t id)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::erase_if(m_evictors, [id](const auto &entry) { return entry.first == id; });
+}
+
+bool MemoryBudget::fits(uint32_t heapIndex, VkDeviceSize size) const
+{
+    HeapUsage heap = getHeapUsage(heapIndex);
+    const auto limit = static_cast<VkDeviceSize>(static_cast<double>(heap.budget) * m_watermark.load());
+    return heap.usage + size <= limit;
+}
+
+void MemoryBudget::refresh()
+{
+    vmaSetCurrentFrameIndex(m_allocator, ++m_frame);
+}
+
+size_t MemoryBudget::evict(size_t bytes)
+{
+    // Evictors free memory, which ends in notify(); they must run without m_mutex held
+    std::vector<Evictor> evictors;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (const auto &entry : m_evictors)
+            evictors.push_back(entry.second);
+    }
+
+    size_t freed = 0;
+    for (auto &evictor : evictors)
+    {
+        if (freed >= bytes)
+            break;
+        freed += evictor(bytes - freed);
+    }
+    return freed;
+}
+
+bool MemoryBudget::reserve(uint32_t heapIndex, VkDeviceSize size)
+{
+    if (fits(heapIndex, size))
+        return true;
+
+    // VMA only re-queries the driver every few allocations; make sure the rejection is real
+    refresh();
+    if (fits(heapIndex, size))
+        return true;
+
+    HeapUsage heap = getHeapUsage(heapIndex);
+    const auto limit = static_cast<VkDeviceSize>(static_cast<double>(heap.budget) * m_watermark.load());
+    size_t freed = evict(heap.usage + size - std::min(limit, heap.usage + size));
+    if (freed)
+    {
+        refresh();
+        if (fits(heapIndex, size))
+            return true;
+    }
+
+    // Queue until other buffers are released or the timeout expires
+    const auto deadline = std::chrono::steady_clock::now() + m_wait_timeout.load();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_freed.wait_until(lock, deadline, [&] { return fits(heapIndex, size); }))
+            return true;
+    }
+
+    heap = getHeapUsage(heapIndex);
+    LOG_WARNING("Memory budget exceeded on heap %u: %llu bytes requested, %llu of %llu in use (watermark %.2f)",
+                heapIndex, static_cast<unsigned long long>(size), static_cast<unsigned long long>(heap.usage),
+                static_cast<unsigned long long>(heap.budget), m_watermark.load());
+    return false;
+}
+
+void MemoryBudget::notify()
+{
+    {
+        // A waiter between its fits() check and wait_until() must not miss this wakeup
+        std::unique_lock<std::mutex> lock(m_mutex);
+    }
+    m_freed.notify_all();
+}
+
+} // namespace runtime
@@ -0,0 +1,139 @@
+#include "memory_planner.h"
+
+#include "error_handling.h"
+#include "storage.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+
+namespace runtime
+{
+
+static constexpr size_t kUnused = SIZE_MAX;
+
+MemoryPlanner::TensorId MemoryPlanner::addTensor(size_t size, bool persistent)
+{
+    m_tensors.push_back({size, persistent, kUnused, 0, 0});
+    m_planned = false;
+    return m_tensors.size() - 1;
+}
+
+void MemoryPlanner::addStep(const std::vector<TensorId> &tensors)
+{
+    const size_t step = m_stepCount++;
+    for (TensorId id : tensors)
+    {
+        check_condition(id < m_tensors.size(), "MemoryPlanner::addStep: unknown tensor");
+        auto &tensor = m_tensors[id];
+        tensor.firstUse = std::min(tensor.firstUse, step);
+        tensor.lastUse = std::max(tensor.lastUse, step);
+    }
+    m_planned = false;
+}
+
+size_t MemoryPlanner::plan(size_t alignment)
+{
+    alignment = std::max<size_t>(1, alignment);
+    const size_t lastStep = m_stepCount ? m_stepCount - 1 : 0;
+    for (auto &tensor : m_tensors)
+    {
+        if (tensor.persistent)
+        {
+            tensor.firstUse = 0;
+            tensor.lastUse = lastStep;
+        }
+    }
+
+    // Greedy by size: large tensors constrain the layout most, so they go first
+    std::vector<TensorId> order(m_tensors.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [this](TensorId a, TensorId b) { return m_tensors[a].size > m_tensors[b].size; });
+
+    std::vector<TensorId> placed;
+    placed.reserve(order.size());
+    m_arenaSize = 0;
+    for (TensorId id : order)
+    {
+        auto &tensor = m_tensors[id];
+        tensor.offset = 0;
+        if (tensor.firstUse == kUnused || tensor.size == 0)
+            continue;
+
+        // Placed tensors that are live at the same time, by offset
+        std::vector<TensorId> live;
+        for (TensorId other : placed)
+        {
+            const auto &o = m_tensors[other];
+            if (o.firstUse <= tensor.lastUse && tensor.firstUse <= o.lastUse)
+                live.push_back(other);
+        }
+        std::sort(live.begin(), live.end(),
+                  [this](TensorId a, TensorId b) { return m_tensors[a].offset < m_tensors[b].offset; });
+
+        // Lowest gap that fits
+        size_t offset = 0;
+        for (TensorId other : live)
+        {
+            const auto &o = m_tensors[other];
+            if (o.offset >= offset + tensor.size)
+                break;
+            offset = std::max(offset, (o.offset + o.size + alignment - 1) / alignment * alignment);
+        }
+
+        tensor.offset = offset;
+        m_arenaSize = std::max(m_arenaSize, offset + tensor.size);
+        placed.push_back(id);
+    }
+
+    m_planned = true;
+    return m_arenaSize;
+}
+
+size_t MemoryPlanner::getOffset(TensorId tensor) const
+{
+    check_condition(m_planned, "MemoryPlanner::getOffset: plan() has not run");
+    check_condition(tensor < m_tensors.size(), "MemoryPlanner::getOffset: unknown tensor");
+    return m_tensors[tensor].offset;
+}
+
+size_t MemoryPlanner::getSize(TensorId tensor) const
+{
+    check_condition(tensor < m_tensors.size(), "MemoryPlanner::getSize: unknown tensor");
+    return m_tensors[tensor].size;
+}
+
+size_t MemoryPlanner::getArenaSize() const
+{
+    return m_arenaSize;
+}
+
+size_t MemoryPlanner::getUnplannedSize() const
+{
+    size_t total = 0;
+    for (const auto &tensor : m_tensors)
+        total += tensor.size;
+    return total;
+}
+
+std::vector<std::shared_ptr<BufferView>> MemoryPlanner::materialize(const std::shared_ptr<Buffer> &arena) const
+{
+    check_condition(m_planned, "MemoryPlanner::materialize: plan() has not run");
+
+    std::vector<std::shared_ptr<BufferView>> views;
+    views.reserve(m_tensors.size());
+    for (const auto &tensor : m_tensors)
+    {
+        if (tensor.firstUse == kUnused || tensor.size == 0)
+            views.push_back(nullptr);
+        else
+        {
+            check_condition(arena != nullptr, "MemoryPlanner::materialize: arena is null");
+            views.push_back(BufferView::create(arena, tensor.offset, tensor.size));
+        }
+    }
+    return views;
+}
+
+} // namespace runtime
@@ -0,0 +1,236 @@
+#include "pipeline_cache.h"
+
+#include "config.h"
+#include "device_features.h"
+#include "error_handling.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace runtime
+{
+
+static unsigned long processId()
+{
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return static_cast<unsigned long>(getpid());
+#endif
+}
+
+static constexpr char kMagic[8] = {'V', 'K', 'R', 'T', 'P', 'C', '0', '1'};
+
+// Prepended to the driver's blob; the driver validates nothing beyond its own header
+struct FileHeader
+{
+    char magic[8];
+    uint8_t deviceUUID[VK_UUID_SIZE];
+    uint32_t driverVersion;
+    uint32_t reserved;
+    uint64_t dataSize;
+};
+
+static std::string toHex(const uint8_t *bytes, size_t size)
+{
+    std::ostringstream out;
+    out << std::hex << std::setfill('0');
+    for (size_t i = 0; i < size; ++i)
+        out << std::setw(2) << static_cast<unsigned>(bytes[i]);
+    return out.str();
+}
+
+std::shared_ptr<PipelineCache> PipelineCache::create(VkDevice device, const DeviceFeatures &features,
+                                                     const std::filesystem::path &directory)
+{
+    return std::make_shared<PipelineCache>(device, features, directory);
+}
+
+PipelineCache::PipelineCache(VkDevice device, const DeviceFeatures &features, const std::filesystem::path &directory)
+    : m_device(device)
+{
+    initialize(features, directory);
+}
+
+PipelineCache::~PipelineCache()
+{
+    cleanup();
+}
+
+void PipelineCache::initialize(const DeviceFeatures &features, const std::filesystem::path &directory)
+{
+    const auto &properties = features.getProperties();
+    const auto &limits = properties.device_properties_2.properties;
+    std::memcpy(m_device_uuid, properties.device_vulkan11_properties.deviceUUID, VK_UUID_SIZE);
+    std::memcpy(m_cache_uuid, limits.pipelineCacheUUID, VK_UUID_SIZE);
+    m_driver_version = limits.driverVersion;
+    m_vendor_id = limits.vendorID;
+    m_device_id = limits.deviceID;
+
+    std::filesystem::path dir = directory;
+    if (dir.empty())
+    {
+        if (const char *env = std::getenv("VKRT_PIPELINE_CACHE_DIR"))
+            dir = env;
+        else
+        {
+            std::error_code ec;
+            dir = std::filesystem::temp_directory_path(ec) / PIPELINE_CACHE_DIR;
+        }
+    }
+    m_path = dir / (toHex(m_device_uuid, VK_UUID_SIZE) + "_" + std::to_string(m_driver_version) + "_" +
+                    toHex(m_cache_uuid, VK_UUID_SIZE) + ".bin");
+
+    std::vector<uint8_t> file = load();
+    m_warm = validate(file);
+
+    VkPipelineCacheCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if (m_warm)
+    {
+        createInfo.initialDataSize = file.size() - sizeof(FileHeader);
+        createInfo.pInitialData = file.data() + sizeof(FileHeader);
+    }
+    VkResult result = vkCreatePipelineCache(m_device, &createInfo, nullptr, &m_cache);
+    if (result != VK_SUCCESS && m_warm)
+    {
+        LOG_WARNING("Driver rejected the pipeline cache at %s, starting empty", m_path.string().c_str());
+        m_warm = false;
+        createInfo.initialDataSize = 0;
+        createInfo.pInitialData = nullptr;
+        result = vkCreatePipelineCache(m_device, &createInfo, nullptr, &m_cache);
+    }
+    check_result(result, "Failed to create pipeline cache");
+}
+
+std::vector<uint8_t> PipelineCache::load() const
+{
+    std::ifstream in(m_path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return {};
+    std::vector<uint8_t> file(static_cast<size_t>(in.tellg()));
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(file.data()), static_cast<std::streamsize>(file.size())))
+        return {};
+    return file;
+}
+
+bool PipelineCache::validate(const std::vector<uint8_t> &file) const
+{
+    if (file.empty())
+        return false;
+
+    FileHeader header;
+    VkPipelineCacheHeaderVersionOne vkHeader;
+    if (file.size() < sizeof(header) + sizeof(vkHeader))
+    {
+        LOG_WARNING("Pipeline cache %s is truncated, ignoring it", m_path.string().c_str());
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    std::memcpy(&vkHeader, file.data() + sizeof(header), sizeof(vkHeader));
+
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.dataSize != file.size() - sizeof(header) ||
+        std::memcmp(header.deviceUUID, m_device_uuid, VK_UUID_SIZE) != 0 || header.driverVersion != m_driver_version)
+    {
+        LOG_WARNING("Pipeline cache %s does not match this device or is incomplete, ignoring it",
+                    m_path.string().c_str());
+        return false;
+    }
+    if (vkHeader.headerSize < sizeof(vkHeader) || vkHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+        vkHeader.vendorID != m_vendor_id || vkHeader.deviceID != m_device_id ||
+        std::memcmp(vkHeader.pipelineCacheUUID, m_cache_uuid, VK_UUID_SIZE) != 0)
+    {
+        LOG_WARNING("Pipeline cache %s was written by another driver, ignoring it", m_path.string().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool PipelineCache::save()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_cache == VK_NULL_HANDLE)
+        return false;
+
+    size_t size = 0;
+    if (vkGetPipelineCacheData(m_device, m_cache, &size, nullptr) != VK_SUCCESS || size == 0)
+        return false;
+    std::vector<uint8_t> data(size);
+    if (vkGetPipelineCacheData(m_device, m_cache, &size, data.data()) != VK_SUCCESS)
+        return false;
+    data.resize(size);
+
+    FileHeader header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    std::memcpy(header.deviceUUID, m_device_uuid, VK_UUID_SIZE);
+    header.driverVersion = m_driver_version;
+    header.dataSize = data.size();
+
+    std::error_code ec;
+    std::filesystem::create_directories(m_path.parent_path(), ec);
+    // Unique per process and thread so concurrent writers never share a temporary
+    std::ostringstream suffix;
+    suffix << ".tmp." << processId() << "." << std::this_thread::get_id() << "." << reinterpret_cast<uintptr_t>(this);
+    std::filesystem::path tmp = m_path;
+    tmp += suffix.str();
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (!out.flush())
+        {
+            LOG_WARNING("Failed to write pipeline cache %s", tmp.string().c_str());
+            out.close();
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, m_path, ec);
+    if (ec)
+    {
+        LOG_WARNING("Failed to replace pipeline cache %s: %s", m_path.string().c_str(), ec.message().c_str());
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+VkPipelineCache PipelineCache::getHandle() const
+{
+    return m_cache;
+}
+
+const std::filesystem::path &PipelineCache::getPath() const
+{
+    return m_path;
+}
+
+bool PipelineCache::isWarm() const
+{
+    return m_warm;
+}
+
+void PipelineCache::cleanup()
+{
+    if (m_cache != VK_NULL_HANDLE)
+    {
+        save();
+        vkDestroyPipelineCache(m_device, m_cache, nullptr);
+        m_cache = VK_NULL_HANDLE;
+    }
+}
+
+} // namespace runtime
@@ -4,28 +4,68 @@
 #include "device.h"
 #include "storage.h"
 #include "queue.h"
+#include "barrier.h"
+
+#include <algorithm>
+#include <cstring>
 
 namespace runtime
 {
+    // readonly/writeonly qualifiers show up as NonWritable/NonReadable either on the
+    // variable or on every member of the block
+    static bool isBufferDescriptor(VkDescriptorType type)
+    {
+        return type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER || type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ||
+               type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC || type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    }
+
+    static VkAccessFlags2 bindingAccess(const SpvReflectDescriptorBinding &binding)
+    {
+        if (binding.descriptor_type == SPV_REFLECT_DESCRIPTOR_TYPE_UNIFORM_BUFFER)
+            return VK_ACCESS_2_UNIFORM_READ_BIT;
 
-    Program::Program(VkDevice device, VkPipelineCache pipeline_cache,
-                std::shared_ptr<DescriptorLayoutCache> &descCache,
-                std::shared_ptr<DescriptorAllocator> &descAllocator,                 
-                 const std::vector<uint32_t> &shader_code,
-                uint32_t dim_x, uint32_t dim_y, uint32_t dim_z)
-    : m_device(device), m_module(VK_NULL_HANDLE), m_pipeline(VK_NULL_HANDLE), m_pipelineLayout(VK_NULL_HANDLE),
-      dims{dim_x, dim_y, dim_z}
-    {       
-        initialize(device, pipeline_cache, descCache, descAllocator, shader_code);
+        SpvReflectDecorationFlags flags = binding.decoration_flags | binding.block.decoration_flags;
+        if (binding.block.member_count > 0)
+        {
+            SpvReflectDecorationFlags common = ~SpvReflectDecorationFlags(0);
+            for (uint32_t m = 0; m < binding.block.member_count; ++m)
+                common &= binding.block.members[m].decoration_flags;
+            flags |= common;
+        }
+
+        VkAccessFlags2 access = 0;
+        if (!(flags & SPV_REFLECT_DECORATION_NON_READABLE))
+            access |= VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+        if (!(flags & SPV_REFLECT_DECORATION_NON_WRITABLE))
+            access |= VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        return access;
+    }
+
+    Program::Program(VkDevice device, std::shared_ptr<PipelineState> pipeline,
+                     std::shared_ptr<DescriptorAllocator> &descAllocator,
+                     uint32_t dim_x, uint32_t dim_y, uint32_t dim_z)
+    : m_device(device), m_state(std::move(pipeline)), dims{dim_x, dim_y, dim_z}
+    {
+        initialize(descAllocator);
     }
 
     std::shared_ptr<Program> Program::create(VkDevice device, VkPipelineCache pipeline_cache,
                                              std::shared_ptr<DescriptorLayoutCache> &descCache,
                                              std::shared_ptr<DescriptorAllocator> &descAllocator,
                                              const std::vector<uint32_t> &shader_code, uint32_t dim_x, uint32_t dim_y,
-                                             uint32_t dim_z)
+                                             uint32_t dim_z, const Specialization &specialization, BindingMode mode,
+                                             uint32_t max_push_descriptors)
+    {
+        auto pipeline = PipelineState::create(device, pipeline_cache, descCache, shader_code, specialization, mode,
+                                              max_push_descriptors);
+        return std::make_shared<Program>(device, pipeline, descAllocator, dim_x, dim_y, dim_z);
+    }
+
+    std::shared_ptr<Program> Program::create(VkDevice device, std::shared_ptr<PipelineState> pipeline,
+                                             std::shared_ptr<DescriptorAllocator> &descAllocator, uint32_t dim_x,
+                                             uint32_t dim_y, uint32_t dim_z)
     {
-        return std::make_shared<Program>(device, pipeline_cache, descCache, descAllocator, shader_code, dim_x, dim_y, dim_z);
+        return std::make_shared<Program>(device, std::move(pipeline), descAllocator, dim_x, dim_y, dim_z);
     }
 
     Program::~Program()
@@ -33,33 +73,515 @@ namespace runtime
         cleanup();
     }
 
-    void Program::Arg(std::shared_ptr<Buffer> &buffer, size_t binding_idx, size_t set_idx)
+    void Program::Arg(const std::shared_ptr<Buffer> &buffer, size_t binding_idx, size_t set_idx)
     {
         check_condition(set_idx < writes.size(), "set index out of range");
         check_condition(binding_idx < writes[set_idx].size(), "binding index out of range");
+        if (conflictsWithChunks(set_idx, binding_idx, false))
+        {
+            LOG_ERROR("Program: a writable binding cannot take an unchunked buffer next to chunked arguments");
+            return;
+        }
         writes[set_idx][binding_idx].pBufferInfo = buffer->getBufferInfo();
-        vkUpdateDescriptorSets(m_device, 1, &writes[set_idx][binding_idx], 0, nullptr);
+        if (m_state->getBindingMode() == BindingMode::DescriptorSets)
+            vkUpdateDescriptorSets(m_device, 1, &writes[set_idx][binding_idx], 0, nullptr);
+        m_args[set_idx][binding_idx] = buffer;
+        m_argGenerations[set_idx][binding_idx] = buffer->getGeneration();
+        m_chunkedArgs[set_idx][binding_idx] = nullptr;
+        m_chunkSetsDirty = true;
+    }
+
+    bool Program::conflictsWithChunks(size_t set_idx, size_t binding_idx, bool chunked) const
+    {
+        auto writable = [&](size_t i, size_t j) {
+            return (m_bindingAccess[i][j] & VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT) != 0;
+        };
+        for (size_t i = 0; i < m_args.size(); ++i)
+        {
+            for (size_t j = 0; j < m_args[i].size(); ++j)
+            {
+                if (i == set_idx && j == binding_idx)
+                    continue;
+                if (chunked ? (m_args[i][j] && writable(i, j)) : (m_chunkedArgs[i][j] && writable(set_idx, binding_idx)))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    void Program::Arg(const std::shared_ptr<ChunkedBuffer> &buffer, size_t binding_idx, size_t set_idx)
+    {
+        check_condition(set_idx < writes.size(), "set index out of range");
+        check_condition(binding_idx < writes[set_idx].size(), "binding index out of range");
+        if (buffer && conflictsWithChunks(set_idx, binding_idx, true))
+        {
+            LOG_ERROR("Program: a chunked argument cannot be combined with an unchunked writable one");
+            return;
+        }
+        m_chunkedArgs[set_idx][binding_idx] = buffer;
+        m_args[set_idx][binding_idx] = nullptr;
+        m_chunkSetsDirty = true;
+    }
+
+    void Program::bind(const std::vector<std::shared_ptr<Buffer>> &buffers, size_t set_idx)
+    {
+        check_condition(set_idx < writes.size(), "set index out of range");
+        check_condition(buffers.size() <= writes[set_idx].size(), "more buffers than bindings in set");
+        // Chunked arguments replaced by this call do not count against its writable bindings
+        bool writesUnchunked = false, keepsChunks = false;
+        for (size_t i = 0; i < m_chunkedArgs.size(); ++i)
+        {
+            for (size_t j = 0; j < m_chunkedArgs[i].size(); ++j)
+            {
+                const bool replaced = i == set_idx && j < buffers.size() && buffers[j];
+                writesUnchunked |= replaced && (m_bindingAccess[i][j] & VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+                keepsChunks |= !replaced && m_chunkedArgs[i][j];
+            }
+        }
+        if (writesUnchunked && keepsChunks)
+        {
+            LOG_ERROR("Program: a writable binding cannot take an unchunked buffer next to chunked arguments");
+            return;
+        }
+        for (size_t j = 0; j < buffers.size(); ++j)
+        {
+            if (!buffers[j])
+                continue;
+            writes[set_idx][j].pBufferInfo = buffers[j]->getBufferInfo();
+            m_args[set_idx][j] = buffers[j];
+            m_argGenerations[set_idx][j] = buffers[j]->getGeneration();
+            m_chunkedArgs[set_idx][j] = nullptr;
+        }
+        updateSet(set_idx);
+        m_chunkSetsDirty = true;
+    }
+
+    void Program::updateSet(size_t set_idx)
+    {
+        // Pushed descriptors are written at record time
+        if (m_state->getBindingMode() == BindingMode::PushDescriptors)
+            return;
+
+        auto &data = m_templateData[set_idx];
+        bool complete = true;
+        for (size_t j = 0; j < data.size(); ++j)
+        {
+            if (m_args[set_idx][j])
+                data[j] = *m_args[set_idx][j]->getBufferInfo();
+            else
+                complete = false;
+        }
+
+        // The template writes every binding, so a partly bound set falls back to plain writes
+        VkDescriptorUpdateTemplate updateTemplate = m_state->getUpdateTemplates()[set_idx];
+        if (updateTemplate != VK_NULL_HANDLE && complete)
+        {
+            vkUpdateDescriptorSetWithTemplate(m_device, sets[set_idx], updateTemplate, data.data());
+            return;
+        }
+
+        std::vector<VkWriteDescriptorSet> setWrites;
+        for (size_t j = 0; j < data.size(); ++j)
+        {
+            if (!m_args[set_idx][j])
+                continue;
+            setWrites.push_back(writes[set_idx][j]);
+            setWrites.back().pBufferInfo = &data[j];
+        }
+        if (!setWrites.empty())
+            vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(setWrites.size()), setWrites.data(), 0, nullptr);
+    }
+
+    void Program::setPushConstants(const void *data, size_t size, uint32_t offset)
+    {
+        const VkPushConstantRange &range = m_state->getPushConstantRange();
+        if (offset < range.offset || offset + size > range.offset + range.size)
+        {
+            LOG_ERROR("Push constants [%u, %zu) outside the shader's range [%u, %u)", offset, offset + size,
+                      range.offset, range.offset + range.size);
+            return;
+        }
+        std::memcpy(m_pushData.data() + (offset - range.offset), data, size);
+    }
+
+    void Program::ArgAddress(const std::shared_ptr<Buffer> &buffer, uint32_t slot)
+    {
+        const VkPushConstantRange &range = m_state->getPushConstantRange();
+        const uint32_t offset = slot * sizeof(VkDeviceAddress);
+        if (offset < range.offset || offset + sizeof(VkDeviceAddress) > range.offset + range.size)
+        {
+            LOG_ERROR("Address slot %u outside the shader's push-constant range [%u, %u)", slot, range.offset,
+                      range.offset + range.size);
+            return;
+        }
+        if (buffer && buffer->getDeviceAddress() == 0)
+        {
+            LOG_ERROR("Buffer has no device address; bufferDeviceAddress is not supported");
+            return;
+        }
+        if (m_addressArgs.size() <= slot)
+        {
+            m_addressArgs.resize(slot + 1);
+            m_addressTables.resize(slot + 1);
+        }
+        m_addressArgs[slot] = buffer;
+        m_addressTables[slot] = nullptr;
+    }
+
+    void Program::ArgAddress(const std::shared_ptr<AddressTable> &table, uint32_t slot)
+    {
+        ArgAddress(table ? table->getTable() : nullptr, slot);
+        if (table && slot < m_addressArgs.size() && m_addressArgs[slot] == table->getTable())
+            m_addressTables[slot] = table;
+    }
+
+    PushConstants Program::pushConstants() const
+    {
+        const VkPushConstantRange &range = m_state->getPushConstantRange();
+        PushConstants push{range.stageFlags, range.offset, m_pushData};
+        for (size_t slot = 0; slot < m_addressArgs.size(); ++slot)
+        {
+            if (!m_addressArgs[slot])
+                continue;
+            const VkDeviceAddress address = m_addressArgs[slot]->getDeviceAddress();
+            std::memcpy(push.data.data() + (slot * sizeof(VkDeviceAddress) - range.offset), &address, sizeof(address));
+        }
+        return push;
+    }
+
+    void Program::trackAddressArgs(std::vector<BufferAccess> &accesses, std::vector<VkBufferMemoryBarrier2> &barriers,
+                                   std::vector<TimelinePoint> &waits) const
+    {
+        // The shader may dereference anything in the buffer, either way
+        auto track = [&](const std::shared_ptr<Buffer> &buffer) {
+            if (!buffer)
+                return;
+            const VkDescriptorBufferInfo *info = buffer->getBufferInfo();
+            accesses.push_back({info->buffer, info->offset, info->range, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT});
+            auto pending = buffer->takePendingBarriers();
+            barriers.insert(barriers.end(), pending.begin(), pending.end());
+            auto pending_waits = buffer->getPendingWaits();
+            waits.insert(waits.end(), pending_waits.begin(), pending_waits.end());
+        };
+        for (size_t slot = 0; slot < m_addressArgs.size(); ++slot)
+        {
+            track(m_addressArgs[slot]);
+            if (m_addressTables[slot])
+                for (const auto &buffer : m_addressTables[slot]->getBuffers())
+                    track(buffer);
+        }
+    }
+
+    SubmitHook Program::pinBuffers(const std::vector<Buffer *> &buffers) const
+    {
+        std::vector<std::shared_ptr<Buffer>> pinned;
+        for (Buffer *buffer : buffers)
+        {
+            if (buffer)
+                pinned.push_back(buffer->shared_from_this());
+        }
+        for (size_t slot = 0; slot < m_addressArgs.size(); ++slot)
+        {
+            if (m_addressArgs[slot])
+                pinned.push_back(m_addressArgs[slot]);
+            if (!m_addressTables[slot])
+                continue;
+            for (const auto &buffer : m_addressTables[slot]->getBuffers())
+            {
+                if (buffer)
+                    pinned.push_back(buffer);
+            }
+        }
+        for (const auto &buffer : pinned)
+            buffer->pin();
+        return [pinned](const TimelinePoint &point) {
+            for (const auto &buffer : pinned)
+                buffer->unpin(point);
+        };
     }
 
     void Program::setup(std::shared_ptr<CommandPoolManager> cmd_pool)
     {
         if (!m_cmdPoolManager)
             m_cmdPoolManager = cmd_pool;
+
+        for (const auto &set : m_chunkedArgs)
+        {
+            for (const auto &chunked : set)
+            {
+                if (chunked)
+                {
+                    dispatchChunks();
+                    return;
+                }
+            }
+        }
+
+        if (m_state->getBindingMode() == BindingMode::PushDescriptors)
+        {
+            std::vector<Buffer *> buffers;
+            if (!m_args.empty())
+                for (const auto &buffer : m_args[0])
+                    buffers.push_back(buffer.get());
+            SubmitHook onSubmit = pinBuffers(buffers);
+            dispatchPushed(*m_cmdPoolManager, buffers, dims[0], pushConstants(), std::move(onSubmit));
+            return;
+        }
+
+        std::vector<Buffer *> bound;
+        for (const auto &set : m_args)
+            for (const auto &buffer : set)
+                bound.push_back(buffer.get());
+        SubmitHook onSubmit = pinBuffers(bound);
+
+        // Describe what this dispatch touches so the recorder can place barriers
+        std::vector<BufferAccess> accesses;
+        std::vector<VkBufferMemoryBarrier2> barriers;
+        std::vector<TimelinePoint> waits;
+        for (size_t i = 0; i < m_args.size(); ++i)
+        {
+            bool moved = false;
+            for (size_t j = 0; j < m_args[i].size(); ++j)
+            {
+                auto &buffer = m_args[i][j];
+                if (!buffer)
+                    continue;
+                if (buffer->getGeneration() != m_argGenerations[i][j])
+                {
+                    // Defragmentation moved the buffer since the descriptor was written
+                    m_argGenerations[i][j] = buffer->getGeneration();
+                    moved = true;
+                }
+                const VkDescriptorBufferInfo *info = buffer->getBufferInfo();
+                accesses.push_back({info->buffer, info->offset, info->range, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                    m_bindingAccess[i][j]});
+                auto pending = buffer->takePendingBarriers();
+                barriers.insert(barriers.end(), pending.begin(), pending.end());
+                auto pending_waits = buffer->getPendingWaits();
+                waits.insert(waits.end(), pending_waits.begin(), pending_waits.end());
+            }
+            if (moved)
+                updateSet(i);
+        }
+        trackAddressArgs(accesses, barriers, waits);
+
+        m_cmdPoolManager->addWaits(waits);
         m_cmdPoolManager->submitCompute(m_pipeline, m_pipelineLayout, sets.size(), sets.data(),
                                         VK_PIPELINE_BIND_POINT_COMPUTE,
-                                dims[0], dims[1], dims[2]);
-        
+                                dims[0], dims[1], dims[2], accesses, barriers, pushConstants(), {},
+                                std::move(onSubmit));
+
+    }
+
+    void Program::dispatch(const std::shared_ptr<CommandPoolManager> &cmd_pool,
+                           const std::vector<std::shared_ptr<Buffer>> &buffers, const void *push_data,
+                           size_t push_size, uint32_t push_offset) const
+    {
+        if (m_state->getBindingMode() != BindingMode::PushDescriptors)
+        {
+            LOG_ERROR("Program::dispatch needs a Program created with BindingMode::PushDescriptors");
+            return;
+        }
+
+        std::vector<Buffer *> raw;
+        for (const auto &buffer : buffers)
+            raw.push_back(buffer.get());
+        SubmitHook onSubmit = pinBuffers(raw);
+
+        PushConstants push = pushConstants();
+        if (push_size > 0)
+        {
+            if (push_offset < push.offset || push_offset + push_size > push.offset + push.data.size())
+            {
+                LOG_ERROR("Push constants [%u, %zu) outside the shader's range [%u, %zu)", push_offset,
+                          push_offset + push_size, push.offset, push.offset + push.data.size());
+                onSubmit({VK_NULL_HANDLE, 0});
+                return;
+            }
+            std::memcpy(push.data.data() + (push_offset - push.offset), push_data, push_size);
+        }
+        dispatchPushed(*cmd_pool, raw, dims[0], push, std::move(onSubmit));
+    }
+
+    void Program::dispatchPushed(CommandPoolManager &cmd_pool, const std::vector<Buffer *> &buffers, uint32_t dim_x,
+                                 const PushConstants &push, SubmitHook onSubmit) const
+    {
+        const size_t bindings = writes.empty() ? 0 : writes[0].size();
+        if (buffers.size() != bindings)
+        {
+            LOG_ERROR("Program::dispatch got %zu buffers for %zu bindings", buffers.size(), bindings);
+            onSubmit({VK_NULL_HANDLE, 0});
+            return;
+        }
+
+        PushDescriptors descriptors;
+        std::vector<BufferAccess> accesses;
+        std::vector<VkBufferMemoryBarrier2> barriers;
+        std::vector<TimelinePoint> waits;
+        descriptors.data.reserve(bindings);
+        for (size_t j = 0; j < bindings; ++j)
+        {
+            Buffer *buffer = buffers[j];
+            if (!buffer)
+            {
+                LOG_ERROR("Program::dispatch: binding %zu has no buffer", j);
+                onSubmit({VK_NULL_HANDLE, 0});
+                return;
+            }
+            const VkDescriptorBufferInfo *info = buffer->getBufferInfo();
+            descriptors.data.push_back(*info);
+            accesses.push_back({info->buffer, info->offset, info->range, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                m_bindingAccess[0][j]});
+            auto pending = buffer->takePendingBarriers();
+            barriers.insert(barriers.end(), pending.begin(), pending.end());
+            auto pending_waits = buffer->getPendingWaits();
+            waits.insert(waits.end(), pending_waits.begin(), pending_waits.end());
+        }
+        if (bindings > 0)
+            descriptors.updateTemplate = m_state->getUpdateTemplates()[0];
+        trackAddressArgs(accesses, barriers, waits);
+
+        cmd_pool.addWaits(waits);
+        cmd_pool.submitCompute(m_pipeline, m_pipelineLayout, 0, nullptr, VK_PIPELINE_BIND_POINT_COMPUTE,
+                               std::max(1u, dim_x), dims[1], dims[2], accesses, barriers, push, descriptors,
+                               std::move(onSubmit));
     }
 
-    void Program::initialize(VkDevice device, VkPipelineCache pipeline_cache, std::shared_ptr<DescriptorLayoutCache> &descCache,
-                             std::shared_ptr<DescriptorAllocator> &descAllocator,
-                             const std::vector<uint32_t> &shader_code)
+    void Program::dispatchChunks()
+    {
+        // Chunked arguments advance together, so they must all be split the same way
+        std::shared_ptr<ChunkedBuffer> shape;
+        for (const auto &set : m_chunkedArgs)
+        {
+            for (const auto &chunked : set)
+            {
+                if (!chunked)
+                    continue;
+                if (!shape)
+                    shape = chunked;
+                check_condition(chunked->getChunkCount() == shape->getChunkCount() &&
+                                    chunked->getChunkSize() == shape->getChunkSize(),
+                                "Program: chunked arguments are split differently");
+            }
+        }
+
+        const size_t chunks = shape->getChunkCount();
+        // The dispatch covers a full chunk; the last one may be shorter
+        auto chunkDimX = [&](size_t c) {
+            const VkDeviceSize bytes = shape->getChunkSize(c);
+            if (bytes < shape->getChunkSize())
+                return static_cast<uint32_t>((dims[0] * bytes + shape->getChunkSize() - 1) / shape->getChunkSize());
+            return dims[0];
+        };
+
+        if (m_state->getBindingMode() == BindingMode::PushDescriptors)
+        {
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                std::vector<Buffer *> buffers;
+                for (size_t j = 0; j < m_args[0].size(); ++j)
+                    buffers.push_back(m_chunkedArgs[0][j] ? m_chunkedArgs[0][j]->getChunk(c).get() : m_args[0][j].get());
+                SubmitHook onSubmit = pinBuffers(buffers);
+                dispatchPushed(*m_cmdPoolManager, buffers, chunkDimX(c), pushConstants(), std::move(onSubmit));
+            }
+            return;
+        }
+
+        // The unchunked arguments are shared by every chunk's sets, so keep them in place while those are written;
+        // each chunk pins them again until its own dispatch is submitted
+        std::vector<Buffer *> shared;
+        for (size_t i = 0; i < m_args.size(); ++i)
+            for (size_t j = 0; j < m_args[i].size(); ++j)
+                if (!m_chunkedArgs[i][j])
+                    shared.push_back(m_args[i][j].get());
+        SubmitHook held = pinBuffers(shared);
+
+        while (m_chunkSets.size() < chunks)
+        {
+            std::vector<VkDescriptorSet> chunkSets(sets.size());
+            check_condition(m_descAllocator->allocate(chunkSets.size(), chunkSets.data(), m_layouts.data()),
+                            "failed to allocate descriptor sets for chunk");
+            m_chunkSets.push_back(std::move(chunkSets));
+            m_chunkGenerations.emplace_back(m_args.size());
+            for (size_t i = 0; i < m_args.size(); ++i)
+                m_chunkGenerations.back()[i].resize(m_args[i].size(), 0);
+            m_chunkSetsDirty = true;
+        }
+        for (size_t i = 0; i < m_args.size(); ++i)
+        {
+            for (size_t j = 0; j < m_args[i].size(); ++j)
+            {
+                if (m_args[i][j] && m_args[i][j]->getGeneration() != m_argGenerations[i][j])
+                {
+                    m_argGenerations[i][j] = m_args[i][j]->getGeneration();
+                    m_chunkSetsDirty = true;
+                }
+            }
+        }
+
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            std::vector<VkWriteDescriptorSet> chunkWrites;
+            std::vector<BufferAccess> accesses;
+            std::vector<VkBufferMemoryBarrier2> barriers;
+            std::vector<TimelinePoint> waits;
+            std::vector<Buffer *> bound;
+            for (size_t i = 0; i < m_args.size(); ++i)
+                for (size_t j = 0; j < m_args[i].size(); ++j)
+                    bound.push_back(m_chunkedArgs[i][j] ? m_chunkedArgs[i][j]->getChunk(c).get() : m_args[i][j].get());
+            SubmitHook onSubmit = pinBuffers(bound);
+            for (size_t i = 0; i < m_args.size(); ++i)
+            {
+                for (size_t j = 0; j < m_args[i].size(); ++j)
+                {
+                    Buffer *buffer = m_chunkedArgs[i][j] ? m_chunkedArgs[i][j]->getChunk(c).get() : m_args[i][j].get();
+                    if (!buffer)
+                        continue;
+                    const VkDescriptorBufferInfo *info = buffer->getBufferInfo();
+                    // Chunks can be moved like any other buffer; rewrite the binding if this one was
+                    const uint64_t generation = buffer->getGeneration();
+                    if (m_chunkSetsDirty || m_chunkGenerations[c][i][j] != generation)
+                    {
+                        m_chunkGenerations[c][i][j] = generation;
+                        VkWriteDescriptorSet write = writes[i][j];
+                        write.dstSet = m_chunkSets[c][i];
+                        write.pBufferInfo = info;
+                        chunkWrites.push_back(write);
+                    }
+                    accesses.push_back({info->buffer, info->offset, info->range,
+                                        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, m_bindingAccess[i][j]});
+                    auto pending = buffer->takePendingBarriers();
+                    barriers.insert(barriers.end(), pending.begin(), pending.end());
+                    auto pending_waits = buffer->getPendingWaits();
+                    waits.insert(waits.end(), pending_waits.begin(), pending_waits.end());
+                }
+            }
+            trackAddressArgs(accesses, barriers, waits);
+            if (!chunkWrites.empty())
+                vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(chunkWrites.size()), chunkWrites.data(), 0,
+                                       nullptr);
+
+            m_cmdPoolManager->addWaits(waits);
+            m_cmdPoolManager->submitCompute(m_pipeline, m_pipelineLayout, m_chunkSets[c].size(),
+                                            m_chunkSets[c].data(), VK_PIPELINE_BIND_POINT_COMPUTE,
+                                            std::max(1u, chunkDimX(c)),
+                                            dims[1], dims[2], accesses, barriers, pushConstants(), {},
+                                            std::move(onSubmit));
+        }
+        m_chunkSetsDirty = false;
+        held({VK_NULL_HANDLE, 0});
+    }
+
+    void PipelineState::initialize(VkPipelineCache pipeline_cache, std::shared_ptr<DescriptorLayoutCache> &descCache,
+                                   const std::vector<uint32_t> &shader_code, const Specialization &specialization,
+                                   BindingMode mode, uint32_t max_push_descriptors)
     {
         VkShaderModuleCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
         createInfo.codeSize = shader_code.size() * sizeof(uint32_t);
         createInfo.pCode = shader_code.data();
-        vkCreateShaderModule(device, &createInfo, nullptr, &m_module);
+        vkCreateShaderModule(m_device, &createInfo, nullptr, &m_module);
         SpvReflectShaderModule ref_module = {};
         SpvReflectResult result = spvReflectCreateShaderModule(createInfo.codeSize, createInfo.pCode, &ref_module);
         check_condition(result == SPV_REFLECT_RESULT_SUCCESS, "Failed to create shader module");
@@ -68,21 +590,47 @@ namespace runtime
         check_condition(spvReflectEnumerateDescriptorSets(&ref_module, &count, NULL) == SPV_REFLECT_RESULT_SUCCESS,
                         "failed to enumerate descriptors");
         std::vector<SpvReflectDescriptorSet *> reflsets(count);
-        std::vector<VkDescriptorSetLayout> layouts(count);
+        std::vector<VkDescriptorSetLayout> &layouts = m_layouts;
+        layouts.resize(count);
         std::vector<std::vector<VkDescriptorSetLayoutBinding>> bindings(count);
-        sets.resize(count);
 
+        std::vector<std::vector<VkWriteDescriptorSet>> &writes = m_writes;
         writes.resize(count);
+        m_bindingAccess.resize(count);
 
         check_condition(spvReflectEnumerateDescriptorSets(&ref_module, &count, reflsets.data()) ==
                             SPV_REFLECT_RESULT_SUCCESS,
                         "failed to enumerate descriptors");
 
+        // Only one set of at most max_push_descriptors can be pushed, and the push template
+        // packs buffer infos only
+        m_mode = mode;
+        if (m_mode == BindingMode::PushDescriptors)
+        {
+            bool pushable = reflsets.size() <= 1;
+            uint32_t descriptors = 0;
+            for (const auto *refl_set : reflsets)
+            {
+                for (uint32_t j = 0; j < refl_set->binding_count; ++j)
+                {
+                    pushable &= isBufferDescriptor(static_cast<VkDescriptorType>(refl_set->bindings[j]->descriptor_type));
+                    descriptors += refl_set->bindings[j]->count;
+                }
+            }
+            pushable &= descriptors <= max_push_descriptors;
+            if (!pushable)
+            {
+                LOG_WARNING("Shader cannot use push descriptors, falling back to descriptor sets");
+                m_mode = BindingMode::DescriptorSets;
+            }
+        }
+
         for (size_t i = 0; i < reflsets.size(); ++i)
         {
             const auto &refl_set = *(reflsets[i]);
             bindings[i].resize(refl_set.binding_count);
             writes[i].resize(refl_set.binding_count);
+            m_bindingAccess[i].resize(refl_set.binding_count);
             for (size_t j = 0; j < refl_set.binding_count; ++j)
             {
                 const auto &refl_binding = *(refl_set.bindings[j]);
@@ -102,27 +650,19 @@ namespace runtime
                 writes[i][j].pImageInfo = nullptr;
                 writes[i][j].pBufferInfo = nullptr;
                 writes[i][j].pTexelBufferView = nullptr;
+                m_bindingAccess[i][j] = bindingAccess(refl_binding);
             }
 
             VkDescriptorSetLayoutCreateInfo descCreateInfo = {};
             descCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
             descCreateInfo.bindingCount = static_cast<uint32_t>(bindings[i].size());
             descCreateInfo.pBindings = bindings[i].data();
-            descCreateInfo.flags = 0;
+            descCreateInfo.flags =
+                m_mode == BindingMode::PushDescriptors ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0;
             descCreateInfo.pNext = nullptr;
 
             layouts[i] = descCache->getDescriptorSetLayout(i, &descCreateInfo);
         }
-        check_condition(descAllocator->allocate(sets.size(), sets.data(), layouts.data()),
-                        "failed to allocate descriptorPool");
-        for (size_t i = 0; i < reflsets.size(); ++i)
-        {
-            for (size_t j = 0; j < reflsets[i]->binding_count; ++j)
-            {
-                writes[i][j].dstSet = sets[i];
-            }
-        }
-
         check_condition(spvReflectEnumerateDescriptorBindings(&ref_module, &count, NULL) == SPV_REFLECT_RESULT_SUCCESS,
                         "failed to enumerate bindings");
         std::vector<SpvReflectDescriptorBinding *> desc_bindings(count);
@@ -155,6 +695,31 @@ namespace runtime
         result = spvReflectEnumeratePushConstantBlocks(&ref_module, &count, push_constant.data());
         check_condition(result == SPV_REFLECT_RESULT_SUCCESS, "failed to enumerate push constants");
 
+        // A compute shader has at most one block; cover the bytes its members actually use
+        for (const auto *block : push_constant)
+        {
+            uint32_t begin = block->offset;
+            uint32_t end = block->offset + block->size;
+            if (block->member_count > 0)
+            {
+                begin = UINT32_MAX;
+                end = 0;
+                for (uint32_t m = 0; m < block->member_count; ++m)
+                {
+                    begin = std::min(begin, block->members[m].offset);
+                    end = std::max(end, block->members[m].offset + block->members[m].size);
+                }
+            }
+            if (m_pushRange.size == 0)
+                m_pushRange = {static_cast<VkShaderStageFlags>(ref_module.shader_stage), begin, end - begin};
+            else
+            {
+                const uint32_t first = std::min(m_pushRange.offset, begin);
+                m_pushRange.size = std::max(m_pushRange.offset + m_pushRange.size, end) - first;
+                m_pushRange.offset = first;
+            }
+        }
+
         std::string entryName(ref_module.entry_point_name);
         VkPipelineShaderStageCreateInfo stageInfo = {};
         stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -163,11 +728,49 @@ namespace runtime
         stageInfo.module = m_module;
         stageInfo.pName = entryName.c_str();
 
+        // Resolve names to SpecIds; explicit IDs win over names for the same constant
+        std::map<uint32_t, uint32_t> specValues;
+        if (!specialization.empty())
+        {
+            result = spvReflectEnumerateSpecializationConstants(&ref_module, &count, NULL);
+            check_condition(result == SPV_REFLECT_RESULT_SUCCESS, "failed to enumerate specialization constants");
+            std::vector<SpvReflectSpecializationConstant *> spec_constants(count);
+            result = spvReflectEnumerateSpecializationConstants(&ref_module, &count, spec_constants.data());
+            check_condition(result == SPV_REFLECT_RESULT_SUCCESS, "failed to enumerate specialization constants");
+
+            for (const auto &[name, value] : specialization.getNames())
+            {
+                auto it = std::find_if(spec_constants.begin(), spec_constants.end(), [&](const auto *constant) {
+                    return constant->name && name == constant->name;
+                });
+                if (it == spec_constants.end())
+                    LOG_WARNING("Shader has no specialization constant named %s", name.c_str());
+                else
+                    specValues[(*it)->constant_id] = value;
+            }
+            for (const auto &[id, value] : specialization.getIds())
+            {
+                bool known = std::any_of(spec_constants.begin(), spec_constants.end(),
+                                         [id = id](const auto *constant) { return constant->constant_id == id; });
+                if (!known)
+                    LOG_WARNING("Shader has no specialization constant with SpecId %u", id);
+                specValues[id] = value;
+            }
+        }
+
+        std::vector<VkSpecializationMapEntry> specEntries;
+        std::vector<uint32_t> specData;
+        for (const auto &[id, value] : specValues)
+        {
+            specEntries.push_back({id, static_cast<uint32_t>(specData.size() * sizeof(uint32_t)), sizeof(uint32_t)});
+            specData.push_back(value);
+        }
+
         VkSpecializationInfo specializationInfo = {};
-        specializationInfo.mapEntryCount = 0;
-        specializationInfo.pMapEntries = nullptr;
-        specializationInfo.dataSize = 0;
-        specializationInfo.pData = nullptr;
+        specializationInfo.mapEntryCount = static_cast<uint32_t>(specEntries.size());
+        specializationInfo.pMapEntries = specEntries.data();
+        specializationInfo.dataSize = specData.size() * sizeof(uint32_t);
+        specializationInfo.pData = specData.data();
         stageInfo.pSpecializationInfo = &specializationInfo;
 
         VkPipelineLayoutCreateInfo layoutInfo = {};
@@ -175,12 +778,47 @@ namespace runtime
         layoutInfo.pNext = nullptr;
         layoutInfo.setLayoutCount = static_cast<uint32_t>(layouts.size());
         layoutInfo.pSetLayouts = layouts.data();
-        layoutInfo.pushConstantRangeCount = 0;
-        layoutInfo.pPushConstantRanges = nullptr;
+        layoutInfo.pushConstantRangeCount = m_pushRange.size > 0 ? 1 : 0;
+        layoutInfo.pPushConstantRanges = m_pushRange.size > 0 ? &m_pushRange : nullptr;
 
         check_result(vkCreatePipelineLayout(m_device, &layoutInfo, nullptr, &m_pipelineLayout),
                      "failed create pipelinelayout");
 
+        // Update templates for sets that only hold buffers, one packed VkDescriptorBufferInfo per binding
+        m_updateTemplates.assign(layouts.size(), VK_NULL_HANDLE);
+        for (size_t i = 0; i < layouts.size(); ++i)
+        {
+            std::vector<VkDescriptorUpdateTemplateEntry> entries(bindings[i].size());
+            bool buffersOnly = true;
+            for (size_t j = 0; j < bindings[i].size(); ++j)
+            {
+                const VkDescriptorType type = bindings[i][j].descriptorType;
+                buffersOnly &= isBufferDescriptor(type);
+                entries[j].dstBinding = bindings[i][j].binding;
+                entries[j].dstArrayElement = 0;
+                entries[j].descriptorCount = 1;
+                entries[j].descriptorType = type;
+                entries[j].offset = j * sizeof(VkDescriptorBufferInfo);
+                entries[j].stride = sizeof(VkDescriptorBufferInfo);
+            }
+            if (!buffersOnly || entries.empty())
+                continue;
+
+            VkDescriptorUpdateTemplateCreateInfo templateInfo = {};
+            templateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+            templateInfo.descriptorUpdateEntryCount = static_cast<uint32_t>(entries.size());
+            templateInfo.pDescriptorUpdateEntries = entries.data();
+            templateInfo.templateType = m_mode == BindingMode::PushDescriptors
+                                            ? VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_PUSH_DESCRIPTORS_KHR
+                                            : VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+            templateInfo.descriptorSetLayout = layouts[i];
+            templateInfo.pipelineBindPoint = VK_PIPELINE_BIND_POINT_COMPUTE;
+            templateInfo.pipelineLayout = m_pipelineLayout;
+            templateInfo.set = static_cast<uint32_t>(i);
+            check_result(vkCreateDescriptorUpdateTemplate(m_device, &templateInfo, nullptr, &m_updateTemplates[i]),
+                         "failed to create descriptor update template");
+        }
+
         VkComputePipelineCreateInfo pipelineInfo = {};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
         pipelineInfo.pNext = nullptr;
@@ -192,12 +830,16 @@ namespace runtime
         check_result(vkCreateComputePipelines(m_device, pipeline_cache, 1, &pipelineInfo, nullptr, &m_pipeline),
                      "failed to create compute pipeline");
         spvReflectDestroyShaderModule(&ref_module);
-
-
     }
 
-    void Program::cleanup()
+    void PipelineState::cleanup()
     {
+        for (auto &updateTemplate : m_updateTemplates)
+        {
+            if (updateTemplate != VK_NULL_HANDLE)
+                vkDestroyDescriptorUpdateTemplate(m_device, updateTemplate, nullptr);
+        }
+        m_updateTemplates.clear();
         if (m_pipeline != VK_NULL_HANDLE)
         {
             vkDestroyPipeline(m_device, m_pipeline, nullptr);
@@ -214,8 +856,174 @@ namespace runtime
             m_module = VK_NULL_HANDLE;
         }
     }
-    
 
+    void Program::initialize(std::shared_ptr<DescriptorAllocator> &descAllocator)
+    {
+        m_pipeline = m_state->getPipeline();
+        m_pipelineLayout = m_state->getPipelineLayout();
+        m_layouts = m_state->getSetLayouts();
+        m_bindingAccess = m_state->getBindingAccess();
+        m_descAllocator = descAllocator;
+        m_pushData.assign(m_state->getPushConstantRange().size, 0);
+
+        writes = m_state->getWriteTemplates();
+        const size_t count = writes.size();
+        sets.resize(count);
+        m_args.resize(count);
+        m_argGenerations.resize(count);
+        m_chunkedArgs.resize(count);
+        m_templateData.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            m_args[i].resize(writes[i].size());
+            m_argGenerations[i].resize(writes[i].size());
+            m_chunkedArgs[i].resize(writes[i].size());
+            m_templateData[i].resize(writes[i].size());
+        }
+
+        // Pushed descriptors live in the command buffer, and bindless shaders have no sets
+        if (m_state->getBindingMode() == BindingMode::PushDescriptors || sets.empty())
+            return;
+        check_condition(descAllocator->allocate(sets.size(), sets.data(), m_layouts.data()),
+                        "failed to allocate descriptorPool");
+        for (size_t i = 0; i < count; ++i)
+        {
+            for (auto &write : writes[i])
+                write.dstSet = sets[i];
+        }
+    }
+
+    void Program::cleanup()
+    {
+        // Descriptor sets return with their pool; the pipeline objects belong to m_state
+        m_pipeline = VK_NULL_HANDLE;
+        m_pipelineLayout = VK_NULL_HANDLE;
+    }
 
+    std::shared_ptr<PipelineState> PipelineState::create(VkDevice device, VkPipelineCache pipeline_cache,
+                                                         std::shared_ptr<DescriptorLayoutCache> &descCache,
+                                                         const std::vector<uint32_t> &shader_code,
+                                                         const Specialization &specialization, BindingMode mode,
+                                                         uint32_t max_push_descriptors)
+    {
+        return std::make_shared<PipelineState>(device, pipeline_cache, descCache, shader_code, specialization, mode,
+                                               max_push_descriptors);
+    }
+
+    PipelineState::PipelineState(VkDevice device, VkPipelineCache pipeline_cache,
+                                 std::shared_ptr<DescriptorLayoutCache> &descCache,
+                                 const std::vector<uint32_t> &shader_code, const Specialization &specialization,
+                                 BindingMode mode, uint32_t max_push_descriptors)
+        : m_device(device)
+    {
+        initialize(pipeline_cache, descCache, shader_code, specialization, mode, max_push_descriptors);
+    }
+
+    PipelineState::~PipelineState()
+    {
+        cleanup();
+    }
+
+    // FNV-1a over the SPIR-V words, the specialization values and the binding mode
+    static size_t hashKey(const std::vector<uint32_t> &code, const Specialization &specialization, BindingMode mode)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](uint32_t word) {
+            hash ^= word;
+            hash *= 1099511628211ull;
+        };
+        for (uint32_t word : code)
+            mix(word);
+        for (const auto &[id, value] : specialization.getIds())
+        {
+            mix(id);
+            mix(value);
+        }
+        for (const auto &[name, value] : specialization.getNames())
+        {
+            for (char c : name)
+                mix(static_cast<uint8_t>(c));
+            mix(value);
+        }
+        mix(static_cast<uint32_t>(mode));
+        return static_cast<size_t>(hash);
+    }
+
+    std::shared_ptr<ProgramCache> ProgramCache::create(VkDevice device, VkPipelineCache pipeline_cache,
+                                                       std::shared_ptr<DescriptorLayoutCache> &descCache,
+                                                       uint32_t max_push_descriptors)
+    {
+        return std::make_shared<ProgramCache>(device, pipeline_cache, descCache, max_push_descriptors);
+    }
+
+    ProgramCache::ProgramCache(VkDevice device, VkPipelineCache pipeline_cache,
+                               std::shared_ptr<DescriptorLayoutCache> &descCache, uint32_t max_push_descriptors)
+        : m_device(device), m_pipeline_cache(pipeline_cache), m_descCache(descCache),
+          m_maxPushDescriptors(max_push_descriptors)
+    {
+    }
+
+    std::shared_ptr<PipelineState> ProgramCache::getPipeline(const std::vector<uint32_t> &shader_code,
+                                                             const Specialization &specialization, BindingMode mode)
+    {
+        Key key{shader_code, specialization, mode, hashKey(shader_code, specialization, mode)};
+        std::promise<std::shared_ptr<PipelineState>> promise;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto it = m_entries.find(key);
+            if (it != m_entries.end())
+            {
+                ++m_hits;
+                auto entry = it->second;
+                lock.unlock();
+                return entry.get();
+            }
+            ++m_misses;
+            m_entries.emplace(key, promise.get_future().share());
+        }
+
+        // Built unlocked so different shaders compile in parallel
+        try
+        {
+            auto state =
+                PipelineState::create(m_device, m_pipeline_cache, m_descCache, shader_code, specialization, mode,
+                                      m_maxPushDescriptors);
+            promise.set_value(state);
+            return state;
+        }
+        catch (...)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_entries.erase(key);
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    size_t ProgramCache::size() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_entries.size();
+    }
+
+    size_t ProgramCache::getHitCount() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_hits;
+    }
+
+    size_t ProgramCache::getMissCount() const
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_misses;
+    }
+
+    void ProgramCache::clear()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_entries.clear();
+    }
 
     } // namespace runtime
@@ -3,6 +3,7 @@
 #define VOLK_HH
 #include <volk.h>
 #endif // VOLK_HH
+#include "config.h"
 #include "queue.h"
 
 #include "program.h"
@@ -13,12 +14,180 @@
 
 #include <numeric>
 #include <algorithm>
+#include <bit>
+#include <iterator>
 
 #include <future>
 
 namespace runtime
 {
 
+    std::shared_ptr<CommandGraph> CommandGraph::create(VkDevice device, uint32_t queueFamilyIndex)
+    {
+        return std::make_shared<CommandGraph>(device, queueFamilyIndex);
+    }
+
+    CommandGraph::CommandGraph(VkDevice device, uint32_t queueFamilyIndex)
+        : m_device(device), m_queueFamilyIndex(queueFamilyIndex)
+    {
+        initialize(device, queueFamilyIndex);
+    }
+
+    CommandGraph::~CommandGraph()
+    {
+        cleanup();
+    }
+
+    VkCommandBuffer CommandGraph::getCommandBuffer() const
+    {
+        return m_commandBuffer;
+    }
+
+    uint32_t CommandGraph::getQueueFamilyIndex() const
+    {
+        return m_queueFamilyIndex;
+    }
+
+    uint32_t CommandGraph::getDispatchCount() const
+    {
+        return m_dispatchCount;
+    }
+
+    void CommandGraph::set_future(const std::shared_future<int> &fut)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_futs.erase(std::remove_if(m_futs.begin(), m_futs.end(),
+                                    [](const std::shared_future<int> &f) {
+                                        return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                                    }),
+                     m_futs.end());
+        m_futs.push_back(fut);
+    }
+
+    void CommandGraph::wait()
+    {
+        std::vector<std::shared_future<int>> futs;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            futs = m_futs;
+        }
+        for (auto &fut : futs)
+            if (fut.valid())
+                fut.wait();
+    }
+
+    void CommandGraph::addWaits(const std::vector<TimelinePoint> &waits)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_waits.insert(m_waits.end(), waits.begin(), waits.end());
+    }
+
+    std::vector<TimelinePoint> CommandGraph::takeWaits()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::vector<TimelinePoint> waits;
+        waits.swap(m_waits);
+        return waits;
+    }
+
+    void CommandGraph::initialize(VkDevice device, uint32_t queueFamilyIndex)
+    {
+        VkCommandPoolCreateInfo poolInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+        poolInfo.pNext = nullptr;
+        poolInfo.flags = 0;
+        poolInfo.queueFamilyIndex = queueFamilyIndex;
+        check_result(vkCreateCommandPool(device, &poolInfo, nullptr, &m_commandPool),
+                     "failed to construct graph command pool");
+
+        VkCommandBufferAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+        allocInfo.pNext = nullptr;
+        allocInfo.commandPool = m_commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        check_result(vkAllocateCommandBuffers(device, &allocInfo, &m_commandBuffer),
+                     "failed to allocate graph command buffer");
+    }
+
+    void CommandGraph::cleanup()
+    {
+        // Replays may still be executing
+        wait();
+        std::vector<SubmitHook> hooks;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            hooks.swap(m_hooks);
+        }
+        for (auto &hook : hooks)
+            hook({VK_NULL_HANDLE, 0});
+        if (m_commandPool != VK_NULL_HANDLE)
+        {
+            vkFreeCommandBuffers(m_device, m_commandPool, 1, &m_commandBuffer);
+            vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+            m_commandPool = VK_NULL_HANDLE;
+        }
+    }
+
+    void CommandGraph::begin()
+    {
+        // Simultaneous use lets a replay be queued again before the previous one retires
+        VkCommandBufferBeginInfo beginInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+        beginInfo.pNext = nullptr;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+        beginInfo.pInheritanceInfo = nullptr;
+        check_result(vkBeginCommandBuffer(m_commandBuffer, &beginInfo), "failed to begin graph capture");
+        m_dispatchCount = 0;
+        m_tracker.reset();
+    }
+
+    void CommandGraph::end()
+    {
+        check_result(vkEndCommandBuffer(m_commandBuffer), "failed to end graph capture");
+    }
+
+    void CommandGraph::recordDispatch(VkPipeline pipeline, VkPipelineLayout layout, uint32_t n_sets,
+                                      const VkDescriptorSet *pDescriptors, VkPipelineBindPoint bindPoint,
+                                      uint32_t dim_x, uint32_t dim_y, uint32_t dim_z,
+                                      const std::vector<BufferAccess> &accesses,
+                                      const std::vector<VkBufferMemoryBarrier2> &barriers, const PushConstants &push,
+                                      const PushDescriptors &descriptors, SubmitHook onSubmit)
+    {
+        if (onSubmit)
+            m_hooks.push_back(std::move(onSubmit));
+
+        // Captured dispatches run in stream order; only real dependencies get a barrier
+        for (const auto &barrier : barriers)
+            m_tracker.addBarrier(barrier);
+        m_tracker.access(accesses);
+        m_tracker.flush(m_commandBuffer);
+
+        vkCmdBindPipeline(m_commandBuffer, bindPoint, pipeline);
+        if (descriptors.updateTemplate != VK_NULL_HANDLE)
+            vkCmdPushDescriptorSetWithTemplateKHR(m_commandBuffer, descriptors.updateTemplate, layout, 0,
+                                                  descriptors.data.data());
+        else if (n_sets > 0)
+            vkCmdBindDescriptorSets(m_commandBuffer, bindPoint, layout, 0, n_sets, pDescriptors, 0, nullptr);
+        if (!push.data.empty())
+            vkCmdPushConstants(m_commandBuffer, layout, push.stages, push.offset,
+                               static_cast<uint32_t>(push.data.size()), push.data.data());
+        vkCmdDispatch(m_commandBuffer, dim_x, dim_y, dim_z);
+        ++m_dispatchCount;
+    }
+
+    void CommandGraph::recordCopy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                                  const std::vector<BufferAccess> &accesses,
+                                  const std::vector<VkBufferMemoryBarrier2> &barriers)
+    {
+        for (const auto &barrier : barriers)
+            m_tracker.addBarrier(barrier);
+        m_tracker.access(accesses);
+        m_tracker.flush(m_commandBuffer);
+
+        vkCmdCopyBuffer(m_commandBuffer, src, dst, static_cast<uint32_t>(regions.size()), regions.data());
+    }
+
+    // Distinguishes managers in the per-thread arena cache; never reused, unlike addresses
+    static std::atomic<uint64_t> s_nextCommandPoolManagerId{1};
+
     std::shared_ptr<CommandPoolManager> CommandPoolManager::create(std::shared_ptr<ThreadPool> pool, VkDevice device,
                                                                uint32_t queueIndex,
                                                                VkQueueFamilyProperties queueFamilyProperties)
@@ -29,7 +198,8 @@ namespace runtime
     CommandPoolManager::CommandPoolManager(std::shared_ptr<ThreadPool> pool, VkDevice device, uint32_t queueIndex,
                                            VkQueueFamilyProperties queueFamilyProperties)
         : ready(false), m_device(device), m_queueFamilyProperties(queueFamilyProperties), m_commandPool(VK_NULL_HANDLE),
-          m_primaryCommandBuffer(VK_NULL_HANDLE), m_threadPool(pool), m_queueFamilyIndex(queueIndex)
+          m_queueFamilyIndex(queueIndex), m_threadPool(pool),
+          m_id(s_nextCommandPoolManagerId.fetch_add(1))
     {
         initialize(device, queueIndex);
     }
@@ -46,12 +216,45 @@ namespace runtime
 
     VkCommandBuffer CommandPoolManager::getPrimaryCommandBuffer()
     {
-        return m_primaryCommandBuffer;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_closed.empty() ? VK_NULL_HANDLE : m_closed.front().primary;
+    }
+
+    std::vector<VkCommandBuffer> CommandPoolManager::takePrimaryCommandBuffers(const std::shared_future<int> &fut,
+                                                                           std::vector<SubmitHook> &hooks)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::vector<VkCommandBuffer> primaries;
+        if (m_closed.empty())
+            return primaries;
+
+        primaries.reserve(m_closed.size());
+        for (auto &closed : m_closed)
+        {
+            primaries.push_back(closed.primary);
+            std::move(closed.hooks.begin(), closed.hooks.end(), std::back_inserter(hooks));
+        }
+        m_inflight.push_back({m_closed.back().epoch, fut, primaries});
+        m_closed.clear();
+        return primaries;
+    }
+
+    TimelinePoint CommandPoolManager::getLastSubmission()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_lastSubmission;
+    }
+
+    void CommandPoolManager::setLastSubmission(const TimelinePoint &point)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_lastSubmission = point;
     }
 
     std::vector<VkCommandBuffer> CommandPoolManager::getSecondaryCommandBuffer()
     {
-        return m_secondaryCommandBuffers;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_executed;
     }
 
     VkQueueFamilyProperties CommandPoolManager::getQueueFamilyProperties() const
@@ -59,48 +262,80 @@ namespace runtime
         return m_queueFamilyProperties;
     }
 
-    inline uint32_t CommandPoolManager::getQueueFamilyIndex() const
+    uint32_t CommandPoolManager::getQueueFamilyIndex() const
     {
         return m_queueFamilyIndex;
     }
 
-    size_t CommandPoolManager::findAvailableCommandBuffer()
+    CommandPoolManager::ThreadArena &CommandPoolManager::getThreadArena()
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        
-        // Wait with a timeout to prevent deadlock
-        auto waitResult = m_cv.wait_for(lock, std::chrono::seconds(2), 
-            [this] { return !used_buffers.all(); });
-        
-        if (!waitResult) {
-            throw std::runtime_error("Timeout waiting for available command buffer");
+        // Fast path: the last manager this thread recorded into
+        thread_local struct
+        {
+            uint64_t id = 0;
+            ThreadArena *arena = nullptr;
+        } cache;
+
+        if (cache.id == m_id)
+            return *cache.arena;
+
+        std::unique_lock<std::mutex> lock(m_arenaM);
+        auto &arena = m_arenas[std::this_thread::get_id()];
+        if (!arena)
+        {
+            arena = std::make_unique<ThreadArena>();
+            VkCommandPoolCreateInfo poolInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+            poolInfo.pNext = nullptr;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+            poolInfo.queueFamilyIndex = m_queueFamilyIndex;
+            check_result(vkCreateCommandPool(m_device, &poolInfo, nullptr, &arena->pool),
+                         "failed to construct per-thread command pool");
         }
+        cache.id = m_id;
+        cache.arena = arena.get();
+        return *arena;
+    }
 
-        for (size_t i = 0; i < SECONDARY_BUFFER; ++i)
+    VkCommandBuffer CommandPoolManager::acquireSecondary(ThreadArena &arena)
+    {
+        // Only the owning thread touches the arena, so no locking is needed here
+        uint64_t retired = m_retiredEpoch.load(std::memory_order_acquire);
+        while (!arena.retired.empty() && arena.retired.front().first <= retired)
         {
-            if (!used_buffers[i])
-            {
-                used_buffers.set(i); // Mark as used
-                return i;
-            }
+            arena.free.push_back(arena.retired.front().second);
+            arena.retired.pop_front();
         }
 
-        // This should never happen if the wait was successful
-        throw std::runtime_error("No available command buffer found");
+        if (arena.free.empty())
+        {
+            // Grow geometrically so deep models settle after a few epochs
+            uint32_t count = std::max<uint32_t>(4, static_cast<uint32_t>(arena.allocated.size()));
+            std::vector<VkCommandBuffer> buffers(count);
+
+            VkCommandBufferAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+            allocInfo.pNext = nullptr;
+            allocInfo.commandPool = arena.pool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            allocInfo.commandBufferCount = count;
+            check_result(vkAllocateCommandBuffers(m_device, &allocInfo, buffers.data()),
+                         "failed to allocate secondary command buffers");
+            arena.allocated.insert(arena.allocated.end(), buffers.begin(), buffers.end());
+            arena.free.insert(arena.free.end(), buffers.begin(), buffers.end());
+        }
+
+        VkCommandBuffer commandBuffer = arena.free.back();
+        arena.free.pop_back();
+        return commandBuffer;
     }
 
     bool CommandPoolManager::is_ready()
     {
+        // m_recorded is only non-empty between the last recording finishing and recordPrimary
         std::unique_lock<std::mutex> lock(m_mutex);
-        m_cv.wait(lock, [this] { return used_buffers.all() || ready; });
-        if (ready)
-        {
-            lock.unlock();
-            m_cv.notify_all();
-            return true;
-        }
-        return false;
-    }    void CommandPoolManager::set_future(const std::shared_future<int> &fut)
+        return m_pendingRecords.load() == 0 && m_recorded.empty();
+    }
+
+    void CommandPoolManager::set_future(const std::shared_future<int> &fut)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
         m_fut = fut;
@@ -143,37 +378,179 @@ namespace runtime
 
     void CommandPoolManager::submitCompute(VkPipeline pipeline, VkPipelineLayout layout, uint32_t n_sets,
                                            const VkDescriptorSet *pDescriptors, VkPipelineBindPoint bindPoint,
-                                           uint32_t dim_x, uint32_t dim_y, uint32_t dim_z)
-    {
-        m_threadPool->enqueue([=]() {
-            size_t cmd_idx = findAvailableCommandBuffer();
-            VkCommandBuffer commandBuffer = m_secondaryCommandBuffers[cmd_idx];
-                
-            secondaryCommandBufferRecord(commandBuffer, pipeline, layout, n_sets, pDescriptors, 
-                                        bindPoint, dim_x, dim_y, dim_z);
-                
+                                           uint32_t dim_x, uint32_t dim_y, uint32_t dim_z,
+                                           const std::vector<BufferAccess> &accesses,
+                                           const std::vector<VkBufferMemoryBarrier2> &barriers,
+                                           const PushConstants &push, const PushDescriptors &descriptors,
+                                           SubmitHook onSubmit)
+    {
+        // While capturing, dispatches go straight into the graph in call order
+        {
             std::unique_lock<std::mutex> lock(m_mutex);
-            used_buffers.reset(cmd_idx);
-                
-            // Check if all secondary command buffers are complete
-            if (!used_buffers.any()) {
-                // Create the primary command buffer only when all secondaries are done
-                m_threadPool->enqueue([this]() {
-                    primaryCommandBufferRecord(m_primaryCommandBuffer, 
-                                            used_buffers.count(),
-                                            m_secondaryCommandBuffers.data());
-                    std::unique_lock<std::mutex> readyLock(m_mutex);
-                    ready = true;
-                    readyLock.unlock();
-                    m_cv.notify_all();
-                });
+            if (m_capture)
+            {
+                m_capture->recordDispatch(pipeline, layout, n_sets, pDescriptors, bindPoint, dim_x, dim_y, dim_z,
+                                          accesses, barriers, push, descriptors, std::move(onSubmit));
+                return;
+            }
+        }
+
+        enqueueRecord(
+            [=](VkCommandBuffer commandBuffer) {
+                secondaryCommandBufferRecord(commandBuffer, pipeline, layout, n_sets, pDescriptors, bindPoint, dim_x,
+                                             dim_y, dim_z, push, descriptors);
+            },
+            accesses, barriers, std::move(onSubmit));
+    }
+
+    void CommandPoolManager::submitCopy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                                        const std::vector<VkBufferMemoryBarrier2> &barriers)
+    {
+        std::vector<BufferAccess> accesses;
+        accesses.reserve(regions.size() * 2);
+        for (const auto &region : regions)
+        {
+            accesses.push_back({src, region.srcOffset, region.size, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                                VK_ACCESS_2_TRANSFER_READ_BIT});
+            accesses.push_back({dst, region.dstOffset, region.size, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                                VK_ACCESS_2_TRANSFER_WRITE_BIT});
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_capture)
+            {
+                m_capture->recordCopy(src, dst, regions, accesses, barriers);
+                return;
             }
-                
-            lock.unlock();
-            m_cv.notify_all();
+        }
+
+        enqueueRecord([=](VkCommandBuffer commandBuffer) { secondaryCopyRecord(commandBuffer, src, dst, regions); },
+                      accesses, barriers);
+    }
+
+    void CommandPoolManager::addWaits(const std::vector<TimelinePoint> &waits)
+    {
+        if (waits.empty())
+            return;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_capture)
+            m_capture->addWaits(waits);
+        else
+            m_waits.insert(m_waits.end(), waits.begin(), waits.end());
+    }
+
+    std::vector<TimelinePoint> CommandPoolManager::takeWaits()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::vector<TimelinePoint> waits;
+        waits.swap(m_waits);
+        return waits;
+    }
+
+    void CommandPoolManager::enqueueRecord(std::function<void(VkCommandBuffer)> record,
+                                           const std::vector<BufferAccess> &accesses,
+                                           const std::vector<VkBufferMemoryBarrier2> &barriers, SubmitHook onSubmit)
+    {
+        // Slots keep dispatch order stable no matter which thread finishes recording first
+        uint64_t slot = m_nextSlot.fetch_add(1);
+        m_pendingRecords.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            ready = false;
+            collectRetiredEpochs();
+        }
+
+        m_threadPool->enqueue([=, this]() {
+            ThreadArena &arena = getThreadArena();
+            VkCommandBuffer commandBuffer = acquireSecondary(arena);
+
+            record(commandBuffer);
+
+            // The epoch cannot advance while this recording is pending
+            arena.retired.push_back({m_epoch.load(), commandBuffer});
+            finishRecording({slot, commandBuffer, accesses, barriers, onSubmit});
         });
     }
 
+    void CommandPoolManager::finishRecording(RecordedCommand &&recorded)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_recorded.push_back(std::move(recorded));
+        }
+
+        // Whoever finishes last records the primary for the epoch
+        if (m_pendingRecords.fetch_sub(1) == 1)
+            recordPrimary();
+    }
+
+    void CommandPoolManager::recordPrimary()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // Another recording may have started (or already closed the epoch) since we checked
+        if (m_pendingRecords.load() != 0 || m_recorded.empty())
+            return;
+
+        // Earlier epochs may still be waiting for submission or running: close this one into
+        // a primary of its own instead of waiting for them
+        collectRetiredEpochs();
+        VkCommandBuffer primary = VK_NULL_HANDLE;
+        if (!m_freePrimaries.empty())
+        {
+            primary = m_freePrimaries.back();
+            m_freePrimaries.pop_back();
+        }
+        else
+        {
+            VkCommandBufferAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+            allocInfo.pNext = nullptr;
+            allocInfo.commandPool = m_commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+            check_result(vkAllocateCommandBuffers(m_device, &allocInfo, &primary), "failed to allocate command buffer");
+            m_primaries.push_back(primary);
+        }
+
+        std::sort(m_recorded.begin(), m_recorded.end(),
+                  [](const RecordedCommand &a, const RecordedCommand &b) { return a.slot < b.slot; });
+        m_executed.clear();
+        for (const auto &recorded : m_recorded)
+            m_executed.push_back(recorded.commandBuffer);
+
+        primaryCommandBufferRecord(primary, m_recorded, m_tracker);
+        std::vector<SubmitHook> hooks;
+        for (auto &recorded : m_recorded)
+        {
+            if (recorded.onSubmit)
+                hooks.push_back(std::move(recorded.onSubmit));
+        }
+        m_recorded.clear();
+        m_closed.push_back({m_epoch.fetch_add(1), primary, std::move(hooks)});
+        ready = true;
+        auto onReady = m_onReady;
+        lock.unlock();
+        m_cv.notify_all();
+        if (onReady)
+            onReady();
+    }
+
+    void CommandPoolManager::collectRetiredEpochs()
+    {
+        // Caller holds m_mutex
+        while (!m_inflight.empty() &&
+               m_inflight.front().fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            auto &inflight = m_inflight.front();
+            m_retiredEpoch.store(inflight.epoch, std::memory_order_release);
+            m_freePrimaries.insert(m_freePrimaries.end(), inflight.primaries.begin(), inflight.primaries.end());
+            m_inflight.pop_front();
+        }
+        // With nothing left to run, the next epoch has no earlier work to wait on
+        if (m_inflight.empty() && m_closed.empty())
+            m_tracker.reset();
+    }
+
     void CommandPoolManager::setPromise(std::shared_ptr<std::promise<int>> promise)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
@@ -186,42 +563,86 @@ namespace runtime
         return m_cv.wait_for(lock, timeout, [this] { return ready; });
     }
 
+    void CommandPoolManager::setReadyCallback(std::function<void()> callback)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_onReady = std::move(callback);
+    }
+
+    void CommandPoolManager::beginCapture()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        check_condition(m_capture == nullptr, "CommandPoolManager::beginCapture: capture already in progress");
+        m_capture = CommandGraph::create(m_device, m_queueFamilyIndex);
+        m_capture->begin();
+    }
+
+    std::shared_ptr<CommandGraph> CommandPoolManager::endCapture()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        check_condition(m_capture != nullptr, "CommandPoolManager::endCapture: no capture in progress");
+        auto graph = std::move(m_capture);
+        m_capture.reset();
+        graph->end();
+        return graph;
+    }
+
+    bool CommandPoolManager::isCapturing()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_capture != nullptr;
+    }
+
     void CommandPoolManager::initialize(VkDevice device, uint32_t queueIndex)
     {        
-        // make multiple commandPools for different tasks or asignments.. primary buffer asignments.
+        // The manager's own pool only holds the primaries; secondaries come from per-thread arenas
         VkCommandPoolCreateInfo poolInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
         poolInfo.pNext = nullptr;
         poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
         poolInfo.queueFamilyIndex = queueIndex;
         check_result(vkCreateCommandPool(device, &poolInfo, nullptr, &m_commandPool), "failed to construct command pool");
-
-        VkCommandBufferAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
-        allocInfo.pNext = nullptr;
-        allocInfo.commandPool = m_commandPool;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = 1;
-        check_result(vkAllocateCommandBuffers(device, &allocInfo, &m_primaryCommandBuffer),
-                     "failed to allocate command buffer");
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
-        m_secondaryCommandBuffers.resize(SECONDARY_BUFFER);
-        allocInfo.commandBufferCount = m_secondaryCommandBuffers.size();
-        check_result(vkAllocateCommandBuffers(device, &allocInfo, m_secondaryCommandBuffers.data()),
-                    "failed to allocate secondary command buffers");
     }
 
     void CommandPoolManager::cleanup()
     {
-        vkFreeCommandBuffers(m_device, m_commandPool, m_secondaryCommandBuffers.size(),
-                             m_secondaryCommandBuffers.data());
-        vkFreeCommandBuffers(m_device, m_commandPool, 1, &m_primaryCommandBuffer);
+        std::vector<SubmitHook> dropped;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for (auto &inflight : m_inflight)
+                inflight.fut.wait();
+            m_inflight.clear();
+            // Work that was recorded but never submitted
+            for (auto &closed : m_closed)
+                std::move(closed.hooks.begin(), closed.hooks.end(), std::back_inserter(dropped));
+            for (auto &recorded : m_recorded)
+            {
+                if (recorded.onSubmit)
+                    dropped.push_back(std::move(recorded.onSubmit));
+            }
+            m_closed.clear();
+            m_recorded.clear();
+        }
+        for (auto &hook : dropped)
+            hook({VK_NULL_HANDLE, 0});
+
+        std::unique_lock<std::mutex> lock(m_arenaM);
+        for (auto &entry : m_arenas)
+        {
+            auto &arena = entry.second;
+            if (!arena->allocated.empty())
+                vkFreeCommandBuffers(m_device, arena->pool, static_cast<uint32_t>(arena->allocated.size()),
+                                     arena->allocated.data());
+            vkDestroyCommandPool(m_device, arena->pool, nullptr);
+        }
+        m_arenas.clear();
+
+        if (!m_primaries.empty())
+            vkFreeCommandBuffers(m_device, m_commandPool, static_cast<uint32_t>(m_primaries.size()),
+                                 m_primaries.data());
         vkDestroyCommandPool(m_device, m_commandPool, nullptr);
     }
 
-    void CommandPoolManager::secondaryCommandBufferRecord(VkCommandBuffer commandBuffer, VkPipeline pipeline,
-                                                          VkPipelineLayout layout, uint32_t n_sets,
-                                                          const VkDescriptorSet *pDescriptors,
-                                                          VkPipelineBindPoint bindPoint, uint32_t dim_x,
-                                                          uint32_t dim_y, uint32_t dim_z)
+    void CommandPoolManager::beginSecondary(VkCommandBuffer commandBuffer)
     {
         VkCommandBufferInheritanceRenderingInfo inheritanceRenderingInfo = {};
         inheritanceRenderingInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
@@ -242,23 +663,72 @@ namespace runtime
         beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
         beginInfo.pInheritanceInfo = &inheritanceInfo;
         vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    }
+
+    void CommandPoolManager::secondaryCommandBufferRecord(VkCommandBuffer commandBuffer, VkPipeline pipeline,
+                                                          VkPipelineLayout layout, uint32_t n_sets,
+                                                          const VkDescriptorSet *pDescriptors,
+                                                          VkPipelineBindPoint bindPoint, uint32_t dim_x,
+                                                          uint32_t dim_y, uint32_t dim_z, const PushConstants &push,
+                                                          const PushDescriptors &descriptors)
+    {
+        beginSecondary(commandBuffer);
         vkCmdBindPipeline(commandBuffer, bindPoint, pipeline);
-        vkCmdBindDescriptorSets(commandBuffer, bindPoint, layout, 0, n_sets, pDescriptors,
-                                0, nullptr);
+        if (descriptors.updateTemplate != VK_NULL_HANDLE)
+            vkCmdPushDescriptorSetWithTemplateKHR(commandBuffer, descriptors.updateTemplate, layout, 0,
+                                                  descriptors.data.data());
+        else if (n_sets > 0)
+            vkCmdBindDescriptorSets(commandBuffer, bindPoint, layout, 0, n_sets, pDescriptors, 0, nullptr);
+        if (!push.data.empty())
+            vkCmdPushConstants(commandBuffer, layout, push.stages, push.offset, static_cast<uint32_t>(push.data.size()),
+                               push.data.data());
 
         vkCmdDispatch(commandBuffer, dim_x, dim_y, dim_z);
         vkEndCommandBuffer(commandBuffer);
     }
 
-    void CommandPoolManager::primaryCommandBufferRecord(VkCommandBuffer commandBuffer, uint32_t n_cmds,
-                                                        const VkCommandBuffer *pCmdBuffers)
+    void CommandPoolManager::secondaryCopyRecord(VkCommandBuffer commandBuffer, VkBuffer src, VkBuffer dst,
+                                                 const std::vector<VkBufferCopy> &regions)
+    {
+        beginSecondary(commandBuffer);
+        vkCmdCopyBuffer(commandBuffer, src, dst, static_cast<uint32_t>(regions.size()), regions.data());
+        vkEndCommandBuffer(commandBuffer);
+    }
+
+    void CommandPoolManager::primaryCommandBufferRecord(VkCommandBuffer commandBuffer,
+                                                        const std::vector<RecordedCommand> &recorded,
+                                                        BarrierTracker &tracker)
     {
         VkCommandBufferBeginInfo primaryBeginInfo = {};
         primaryBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
         primaryBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
         primaryBeginInfo.pNext = nullptr;
         vkBeginCommandBuffer(commandBuffer, &primaryBeginInfo);
-        vkCmdExecuteCommands(commandBuffer, n_cmds, pCmdBuffers);
+
+        // Secondaries with no dependency between them go out in one vkCmdExecuteCommands;
+        // a hazard closes the run, emits the batched barrier and starts a new one. The tracker
+        // still holds the accesses of earlier epochs, which are submitted ahead of this one.
+        std::vector<VkCommandBuffer> run;
+        run.reserve(recorded.size());
+        for (const auto &command : recorded)
+        {
+            for (const auto &barrier : command.barriers)
+                tracker.addBarrier(barrier);
+            tracker.access(command.accesses);
+            if (tracker.hasPending())
+            {
+                if (!run.empty())
+                {
+                    vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(run.size()), run.data());
+                    run.clear();
+                }
+                tracker.flush(commandBuffer);
+            }
+            run.push_back(command.commandBuffer);
+        }
+        if (!run.empty())
+            vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(run.size()), run.data());
+
         vkEndCommandBuffer(commandBuffer);
     }
 
@@ -269,6 +739,7 @@ namespace runtime
     }
 
     QueueManager::QueueManager(VkPhysicalDevice &pDevice, const std::vector<uint32_t> &queue_count)
+        : m_batchMaxCount(SUBMIT_BATCH_MAX_COUNT), m_batchWindow(SUBMIT_BATCH_WINDOW_US)
     {
         initialize(pDevice, queue_count);
     }
@@ -280,148 +751,506 @@ namespace runtime
            
     VkQueue QueueManager::getSparseQueue(uint32_t i) const
     {
-        return nullptr;
+        uint32_t family = getQueueFamilyIndex(VK_QUEUE_SPARSE_BINDING_BIT);
+        for (const auto &queueData : m_queueData)
+        {
+            if (queueData->queueFamilyIndex == family && queueData->queueIndex == i)
+                return queueData->queue;
+        }
+        return VK_NULL_HANDLE;
     }
-    
+
+    VkSemaphore QueueManager::createTimelineSemaphore(VkDevice device)
+    {
+        VkSemaphoreTypeCreateInfo typeInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO};
+        typeInfo.pNext = nullptr;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+
+        VkSemaphoreCreateInfo semaphoreInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+        semaphoreInfo.pNext = &typeInfo;
+        semaphoreInfo.flags = 0;
+
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+        check_result(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore),
+                     "Failed to create timeline semaphore");
+        return semaphore;
+    }
+
     void QueueManager::start(std::shared_ptr<ThreadPool> pool, VkPhysicalDevice &pDevice, VkDevice &device)
     {
         m_threadPool = pool;
         m_device = device;
-        for (int i = 0; i < m_queueCreateInfos.size(); ++i)
+        for (auto &queueData : m_queueData)
         {
-            uint32_t queuePacketindex = m_queueFlags.front();
-            m_queueFlags.pop();
-
-            vkGetDeviceQueue(device, m_queueData[queuePacketindex] ->queueFamilyIndex,
-                             m_queueData[queuePacketindex]->queueIndex, &m_queueData[queuePacketindex]->queue);
-            VkFenceCreateInfo fenceInfo = {VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
-            fenceInfo.pNext = nullptr;
-            fenceInfo.flags = 0;
-            vkCreateFence(device, &fenceInfo, nullptr, &m_queueData[queuePacketindex]->fence);
-            m_queueFlags.push(queuePacketindex);
+            vkGetDeviceQueue(device, queueData->queueFamilyIndex, queueData->queueIndex, &queueData->queue);
+            queueData->timeline = createTimelineSemaphore(device);
+            queueData->timelineValue = 0;
         }
- 
-    }    void QueueManager::run(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPoolManagers, uint32_t i)
+
+        m_wakeSemaphore = createTimelineSemaphore(device);
+        m_wakeValue = 0;
+        m_stopping = false;
+        m_completionThread = std::thread(&QueueManager::completionLoop, this);
+        m_submitStopping = false;
+        m_submitThread = std::thread(&QueueManager::submitLoop, this);
+    }
+
+    std::shared_future<int> QueueManager::run(const std::vector<std::shared_ptr<CommandPoolManager>> &cmdPoolManagers,
+                                              uint32_t i)
     {
         check_condition(i < m_queueData.size(), "QueueManager::run: Queue index out of range");
 
         // Create a shared promise that will be fulfilled when the work is complete
         auto shared_promise = std::make_shared<std::promise<int>>();
         auto shared_future = shared_promise->get_future().share();
-        
-        // First make sure all command pool managers have the future before starting work
-        for (auto& cmd_pool : cmdPoolManagers) {
+
+        if (cmdPoolManagers.empty())
+        {
+            shared_promise->set_value(0);
+            return shared_future;
+        }
+
+        // A pool listed twice would have its one-time-submit primary submitted twice
+        std::vector<std::shared_ptr<CommandPoolManager>> cmdPools;
+        cmdPools.reserve(cmdPoolManagers.size());
+        for (auto &cmd_pool : cmdPoolManagers)
+            if (std::find(cmdPools.begin(), cmdPools.end(), cmd_pool) == cmdPools.end())
+                cmdPools.push_back(cmd_pool);
+
+        // First make sure all command pool managers have the future and promise before starting work
+        std::vector<TimelinePoint> waits;
+        std::weak_ptr<QueueManager> weak = weak_from_this();
+        for (auto& cmd_pool : cmdPools) {
             cmd_pool->set_future(shared_future);
+            cmd_pool->setPromise(shared_promise);
+            cmd_pool->setReadyCallback([weak]() {
+                if (auto self = weak.lock())
+                    self->wakeSubmitThread();
+            });
+            auto pool_waits = cmd_pool->takeWaits();
+            waits.insert(waits.end(), pool_waits.begin(), pool_waits.end());
         }
-        
-        // Now submit the work to the queue
+
+        // Hand the work to the submission thread, which coalesces it with its neighbours
+        beginSubmits(1);
         {
             std::unique_lock<std::mutex> lock(m_workPoolM);
-            m_cmdPoolQueue.push({cmdPoolManagers, shared_promise});
+            m_cmdPoolQueue.push({cmdPools, nullptr, shared_promise, shared_future, cmdPools[0]->getQueueFamilyIndex(),
+                                 std::move(waits)});
         }
         m_workPoolC.notify_one();
 
-        // Second stage: Process enqueued work in a thread pool task
-        m_threadPool->enqueue([this]() {
-            // Get the work item
-            std::vector<std::shared_ptr<CommandPoolManager>> cmd_pool_work;
-            std::shared_ptr<std::promise<int>> work_promise;
+        return shared_future;
+    }
+
+    std::shared_future<int> QueueManager::run(const std::shared_ptr<CommandGraph> &graph)
+    {
+        check_condition(graph != nullptr, "QueueManager::run: graph is null");
+
+        auto shared_promise = std::make_shared<std::promise<int>>();
+        auto shared_future = shared_promise->get_future().share();
+        graph->set_future(shared_future);
+
+        beginSubmits(1);
+        {
+            std::unique_lock<std::mutex> lock(m_workPoolM);
+            m_cmdPoolQueue.push({{}, graph, shared_promise, shared_future, graph->getQueueFamilyIndex(),
+                                 graph->takeWaits()});
+        }
+        m_workPoolC.notify_one();
+
+        return shared_future;
+    }
+
+    void QueueManager::setSubmitBatchWindow(uint32_t max_count, std::chrono::microseconds window)
+    {
+        std::unique_lock<std::mutex> lock(m_workPoolM);
+        m_batchMaxCount = std::max<uint32_t>(1, max_count);
+        m_batchWindow = window;
+    }
+
+    void QueueManager::wakeSubmitThread()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_workPoolM);
+            m_poolReady = true;
+        }
+        m_workPoolC.notify_one();
+    }
+
+    void QueueManager::submitLoop()
+    {
+        std::vector<SubmitWork> batch;
+        std::vector<SubmitWork> deferred;
+        while (true)
+        {
             {
                 std::unique_lock<std::mutex> lock(m_workPoolM);
-                m_workPoolC.wait(lock, [this]() { return !m_cmdPoolQueue.empty(); });
-                auto work_item = std::move(m_cmdPoolQueue.front());
-                cmd_pool_work = std::move(work_item.first);
-                work_promise = std::move(work_item.second);
-                m_cmdPoolQueue.pop();
+                // Deferred work is retried once a pool has finished recording; on shutdown it
+                // is still flushed, since recording always finishes
+                m_workPoolC.wait(lock, [&]() {
+                    if (!m_cmdPoolQueue.empty())
+                        return true;
+                    return deferred.empty() ? m_submitStopping : m_poolReady;
+                });
+                if (m_submitStopping && m_cmdPoolQueue.empty() && deferred.empty())
+                    return;
+
+                // Give the window a chance to fill before flushing, unless we are shutting down
+                if (!m_cmdPoolQueue.empty())
+                {
+                    auto deadline = std::chrono::steady_clock::now() + m_batchWindow;
+                    m_workPoolC.wait_until(lock, deadline, [this]() {
+                        return m_submitStopping || m_cmdPoolQueue.size() >= m_batchMaxCount;
+                    });
+                }
+
+                // Deferred work was queued first and keeps its place
+                m_poolReady = false;
+                batch.swap(deferred);
+                while (!m_cmdPoolQueue.empty())
+                {
+                    batch.push_back(std::move(m_cmdPoolQueue.front()));
+                    m_cmdPoolQueue.pop();
+                }
             }
-            
-            if (cmd_pool_work.empty() || !work_promise) {
-                return;
+            size_t count = batch.size();
+            submitBatch(batch, deferred);
+            finishSubmits(count - deferred.size());
+            batch.clear();
+        }
+    }
+
+    void QueueManager::submitBatch(std::vector<SubmitWork> &batch, std::vector<SubmitWork> &deferred)
+    {
+        // Group by queue family while keeping submission order within each family
+        std::stable_sort(batch.begin(), batch.end(), [](const SubmitWork &a, const SubmitWork &b) {
+            return a.queueFamilyIndex < b.queueFamilyIndex;
+        });
+
+        std::vector<VkCommandBufferSubmitInfo> cmdInfos;
+        std::vector<VkSemaphoreSubmitInfo> waitInfos;
+        std::vector<VkSemaphoreSubmitInfo> signalInfos;
+        std::vector<VkSubmitInfo2> submitInfos;
+        std::vector<PendingCompletion> completions;
+
+        for (size_t first = 0; first < batch.size();)
+        {
+            size_t last = first;
+            while (last < batch.size() && batch[last].queueFamilyIndex == batch[first].queueFamilyIndex)
+                ++last;
+
+            // Never wait on a recorder here, it would hold back everything behind it. Work with
+            // a pool still recording is deferred, and so is later work sharing a pool with it,
+            // which keeps each pool's submissions in order. Captured graphs are already recorded.
+            std::vector<size_t> ready;
+            std::vector<CommandPoolManager *> waiting;
+            for (size_t w = first; w < last; ++w)
+            {
+                auto &work = batch[w];
+                bool is_ready = true;
+                for (auto &cmd_pool : work.cmdPools)
+                    is_ready = is_ready && std::find(waiting.begin(), waiting.end(), cmd_pool.get()) == waiting.end() &&
+                               cmd_pool->is_ready();
+                if (!is_ready)
+                {
+                    for (auto &cmd_pool : work.cmdPools)
+                        waiting.push_back(cmd_pool.get());
+                    deferred.push_back(std::move(work));
+                    continue;
+                }
+                ready.push_back(w);
             }
-            
+            if (ready.empty())
+            {
+                first = last;
+                continue;
+            }
+
             uint32_t queuePacketindex = 0;
-            // Find compatible queue
+            if (!acquireQueue(batch[first].queueFamilyIndex, queuePacketindex))
             {
-                std::unique_lock<std::mutex> lock(m_QueueM);
-                auto targetFamilyIndex = cmd_pool_work[0]->getQueueFamilyIndex();
-                
-                // Use a timeout to prevent indefinite waiting
-                auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
-                
-                while (true) {
-                    // Wait for any queue to become available
-                    auto waitResult = m_QueueC.wait_until(lock, deadline, [this]() { 
-                        return !m_queueFlags.empty(); 
-                    });
-                    
-                    if (!waitResult) {
-                        // Timeout occurred
-                        work_promise->set_exception(
-                            std::make_exception_ptr(std::runtime_error("Queue wait timeout")));
-                        return;
-                    }
-                    
-                    queuePacketindex = m_queueFlags.front();
-                    m_queueFlags.pop();
-                    
-                    // Check if this queue matches the required family index
-                    if (m_queueData[queuePacketindex]->queueFamilyIndex == targetFamilyIndex) {
-                        break;
-                    }
-                    
-                    // If not compatible, put it back and continue searching
-                    m_queueFlags.push(queuePacketindex);
+                for (size_t w : ready)
+                    batch[w].promise->set_exception(std::make_exception_ptr(std::runtime_error("Queue wait timeout")));
+                first = last;
+                continue;
+            }
+            auto &queueData = m_queueData[queuePacketindex];
+
+            // Collect every item's command buffers and waits first. A pool queued by several
+            // items goes out with the first of them; its epochs recorded on another queue
+            // must have been submitted before these.
+            std::vector<std::vector<VkCommandBuffer>> commandBuffers(ready.size());
+            std::vector<std::vector<TimelinePoint>> waits(ready.size());
+            std::vector<std::vector<SubmitHook>> hooks(ready.size());
+            std::vector<std::pair<CommandPoolManager *, size_t>> submitted;
+            size_t n_cmds = 0;
+            size_t n_waits = 0;
+            for (size_t r = 0; r < ready.size(); ++r)
+            {
+                auto &work = batch[ready[r]];
+                waits[r] = work.waits;
+                if (work.graph)
+                    commandBuffers[r].push_back(work.graph->getCommandBuffer());
+                for (auto &cmd_pool : work.cmdPools)
+                {
+                    if (std::any_of(submitted.begin(), submitted.end(),
+                                    [&](const auto &entry) { return entry.first == cmd_pool.get(); }))
+                        continue;
+                    auto primaries = cmd_pool->takePrimaryCommandBuffers(work.future, hooks[r]);
+                    if (primaries.empty())
+                        continue;
+                    TimelinePoint previous = cmd_pool->getLastSubmission();
+                    if (previous.semaphore != VK_NULL_HANDLE && previous.semaphore != queueData->timeline)
+                        waits[r].push_back(previous);
+                    commandBuffers[r].insert(commandBuffers[r].end(), primaries.begin(), primaries.end());
+                    submitted.push_back({cmd_pool.get(), r});
                 }
-            }            // Pre-prepare each command pool
-            std::vector<VkCommandBuffer> buffers;
-            buffers.reserve(cmd_pool_work.size());
-            
-            // First pass - ensure all command pools are ready before submission
-            for (auto& cmd_pool : cmd_pool_work) {
-                // Share the promise with command pool - not the future, which was already set earlier
-                cmd_pool->setPromise(work_promise);
-                
-                // Wait for the command pool to be ready (with timeout)
-                if (!cmd_pool->waitForReady(std::chrono::seconds(5))) {
-                    // If timeout occurs, release the queue and set exception
-                    std::unique_lock<std::mutex> lock(m_QueueM);
-                    m_queueFlags.push(queuePacketindex);
-                    work_promise->set_exception(
-                        std::make_exception_ptr(std::runtime_error("Command pool not ready in time")));
-                    LOG_ERROR("Timeout waiting for command pool to be ready");
-                    return;
+                n_cmds += commandBuffers[r].size();
+                n_waits += waits[r].size();
+            }
+
+            // Reserve up front: VkSubmitInfo2 keeps pointers into these arrays
+            cmdInfos.clear();
+            waitInfos.clear();
+            signalInfos.clear();
+            submitInfos.clear();
+            completions.clear();
+            cmdInfos.reserve(n_cmds);
+            waitInfos.reserve(n_waits);
+            signalInfos.reserve(ready.size());
+            submitInfos.reserve(ready.size());
+            completions.reserve(ready.size());
+
+            uint64_t signal_value = queueData->timelineValue;
+            for (size_t r = 0; r < ready.size(); ++r)
+            {
+                size_t cmdOffset = cmdInfos.size();
+                size_t waitOffset = waitInfos.size();
+                for (const auto &wait : waits[r])
+                {
+                    VkSemaphoreSubmitInfo waitInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO};
+                    waitInfo.pNext = nullptr;
+                    waitInfo.semaphore = wait.semaphore;
+                    waitInfo.value = wait.value;
+                    waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+                    waitInfo.deviceIndex = 0;
+                    waitInfos.push_back(waitInfo);
                 }
-                buffers.push_back(cmd_pool->getPrimaryCommandBuffer());
+                for (VkCommandBuffer commandBuffer : commandBuffers[r])
+                {
+                    VkCommandBufferSubmitInfo cmdInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO};
+                    cmdInfo.pNext = nullptr;
+                    cmdInfo.commandBuffer = commandBuffer;
+                    cmdInfo.deviceMask = 0;
+                    cmdInfos.push_back(cmdInfo);
+                }
+
+                // Each work item signals its own point so its future retires independently
+                VkSemaphoreSubmitInfo signalInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO};
+                signalInfo.pNext = nullptr;
+                signalInfo.semaphore = queueData->timeline;
+                signalInfo.value = ++signal_value;
+                signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+                signalInfo.deviceIndex = 0;
+                signalInfos.push_back(signalInfo);
+
+                VkSubmitInfo2 submitInfo = {VK_STRUCTURE_TYPE_SUBMIT_INFO_2};
+                submitInfo.pNext = nullptr;
+                submitInfo.flags = 0;
+                submitInfo.waitSemaphoreInfoCount = static_cast<uint32_t>(waitInfos.size() - waitOffset);
+                submitInfo.pWaitSemaphoreInfos = waitInfos.data() + waitOffset;
+                submitInfo.commandBufferInfoCount = static_cast<uint32_t>(cmdInfos.size() - cmdOffset);
+                submitInfo.pCommandBufferInfos = cmdInfos.data() + cmdOffset;
+                submitInfo.signalSemaphoreInfoCount = 1;
+                submitInfo.pSignalSemaphoreInfos = &signalInfos.back();
+                submitInfos.push_back(submitInfo);
+
+                completions.push_back({queueData->timeline, signal_value, batch[ready[r]].promise});
             }
 
-            // Execute the command
-            try {
-                submitQueue(m_queueData[queuePacketindex]->fence, m_queueData[queuePacketindex]->queue,
-                            buffers.size(), buffers.data());
-                vkWaitForFences(m_device, 1, &m_queueData[queuePacketindex]->fence, VK_TRUE, UINT64_MAX);
-                work_promise->set_value(0); // Success
+            if (!submitInfos.empty())
+            {
+                try {
+                    submitQueue(queueData->queue, static_cast<uint32_t>(submitInfos.size()), submitInfos.data());
+                    queueData->timelineValue = signal_value;
+                    for (const auto &entry : submitted)
+                        entry.first->setLastSubmission({queueData->timeline, signalInfos[entry.second].value});
+                    trackCompletion(std::move(completions));
+                    for (size_t r = 0; r < ready.size(); ++r)
+                        for (auto &hook : hooks[r])
+                            hook({queueData->timeline, signalInfos[r].value});
+                    hooks.clear();
+                }
+                catch (const std::exception &e) {
+                    LOG_ERROR("Error in queue submission: %s", e.what());
+                    for (auto &completion : completions)
+                        completion.promise->set_exception(std::current_exception());
+                }
             }
-            catch (const std::exception &e) {
-                LOG_ERROR("Error in queue submission: %s", e.what());
-                work_promise->set_exception(std::make_exception_ptr(e));
+
+            releaseQueue(queuePacketindex);
+            // Nothing was submitted, so the work never runs
+            for (auto &item : hooks)
+                for (auto &hook : item)
+                    hook({VK_NULL_HANDLE, 0});
+            first = last;
+        }
+    }
+
+    bool QueueManager::acquireQueue(uint32_t queueFamilyIndex, uint32_t &queuePacketindex)
+    {
+        std::unique_lock<std::mutex> lock(m_QueueM);
+
+        // Use a timeout to prevent indefinite waiting
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+        while (true) {
+            // Wait for any queue to become available
+            auto waitResult = m_QueueC.wait_until(lock, deadline, [this]() {
+                return !m_queueFlags.empty();
+            });
+
+            if (!waitResult) {
+                return false;
             }
 
-            vkResetFences(m_device, 1, &m_queueData[queuePacketindex]->fence);
-            {
-                std::unique_lock<std::mutex> lock(m_QueueM);
+            // Look for a free queue of the requested family, leaving the others in place
+            for (size_t n = m_queueFlags.size(); n > 0; --n) {
+                queuePacketindex = m_queueFlags.front();
+                m_queueFlags.pop();
+                if (m_queueData[queuePacketindex]->queueFamilyIndex == queueFamilyIndex) {
+                    return true;
+                }
                 m_queueFlags.push(queuePacketindex);
             }
-            m_QueueC.notify_one();
-        });
+
+            if (m_QueueC.wait_until(lock, deadline) == std::cv_status::timeout) {
+                return false;
+            }
+        }
+    }
+
+    void QueueManager::releaseQueue(uint32_t queuePacketindex)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_QueueM);
+            m_queueFlags.push(queuePacketindex);
+        }
+        m_QueueC.notify_one();
+    }
+
+    void QueueManager::trackCompletion(std::vector<PendingCompletion> &&completions)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_completionM);
+            for (auto &completion : completions)
+                m_pending.push_back(std::move(completion));
+        }
+        m_completionC.notify_one();
+        wakeCompletionThread();
+    }
+
+    void QueueManager::wakeCompletionThread()
+    {
+        VkSemaphoreSignalInfo signalInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO};
+        signalInfo.pNext = nullptr;
+        signalInfo.semaphore = m_wakeSemaphore;
+
+        // Signal under the lock so concurrent wakers never move the counter backwards
+        std::unique_lock<std::mutex> lock(m_completionM);
+        signalInfo.value = ++m_wakeValue;
+        vkSignalSemaphore(m_device, &signalInfo);
+    }
+
+    void QueueManager::completionLoop()
+    {
+        std::vector<VkSemaphore> semaphores;
+        std::vector<uint64_t> values;
+
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_completionM);
+                m_completionC.wait(lock, [this]() { return m_stopping || !m_pending.empty(); });
+                if (m_stopping && m_pending.empty())
+                    return;
+
+                // Wait on every outstanding submission plus the wake semaphore so that newly
+                // tracked work (or shutdown) interrupts the wait.
+                semaphores.clear();
+                values.clear();
+                for (const auto &pending : m_pending)
+                {
+                    semaphores.push_back(pending.semaphore);
+                    values.push_back(pending.value);
+                }
+                semaphores.push_back(m_wakeSemaphore);
+                values.push_back(m_wakeValue + 1);
+            }
+
+            VkSemaphoreWaitInfo waitInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+            waitInfo.pNext = nullptr;
+            waitInfo.flags = VK_SEMAPHORE_WAIT_ANY_BIT;
+            waitInfo.semaphoreCount = static_cast<uint32_t>(semaphores.size());
+            waitInfo.pSemaphores = semaphores.data();
+            waitInfo.pValues = values.data();
+
+            VkResult result = vkWaitSemaphores(m_device, &waitInfo, UINT64_MAX);
+            if (result != VK_SUCCESS && result != VK_TIMEOUT)
+            {
+                LOG_ERROR("Timeline semaphore wait failed: %d", result);
+                failPending(result);
+                continue;
+            }
+            retireCompleted();
+        }
+    }
+
+    void QueueManager::retireCompleted()
+    {
+        std::vector<std::shared_ptr<std::promise<int>>> completed;
+        {
+            std::unique_lock<std::mutex> lock(m_completionM);
+            auto it = std::remove_if(m_pending.begin(), m_pending.end(), [&](const PendingCompletion &pending) {
+                uint64_t value = 0;
+                if (vkGetSemaphoreCounterValue(m_device, pending.semaphore, &value) != VK_SUCCESS ||
+                    value < pending.value)
+                    return false;
+                completed.push_back(pending.promise);
+                return true;
+            });
+            m_pending.erase(it, m_pending.end());
+        }
+        if (!completed.empty())
+            m_idleC.notify_all();
+
+        // Fulfil outside the lock so continuations can submit more work
+        for (auto &promise : completed)
+            promise->set_value(0);
+    }
+
+    void QueueManager::failPending(VkResult result)
+    {
+        std::vector<PendingCompletion> failed;
+        {
+            std::unique_lock<std::mutex> lock(m_completionM);
+            failed.swap(m_pending);
+        }
+        m_idleC.notify_all();
+        for (auto &pending : failed)
+            pending.promise->set_exception(
+                std::make_exception_ptr(VulkanError(result, "Timeline semaphore wait failed")));
     }
 
     uint32_t QueueManager::getQueueFamilyIndex(VkQueueFlagBits queue_flags) const
     {
-        for (size_t i = 0; i < m_queueFamilies.size(); ++i)
+        for (const auto &createInfo : m_queueCreateInfos)
         {
-            if (m_queueFamilies[i].queueFlags & queue_flags)
+            if (m_queueFamilies[createInfo.queueFamilyIndex].queueFlags & queue_flags)
             {
-                return i;
+                return createInfo.queueFamilyIndex;
             }
         }
         LOG_ERROR("Queue family index not found");
@@ -435,24 +1264,201 @@ namespace runtime
     }
     
 
-    void QueueManager::submitQueue(VkFence fence, VkQueue queue, uint32_t n_cmds, const VkCommandBuffer *pCmdBuffers,
-                                   const VkPipelineStageFlags *pWaitDstStageMask, uint32_t n_wait_semaphores,
-                                   const VkSemaphore *wait_semaphore, uint32_t n_signal_semaphores,
-                                   const VkSemaphore *signal_semaphores)
+    uint32_t QueueManager::getDedicatedQueueFamilyIndex(VkQueueFlagBits queue_flags) const
     {
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        const VkQueueFlags capabilities = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+        uint32_t best = UINT32_MAX;
+        int bestCount = INT32_MAX;
+        for (const auto &createInfo : m_queueCreateInfos)
+        {
+            VkQueueFlags flags = m_queueFamilies[createInfo.queueFamilyIndex].queueFlags;
+            if (!(flags & queue_flags))
+                continue;
+            int count = std::popcount(static_cast<uint32_t>(flags & capabilities));
+            if (count < bestCount)
+            {
+                best = createInfo.queueFamilyIndex;
+                bestCount = count;
+            }
+        }
+        if (best == UINT32_MAX)
+            return getQueueFamilyIndex(queue_flags);
+        return best;
+    }
+
+    std::shared_future<int> QueueManager::submitDirect(uint32_t queueFamilyIndex, VkCommandBuffer commandBuffer,
+                                                       const std::vector<TimelinePoint> &waits,
+                                                       TimelinePoint &signalled)
+    {
+        uint32_t queuePacketindex = 0;
+        if (!acquireQueue(queueFamilyIndex, queuePacketindex))
+            throw std::runtime_error("Queue wait timeout");
+        auto &queueData = m_queueData[queuePacketindex];
+
+        std::vector<VkSemaphoreSubmitInfo> waitInfos;
+        waitInfos.reserve(waits.size());
+        for (const auto &wait : waits)
+        {
+            VkSemaphoreSubmitInfo waitInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO};
+            waitInfo.pNext = nullptr;
+            waitInfo.semaphore = wait.semaphore;
+            waitInfo.value = wait.value;
+            waitInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            waitInfo.deviceIndex = 0;
+            waitInfos.push_back(waitInfo);
+        }
+
+        VkCommandBufferSubmitInfo cmdInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO};
+        cmdInfo.pNext = nullptr;
+        cmdInfo.commandBuffer = commandBuffer;
+        cmdInfo.deviceMask = 0;
+
+        uint64_t signal_value = queueData->timelineValue + 1;
+        VkSemaphoreSubmitInfo signalInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO};
+        signalInfo.pNext = nullptr;
+        signalInfo.semaphore = queueData->timeline;
+        signalInfo.value = signal_value;
+        signalInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+        signalInfo.deviceIndex = 0;
+
+        VkSubmitInfo2 submitInfo = {VK_STRUCTURE_TYPE_SUBMIT_INFO_2};
         submitInfo.pNext = nullptr;
-        submitInfo.commandBufferCount = n_cmds;
-        submitInfo.pCommandBuffers = pCmdBuffers;
-        submitInfo.pWaitDstStageMask = pWaitDstStageMask;
-        submitInfo.waitSemaphoreCount = n_wait_semaphores;
-        submitInfo.pWaitSemaphores = wait_semaphore;
-        submitInfo.signalSemaphoreCount = n_signal_semaphores;
-        submitInfo.pSignalSemaphores = signal_semaphores;
-        vkQueueSubmit(queue, 1, &submitInfo, fence);
+        submitInfo.flags = 0;
+        submitInfo.waitSemaphoreInfoCount = static_cast<uint32_t>(waitInfos.size());
+        submitInfo.pWaitSemaphoreInfos = waitInfos.data();
+        submitInfo.commandBufferInfoCount = 1;
+        submitInfo.pCommandBufferInfos = &cmdInfo;
+        submitInfo.signalSemaphoreInfoCount = 1;
+        submitInfo.pSignalSemaphoreInfos = &signalInfo;
+
+        auto shared_promise = std::make_shared<std::promise<int>>();
+        auto shared_future = shared_promise->get_future().share();
+        beginSubmits(1);
+        try
+        {
+            submitQueue(queueData->queue, 1, &submitInfo);
+        }
+        catch (...)
+        {
+            finishSubmits(1);
+            releaseQueue(queuePacketindex);
+            throw;
+        }
+        queueData->timelineValue = signal_value;
+        signalled = {queueData->timeline, signal_value};
+
+        std::vector<PendingCompletion> completions;
+        completions.push_back({queueData->timeline, signal_value, shared_promise});
+        trackCompletion(std::move(completions));
+        finishSubmits(1);
+        releaseQueue(queuePacketindex);
+        return shared_future;
+    }
+
+    std::shared_future<int> QueueManager::bindSparse(VkBuffer buffer, const std::vector<VkSparseMemoryBind> &binds,
+                                                     const std::vector<TimelinePoint> &waits,
+                                                     TimelinePoint &signalled)
+    {
+        uint32_t family = getQueueFamilyIndex(VK_QUEUE_SPARSE_BINDING_BIT);
+        check_condition(family != UINT32_MAX, "QueueManager::bindSparse: no sparse binding queue family");
+
+        uint32_t queuePacketindex = 0;
+        if (!acquireQueue(family, queuePacketindex))
+            throw std::runtime_error("Queue wait timeout");
+        auto &queueData = m_queueData[queuePacketindex];
+
+        // VkBindSparseInfo predates VkSemaphoreSubmitInfo: timeline values travel in pNext
+        std::vector<VkSemaphore> waitSemaphores;
+        std::vector<uint64_t> waitValues;
+        waitSemaphores.reserve(waits.size());
+        waitValues.reserve(waits.size());
+        for (const auto &wait : waits)
+        {
+            waitSemaphores.push_back(wait.semaphore);
+            waitValues.push_back(wait.value);
+        }
+
+        uint64_t signal_value = queueData->timelineValue + 1;
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+        timelineInfo.pNext = nullptr;
+        timelineInfo.waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size());
+        timelineInfo.pWaitSemaphoreValues = waitValues.data();
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &signal_value;
+
+        VkSparseBufferMemoryBindInfo bufferBind = {};
+        bufferBind.buffer = buffer;
+        bufferBind.bindCount = static_cast<uint32_t>(binds.size());
+        bufferBind.pBinds = binds.data();
+
+        VkBindSparseInfo bindInfo = {VK_STRUCTURE_TYPE_BIND_SPARSE_INFO};
+        bindInfo.pNext = &timelineInfo;
+        bindInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+        bindInfo.pWaitSemaphores = waitSemaphores.data();
+        bindInfo.bufferBindCount = 1;
+        bindInfo.pBufferBinds = &bufferBind;
+        bindInfo.imageOpaqueBindCount = 0;
+        bindInfo.pImageOpaqueBinds = nullptr;
+        bindInfo.imageBindCount = 0;
+        bindInfo.pImageBinds = nullptr;
+        bindInfo.signalSemaphoreCount = 1;
+        bindInfo.pSignalSemaphores = &queueData->timeline;
+
+        auto shared_promise = std::make_shared<std::promise<int>>();
+        auto shared_future = shared_promise->get_future().share();
+        beginSubmits(1);
+        VkResult result = vkQueueBindSparse(queueData->queue, 1, &bindInfo, VK_NULL_HANDLE);
+        if (result != VK_SUCCESS)
+        {
+            finishSubmits(1);
+            releaseQueue(queuePacketindex);
+            throw VulkanError(result, "vkQueueBindSparse failed");
+        }
+        queueData->timelineValue = signal_value;
+        signalled = {queueData->timeline, signal_value};
+
+        std::vector<PendingCompletion> completions;
+        completions.push_back({queueData->timeline, signal_value, shared_promise});
+        trackCompletion(std::move(completions));
+        finishSubmits(1);
+        releaseQueue(queuePacketindex);
+        return shared_future;
+    }
+
+    void QueueManager::beginSubmits(size_t count)
+    {
+        std::unique_lock<std::mutex> lock(m_completionM);
+        m_unsubmitted += count;
+    }
+
+    void QueueManager::finishSubmits(size_t count)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_completionM);
+            m_unsubmitted -= count;
+        }
+        m_idleC.notify_all();
+    }
+
+    void QueueManager::waitIdle()
+    {
+        std::unique_lock<std::mutex> lock(m_completionM);
+        m_idleC.wait(lock, [this]() { return m_unsubmitted == 0 && m_pending.empty(); });
+    }
+
+    std::shared_ptr<CommandPoolManager> QueueManager::createCommandPoolManager(VkQueueFlagBits queue_flags)
+    {
+        uint32_t family = getQueueFamilyIndex(queue_flags);
+        check_condition(family != UINT32_MAX, "QueueManager::createCommandPoolManager: no matching queue family");
+        return CommandPoolManager::create(m_threadPool, m_device, family, getQueueFamilyProperties(family));
+    }
+
+    void QueueManager::submitQueue(VkQueue queue, uint32_t n_submits, const VkSubmitInfo2 *pSubmits)
+    {
+        VkResult result = vkQueueSubmit2(queue, n_submits, pSubmits, VK_NULL_HANDLE);
+        if (result != VK_SUCCESS)
+            throw VulkanError(result, "vkQueueSubmit2 failed");
     }
-    
 
     bool QueueManager::initialize(VkPhysicalDevice &pDevice, const std::vector<uint32_t> &queue_count)
     { 
@@ -464,6 +1470,8 @@ namespace runtime
 
         vkGetPhysicalDeviceQueueFamilyProperties(pDevice, &queueFamilyCount, queueFamilies.data());
         size_t global_queue_count = std::accumulate(queue_count.begin(), queue_count.end(), 0);
+        // Indexed by queue family index
+        m_queueFamilies = queueFamilies;
         
         for (uint32_t i = 0; i < queueFamilies.size(); ++i)
         {
@@ -479,13 +1487,12 @@ namespace runtime
             queueCreateInfo.pQueuePriorities = priorites;
             m_queueCreateInfos.push_back(queueCreateInfo);
            
-            m_queueFamilies.insert(m_queueFamilies.begin(), queueCreateInfo.queueCount, queueFamily);
 
             for (uint32_t j = 0; j < queueCreateInfo.queueCount; ++j)
             {
                 m_queueFlags.push(m_queueData.size());
-                m_queueData.push_back(std::make_shared<QueueData>(nullptr, nullptr, queueCreateInfo.queueFamilyIndex, j,
-                                                                  std::promise<int>()));
+                m_queueData.push_back(std::make_shared<QueueData>(nullptr, VK_NULL_HANDLE,
+                                                                  queueCreateInfo.queueFamilyIndex, j, 0));
 
             }
         }
@@ -494,13 +1501,49 @@ namespace runtime
     
     void QueueManager::cleanup()
     {
-        while (m_queueFlags.empty() == false)
+        // Flush whatever is still queued before the watcher goes away
+        if (m_submitThread.joinable())
         {
-            auto queueIdx = m_queueFlags.front();
-            vkDestroyFence(m_device, m_queueData[queueIdx]->fence, nullptr);
-            m_queueFlags.pop();
+            {
+                std::unique_lock<std::mutex> lock(m_workPoolM);
+                m_submitStopping = true;
+            }
+            m_workPoolC.notify_all();
+            m_submitThread.join();
+        }
+
+        if (m_completionThread.joinable())
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_completionM);
+                m_stopping = true;
+            }
+            m_completionC.notify_all();
+            wakeCompletionThread();
+            m_completionThread.join();
+        }
+
+        if (m_device == VK_NULL_HANDLE)
+            return;
+
+        // Outstanding submissions must retire before their semaphores go away
+        for (auto &queueData : m_queueData)
+        {
+            if (queueData->timeline == VK_NULL_HANDLE)
+                continue;
+            VkSemaphoreWaitInfo waitInfo = {VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+            waitInfo.semaphoreCount = 1;
+            waitInfo.pSemaphores = &queueData->timeline;
+            waitInfo.pValues = &queueData->timelineValue;
+            vkWaitSemaphores(m_device, &waitInfo, UINT64_MAX);
+            vkDestroySemaphore(m_device, queueData->timeline, nullptr);
+            queueData->timeline = VK_NULL_HANDLE;
+        }
+        if (m_wakeSemaphore != VK_NULL_HANDLE)
+        {
+            vkDestroySemaphore(m_device, m_wakeSemaphore, nullptr);
+            m_wakeSemaphore = VK_NULL_HANDLE;
         }
-        
     }    
     
     std::shared_ptr<DescriptorLayoutCache> DescriptorLayoutCache::create(VkDevice device)
@@ -529,6 +1572,7 @@ namespace runtime
         // Build layout info object for cache lookup
         DescriptorLayoutInfo layoutInfo;
         layoutInfo.setNumber = set;
+        layoutInfo.flags = createInfo->flags;
         layoutInfo.bindings.reserve(createInfo->bindingCount);
 
         // Copy and ensure bindings are sorted
@@ -544,6 +1588,7 @@ namespace runtime
                   });
 
         // Check if we already have this layout cached
+        std::unique_lock<std::mutex> lock(m_mutex);
         auto it = m_layoutCache.find(layoutInfo);
         if (it != m_layoutCache.end())
         {
@@ -572,6 +1617,7 @@ namespace runtime
 
     void DescriptorLayoutCache::cleanup()
     {
+        std::unique_lock<std::mutex> lock(m_mutex);
         for (auto &layout : m_layoutCache)
         {
             vkDestroyDescriptorSetLayout(m_device, layout.second, nullptr);
@@ -601,6 +1647,7 @@ namespace runtime
 
     inline void DescriptorAllocator::resetPools()
     {
+        std::unique_lock<std::mutex> lock(m_mutex);
         for (auto p : usedPools)
         {
             vkResetDescriptorPool(m_device, p, 0);
@@ -612,6 +1659,7 @@ namespace runtime
 
     bool DescriptorAllocator::allocate(size_t n_sets, VkDescriptorSet *set, VkDescriptorSetLayout *layout)
     {
+        std::unique_lock<std::mutex> lock(m_mutex);
         if (currentPool == VK_NULL_HANDLE)
             currentPool = grabPool();
         
@@ -638,8 +1686,8 @@ namespace runtime
 
         if (needReallocate)
         {
+            // grabPool already records the pool as used
             currentPool = grabPool();
-            usedPools.push_back(currentPool);
             allocInfo.descriptorPool = currentPool;
             allocResult = vkAllocateDescriptorSets(m_device, &allocInfo, set);
             if (allocResult == VK_SUCCESS)
@@ -657,6 +1705,7 @@ namespace runtime
 
     inline void DescriptorAllocator::cleanup()
     {
+        std::unique_lock<std::mutex> lock(m_mutex);
         for (auto &pool : usedPools)
             vkDestroyDescriptorPool(m_device, pool, nullptr);
         for (auto &pool : freePools)
@@ -59,14 +59,21 @@ namespace runtime {
         return m_devices[device_id]->createWorkingBuffer(size, false);
     }
 
-    void Runtime::copyData(std::shared_ptr<Buffer> src, std::shared_ptr<Buffer> dst, size_t size)
+    std::shared_ptr<Buffer> Runtime::importHostBuffer(void *ptr, size_t size, uint32_t device_id)
     {
-        src->copyDataTo(dst, size);
+        check_condition(device_id < m_devices.size(), "Device ID is out of range");
+        return m_devices[device_id]->importHostBuffer(ptr, size);
+    }
+
+    std::shared_future<int> Runtime::copyData(std::shared_ptr<Buffer> src, std::shared_ptr<Buffer> dst, size_t size)
+    {
+        return src->copyDataTo(dst, size);
     }
 
-    void Runtime::copyData(void *src, std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset, size_t src_offset)
+    std::shared_future<int> Runtime::copyData(void *src, std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset,
+                                              size_t src_offset)
     {
-        dst->copyDataFrom(src, size, dst_offset, src_offset, VK_ACCESS_HOST_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+        return dst->copyDataFrom(src, size, dst_offset, src_offset, VK_ACCESS_HOST_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT);
     }
 
     void Runtime::copyData(std::shared_ptr<Buffer> src, void *dst, size_t size, size_t dst_offset, size_t src_offset)
@@ -0,0 +1,175 @@
+#include "staging.h"
+
+#include "error_handling.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace runtime
+{
+
+// Keeps every region aligned to the largest nonCoherentAtomSize seen in practice
+static constexpr VkDeviceSize kStagingAlignment = 256;
+
+std::shared_ptr<StagingRing> StagingRing::create(MemoryManager *memory_manager, VkDeviceSize capacity)
+{
+    return std::make_shared<StagingRing>(memory_manager, capacity);
+}
+
+StagingRing::StagingRing(MemoryManager *memory_manager, VkDeviceSize capacity)
+    : m_memory_manager(memory_manager),
+      // Rounded up so that a region of capacity() bytes still fits once aligned
+      m_capacity(std::max(kStagingAlignment, (capacity + kStagingAlignment - 1) & ~(kStagingAlignment - 1)))
+{
+    initialize();
+}
+
+StagingRing::~StagingRing()
+{
+    cleanup();
+}
+
+StagingRing::Region StagingRing::acquire(VkDeviceSize size)
+{
+    check_condition(size > 0, "StagingRing::acquire: empty region");
+    const VkDeviceSize aligned = (size + kStagingAlignment - 1) & ~(kStagingAlignment - 1);
+    check_condition(aligned <= m_capacity, "StagingRing::acquire: region larger than the ring");
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        reclaim();
+        if (m_used == 0)
+            m_head = 0;
+
+        if (m_used < m_capacity)
+        {
+            const VkDeviceSize tail = (m_head + m_capacity - m_used) % m_capacity;
+            VkDeviceSize offset = m_capacity;
+            VkDeviceSize consumed = 0;
+            if (m_head >= tail)
+            {
+                if (m_capacity - m_head >= aligned)
+                {
+                    offset = m_head;
+                    consumed = aligned;
+                }
+                else if (tail >= aligned)
+                {
+                    // Skip the unusable end of the ring; the padding retires with this region
+                    offset = 0;
+                    consumed = (m_capacity - m_head) + aligned;
+                }
+            }
+            else if (tail - m_head >= aligned)
+            {
+                offset = m_head;
+                consumed = aligned;
+            }
+
+            if (offset != m_capacity)
+            {
+                m_head = (offset + aligned) % m_capacity;
+                m_used += consumed;
+                uint64_t id = m_nextId++;
+                m_inflight.push_back({id, consumed, {}, false});
+                return {m_buffer, offset, size, static_cast<char *>(m_allocation_info.pMappedData) + offset, id};
+            }
+        }
+
+        // Out of space: wait for the oldest region to retire
+        Inflight &oldest = m_inflight.front();
+        if (oldest.released && oldest.fut.valid())
+        {
+            auto fut = oldest.fut;
+            lock.unlock();
+            fut.wait();
+            lock.lock();
+        }
+        else
+        {
+            m_released.wait(lock);
+        }
+    }
+}
+
+void StagingRing::release(const Region &region, std::shared_future<int> fut)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (auto &inflight : m_inflight)
+        {
+            if (inflight.id != region.id)
+                continue;
+            inflight.fut = std::move(fut);
+            inflight.released = true;
+            break;
+        }
+        reclaim();
+    }
+    m_released.notify_all();
+}
+
+void StagingRing::flush(const Region &region)
+{
+    m_memory_manager->flushMemory(m_allocation, region.size, region.offset);
+}
+
+void StagingRing::invalidate(const Region &region)
+{
+    m_memory_manager->invalidateMemory(m_allocation, region.size, region.offset);
+}
+
+VkDeviceSize StagingRing::capacity() const
+{
+    return m_capacity;
+}
+
+void StagingRing::reclaim()
+{
+    while (!m_inflight.empty())
+    {
+        auto &front = m_inflight.front();
+        if (!front.released)
+            break;
+        if (front.fut.valid() && front.fut.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            break;
+        m_used -= front.consumed;
+        m_inflight.pop_front();
+    }
+}
+
+bool StagingRing::initialize()
+{
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = m_capacity;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT;
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+    m_memory_manager->buildBuffer(bufferInfo, allocInfo, m_buffer, m_allocation, m_allocation_info);
+    check_condition(m_allocation_info.pMappedData != nullptr, "StagingRing: staging memory is not host visible");
+    return true;
+}
+
+void StagingRing::cleanup()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (auto &inflight : m_inflight)
+    {
+        if (inflight.fut.valid())
+            inflight.fut.wait();
+    }
+    m_inflight.clear();
+    m_used = 0;
+
+    if (m_buffer != VK_NULL_HANDLE)
+    {
+        m_memory_manager->destroyBuffer(m_buffer, m_allocation);
+        m_allocation = VK_NULL_HANDLE;
+    }
+}
+
+} // namespace runtime
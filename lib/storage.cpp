@@ -14,31 +14,145 @@
 #define VMA_VULKAN_VERSION 1003000
 #include <vk_mem_alloc.h>
 
+#include "config.h"
 #include "queue.h"
+#include "barrier.h"
+#include "staging.h"
+#include "transfer.h"
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <chrono>
 
 namespace runtime
 {
 
+static std::shared_future<int> readyFuture()
+{
+    std::promise<int> promise;
+    promise.set_value(0);
+    return promise.get_future().share();
+}
+
+// Keeps the newest point per timeline semaphore; earlier points on it are implied
+static void mergePoint(std::vector<TimelinePoint> &points, const TimelinePoint &point)
+{
+    auto it = std::find_if(points.begin(), points.end(),
+                           [&](const TimelinePoint &other) { return other.semaphore == point.semaphore; });
+    if (it == points.end())
+        points.push_back(point);
+    else
+        it->value = std::max(it->value, point.value);
+}
+
+// Pins buffers across a submission and records its timeline point as their last use
+class SubmissionPins
+{
+  public:
+    SubmissionPins(std::initializer_list<Buffer *> buffers) : m_buffers(buffers)
+    {
+        for (auto *buffer : m_buffers)
+            buffer->pin();
+    }
+    ~SubmissionPins()
+    {
+        for (auto *buffer : m_buffers)
+            buffer->unpin(m_point);
+    }
+    void submitted(const TimelinePoint &point)
+    {
+        m_point = point;
+    }
+
+  private:
+    std::vector<Buffer *> m_buffers;
+    TimelinePoint m_point{VK_NULL_HANDLE, 0};
+};
+
+static std::shared_future<int> failedFuture(VkResult result, std::string_view message)
+{
+    std::promise<int> promise;
+    promise.set_exception(std::make_exception_ptr(VulkanError(result, message)));
+    return promise.get_future().share();
+}
+
 std::shared_ptr<MemoryManager> MemoryManager::create(std::shared_ptr<QueueManager> &queue_manager,
                                                      VkPhysicalDevice &pDevice, VkDevice &device,
-                                                     size_t max_allocation_size)
+                                                     size_t max_allocation_size, bool buffer_device_address)
 {
-    return std::make_shared<MemoryManager>(queue_manager, pDevice, device, max_allocation_size);
+    return std::make_shared<MemoryManager>(queue_manager, pDevice, device, max_allocation_size, buffer_device_address);
 }
 
-void MemoryManager::buildBuffer(VkBufferCreateInfo &bufferInfo, VmaAllocationCreateInfo &allocInfo, VkBuffer &buffer,
+bool MemoryManager::buildBuffer(VkBufferCreateInfo &bufferInfo, VmaAllocationCreateInfo &allocInfo, VkBuffer &buffer,
                                 VmaAllocation &allocation, VmaAllocationInfo &allocationInfo)
 {
+    if (m_budget && !m_budget->reserve(getHeapIndex(bufferInfo, allocInfo), bufferInfo.size))
+    {
+        LOG_ERROR("Buffer of %llu bytes rejected: memory budget watermark reached",
+                  static_cast<unsigned long long>(bufferInfo.size));
+        buffer = VK_NULL_HANDLE;
+        allocation = VK_NULL_HANDLE;
+        return false;
+    }
+
+    addDeviceAddressUsage(bufferInfo);
+    VkResult result = vmaCreateBuffer(m_allocator, &bufferInfo, &allocInfo, &buffer, &allocation, &allocationInfo);
+    check_result(result, "Failed to create buffer");
+    return result == VK_SUCCESS;
+}
+
+void MemoryManager::addDeviceAddressUsage(VkBufferCreateInfo &bufferInfo) const
+{
+    if (m_buffer_device_address &&
+        (bufferInfo.usage & (VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)))
+        bufferInfo.usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+}
+
+VkDeviceAddress MemoryManager::getBufferDeviceAddress(VkBuffer buffer) const
+{
+    if (!m_buffer_device_address || buffer == VK_NULL_HANDLE)
+        return 0;
+    VkBufferDeviceAddressInfo info = {VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
+    info.buffer = buffer;
+    return vkGetBufferDeviceAddress(m_device, &info);
+}
+
+uint32_t MemoryManager::getHeapIndex(const VkBufferCreateInfo &bufferInfo, const VmaAllocationCreateInfo &allocInfo)
+{
+    uint32_t memoryTypeIndex = UINT32_MAX;
+    if (allocInfo.pool != VK_NULL_HANDLE)
+    {
+        std::unique_lock<std::mutex> lock(m_pool_mutex);
+        auto it = m_pool_memory_types.find(allocInfo.pool);
+        if (it != m_pool_memory_types.end())
+            memoryTypeIndex = it->second;
+    }
+    else
+    {
+        vmaFindMemoryTypeIndexForBufferInfo(m_allocator, &bufferInfo, &allocInfo, &memoryTypeIndex);
+    }
 
-    check_result(vmaCreateBuffer(m_allocator, &bufferInfo, &allocInfo, &buffer, &allocation, &allocationInfo),
-                 "Failed to create buffer");
+    const VkPhysicalDeviceMemoryProperties *properties = nullptr;
+    vmaGetMemoryProperties(m_allocator, &properties);
+    if (memoryTypeIndex >= properties->memoryTypeCount)
+        return 0;
+    return properties->memoryTypes[memoryTypeIndex].heapIndex;
 }
 
 void MemoryManager::flushMemory(VmaAllocation &allocation, VkDeviceSize size, VkDeviceSize offset)
 {
+    if (allocation == VK_NULL_HANDLE)
+        return;
     check_result(vmaFlushAllocation(m_allocator, allocation, offset, size), "cache cannot be flushed correctly");
 }
 
+void MemoryManager::invalidateMemory(VmaAllocation &allocation, VkDeviceSize size, VkDeviceSize offset)
+{
+    if (allocation == VK_NULL_HANDLE)
+        return;
+    check_result(vmaInvalidateAllocation(m_allocator, allocation, offset, size), "cache cannot be invalidated correctly");
+}
+
 void MemoryManager::mapMemory(VkBuffer &buffer, VmaAllocation &allocation, void **mappedData)
 {
     check_result(vmaMapMemory(m_allocator, allocation, mappedData), "Failed to map memory");
@@ -56,8 +170,52 @@ void MemoryManager::destroyBuffer(VkBuffer &buffer, VmaAllocation &allocation)
 {
     if (buffer != VK_NULL_HANDLE)
     {
-        vmaDestroyBuffer(m_allocator, buffer, allocation);
+        {
+            // A source of the running defragmentation pass is freed once the pass has ended
+            std::unique_lock<std::mutex> lock(m_defrag_mutex);
+            if (m_defrag_sources.count(allocation))
+                m_defrag_deferred.push_back({buffer, allocation});
+            else
+                vmaDestroyBuffer(m_allocator, buffer, allocation);
+        }
         buffer = VK_NULL_HANDLE;
+        if (m_budget)
+            m_budget->notify();
+    }
+}
+
+VmaPool MemoryManager::createPool(VkBufferCreateInfo &bufferInfo, VmaAllocationCreateInfo &allocInfo,
+                                  VkDeviceSize blockSize)
+{
+    // Pooled buffers get the same usage as buildBuffer gives them
+    addDeviceAddressUsage(bufferInfo);
+    uint32_t memoryTypeIndex = 0;
+    check_result(vmaFindMemoryTypeIndexForBufferInfo(m_allocator, &bufferInfo, &allocInfo, &memoryTypeIndex),
+                 "No memory type for buffer pool");
+
+    VmaPoolCreateInfo poolInfo = {};
+    poolInfo.memoryTypeIndex = memoryTypeIndex;
+    poolInfo.blockSize = blockSize;
+    poolInfo.minBlockCount = 0;
+    poolInfo.maxBlockCount = 0;
+
+    VmaPool pool = VK_NULL_HANDLE;
+    check_result(vmaCreatePool(m_allocator, &poolInfo, &pool), "Failed to create buffer pool");
+    std::unique_lock<std::mutex> lock(m_pool_mutex);
+    m_pool_memory_types[pool] = memoryTypeIndex;
+    return pool;
+}
+
+void MemoryManager::destroyPool(VmaPool &pool)
+{
+    if (pool != VK_NULL_HANDLE)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_pool_mutex);
+            m_pool_memory_types.erase(pool);
+        }
+        vmaDestroyPool(m_allocator, pool);
+        pool = VK_NULL_HANDLE;
     }
 }
 
@@ -86,6 +244,195 @@ void MemoryManager::copyBuffer(VkCommandBuffer &cmd, VkBuffer &src, VkBuffer &ds
     vkCmdCopyBuffer(cmd, src, dst, 1, &copyRegion);
 }
 
+std::shared_future<int> MemoryManager::submitCopy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                                                  const std::vector<VkBufferMemoryBarrier2> &barriers,
+                                                  const std::vector<TimelinePoint> &waits,
+                                                  std::vector<std::shared_ptr<const void>> resources,
+                                                  TimelinePoint *signalled)
+{
+    auto ticket = m_transfer_engine->copy(src, dst, regions, barriers, waits, std::move(resources));
+    if (signalled)
+        *signalled = ticket.signal;
+    return ticket.fut;
+}
+
+std::shared_ptr<TransferEngine> MemoryManager::getTransferEngine() const
+{
+    return m_transfer_engine;
+}
+
+std::shared_ptr<MemoryBudget> MemoryManager::getMemoryBudget() const
+{
+    return m_budget;
+}
+
+void MemoryManager::setAllocationOwner(VmaAllocation allocation, Buffer *owner)
+{
+    vmaSetAllocationUserData(m_allocator, allocation, owner);
+}
+
+bool MemoryManager::defragment(std::chrono::microseconds budget)
+{
+    std::unique_lock<std::mutex> lock(m_defrag_mutex);
+    // Another thread is in the middle of a pass
+    if (m_defrag_in_pass)
+        return false;
+    if (m_defrag_context == VK_NULL_HANDLE)
+    {
+        VmaDefragmentationInfo info = {};
+        info.flags = VMA_DEFRAGMENTATION_FLAG_ALGORITHM_BALANCED_BIT;
+        info.pool = VK_NULL_HANDLE;
+        info.maxBytesPerPass = DEFRAG_MAX_BYTES_PER_PASS;
+        info.maxAllocationsPerPass = 0;
+        VkResult result = vmaBeginDefragmentation(m_allocator, &info, &m_defrag_context);
+        check_result(result, "Failed to begin defragmentation");
+        if (result != VK_SUCCESS)
+            return true;
+    }
+
+    struct Move
+    {
+        std::shared_ptr<Buffer> owner;
+        VkBuffer buffer;
+        VmaDefragmentationMove *move;
+        std::vector<TimelinePoint> uses;
+        std::shared_future<int> fut;
+        TimelinePoint copied;
+    };
+
+    const auto deadline = std::chrono::steady_clock::now() + budget;
+    bool finished = false;
+    do
+    {
+        VmaDefragmentationPassMoveInfo pass = {};
+        VkResult result = vmaBeginDefragmentationPass(m_allocator, m_defrag_context, &pass);
+        if (result != VK_INCOMPLETE)
+        {
+            check_result(result, "Failed to begin defragmentation pass");
+            finished = true;
+            break;
+        }
+
+        m_defrag_in_pass = true;
+        std::vector<Move> moves;
+        moves.reserve(pass.moveCount);
+        for (uint32_t i = 0; i < pass.moveCount; ++i)
+        {
+            auto &move = pass.pMoves[i];
+            m_defrag_sources.insert(move.srcAllocation);
+            // Moves left over once the budget is spent stay where they are; each pass makes at
+            // least one so a short budget still makes progress
+            if (!moves.empty() && std::chrono::steady_clock::now() >= deadline)
+            {
+                move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+                continue;
+            }
+
+            VmaAllocationInfo allocationInfo = {};
+            vmaGetAllocationInfo(m_allocator, move.srcAllocation, &allocationInfo);
+            // An owner already being destroyed cannot be locked; its allocation is freed after the pass
+            auto *user = static_cast<Buffer *>(allocationInfo.pUserData);
+            std::shared_ptr<Buffer> owner = user ? user->weak_from_this().lock() : nullptr;
+            std::vector<TimelinePoint> uses;
+            if (!owner || !owner->beginMove(uses))
+            {
+                move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+                continue;
+            }
+
+            VkBufferCreateInfo bufferInfo = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+            bufferInfo.pNext = nullptr;
+            bufferInfo.size = owner->m_size;
+            bufferInfo.usage = owner->m_usage;
+            bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            addDeviceAddressUsage(bufferInfo);
+            VkBuffer buffer = VK_NULL_HANDLE;
+            if (vkCreateBuffer(m_device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS ||
+                vmaBindBufferMemory(m_allocator, move.dstTmpAllocation, buffer) != VK_SUCCESS)
+            {
+                if (buffer != VK_NULL_HANDLE)
+                    vkDestroyBuffer(m_device, buffer, nullptr);
+                owner->cancelMove();
+                move.operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+                continue;
+            }
+            moves.push_back({std::move(owner), buffer, &move, std::move(uses), {}, {}});
+        }
+
+        // Copies wait on the device for the last submitted use of each source; nothing that
+        // frees memory is blocked meanwhile
+        lock.unlock();
+        for (auto &move : moves)
+        {
+            VkBufferCopy region = {};
+            region.srcOffset = 0;
+            region.dstOffset = 0;
+            region.size = move.owner->m_size;
+            try
+            {
+                move.fut = submitCopy(move.owner->m_buffer, move.buffer, {region}, {}, move.uses, {}, &move.copied);
+            }
+            catch (const std::exception &e)
+            {
+                LOG_ERROR("Defragmentation copy failed: %s", e.what());
+            }
+        }
+        for (auto &move : moves)
+        {
+            try
+            {
+                if (!move.fut.valid())
+                    throw std::runtime_error("copy was not submitted");
+                move.fut.get();
+            }
+            catch (const std::exception &e)
+            {
+                LOG_ERROR("Defragmentation copy failed: %s", e.what());
+                move.move->operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+                vkDestroyBuffer(m_device, move.buffer, nullptr);
+                move.buffer = VK_NULL_HANDLE;
+                move.owner->cancelMove();
+            }
+        }
+        lock.lock();
+
+        // VMA swaps the allocations here: each owner's VmaAllocation now names the new memory
+        result = vmaEndDefragmentationPass(m_allocator, m_defrag_context, &pass);
+        for (auto &move : moves)
+        {
+            if (move.buffer == VK_NULL_HANDLE)
+                continue;
+            vkDestroyBuffer(m_device, move.owner->m_buffer, nullptr);
+            move.owner->relocate(move.buffer, move.copied);
+        }
+        for (auto &deferred : m_defrag_deferred)
+            vmaDestroyBuffer(m_allocator, deferred.first, deferred.second);
+        const bool freed = !m_defrag_deferred.empty();
+        m_defrag_deferred.clear();
+        m_defrag_sources.clear();
+        m_defrag_in_pass = false;
+        if (result == VK_SUCCESS)
+            finished = true;
+
+        // Dropping the last reference to an owner destroys it, which takes m_defrag_mutex
+        lock.unlock();
+        moves.clear();
+        if (freed && m_budget)
+            m_budget->notify();
+        lock.lock();
+    } while (!finished && std::chrono::steady_clock::now() < deadline);
+
+    if (finished)
+    {
+        VmaDefragmentationStats stats = {};
+        vmaEndDefragmentation(m_allocator, m_defrag_context, &stats);
+        m_defrag_context = VK_NULL_HANDLE;
+        LOG_INFO("Defragmentation moved %u allocations (%llu bytes), freed %u blocks", stats.allocationsMoved,
+                 static_cast<unsigned long long>(stats.bytesMoved), stats.deviceMemoryBlocksFreed);
+    }
+    return finished;
+}
+
 void MemoryManager::copyImage(VkCommandBuffer &cmd, VkImage &src, VkImage &dst, uint32_t width, uint32_t height,
                               uint32_t depth)
 {
@@ -139,8 +486,9 @@ void MemoryManager::copyImageToBuffer(VkCommandBuffer &cmd, VkImage &src, VkBuff
 
 
 MemoryManager::MemoryManager(std::shared_ptr<QueueManager> &queue_manager, VkPhysicalDevice &pDevice, VkDevice &device,
-                             size_t max_allocation_size)
-    : m_queue_manager(queue_manager), m_physical_device(pDevice), m_device(device), m_allocator(nullptr)
+                             size_t max_allocation_size, bool buffer_device_address)
+    : m_queue_manager(queue_manager), m_physical_device(pDevice), m_device(device), m_allocator(nullptr),
+      m_buffer_device_address(buffer_device_address), m_staging_ring_size(STAGING_RING_SIZE)
 {
     initialize(pDevice, device, max_allocation_size);
 }
@@ -156,12 +504,205 @@ void MemoryManager::getVmaMemoryAllocationProperotys(VmaAllocation &allocation,
     vmaGetAllocationMemoryProperties(m_allocator, allocation, memoryPropertyFlags);
 }
 
-inline VkQueue MemoryManager::getSparseQueue() const
+VkQueue MemoryManager::getSparseQueue() const
 {
     return m_queue_manager->getSparseQueue();
 }
 
+void MemoryManager::buildSparseBuffer(VkBufferCreateInfo &bufferInfo, VkBuffer &buffer,
+                                      VkMemoryRequirements &requirements)
+{
+    addDeviceAddressUsage(bufferInfo);
+    check_result(vkCreateBuffer(m_device, &bufferInfo, nullptr, &buffer), "Failed to create sparse buffer");
+    if (buffer != VK_NULL_HANDLE)
+        vkGetBufferMemoryRequirements(m_device, buffer, &requirements);
+}
+
+void MemoryManager::destroySparseBuffer(VkBuffer &buffer)
+{
+    if (buffer != VK_NULL_HANDLE)
+    {
+        vkDestroyBuffer(m_device, buffer, nullptr);
+        buffer = VK_NULL_HANDLE;
+    }
+}
+
+bool MemoryManager::importHostMemory(void *ptr, VkBufferCreateInfo &bufferInfo, VkBuffer &buffer,
+                                     VkDeviceMemory &memory, VkMemoryPropertyFlags &propertyFlags)
+{
+    buffer = VK_NULL_HANDLE;
+    memory = VK_NULL_HANDLE;
+
+    VkMemoryHostPointerPropertiesEXT hostProperties = {VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT};
+    if (vkGetMemoryHostPointerPropertiesEXT(m_device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, ptr,
+                                            &hostProperties) != VK_SUCCESS)
+        return false;
+
+    VkExternalMemoryBufferCreateInfo externalInfo = {VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO};
+    externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    addDeviceAddressUsage(bufferInfo);
+    bufferInfo.pNext = &externalInfo;
+    VkResult result = vkCreateBuffer(m_device, &bufferInfo, nullptr, &buffer);
+    bufferInfo.pNext = nullptr;
+    if (result != VK_SUCCESS)
+    {
+        buffer = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(m_device, buffer, &requirements);
+
+    const VkPhysicalDeviceMemoryProperties *properties = nullptr;
+    vmaGetMemoryProperties(m_allocator, &properties);
+    const VkMemoryPropertyFlags required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    const uint32_t typeBits = hostProperties.memoryTypeBits & requirements.memoryTypeBits;
+    uint32_t memoryTypeIndex = UINT32_MAX;
+    for (uint32_t i = 0; i < properties->memoryTypeCount && memoryTypeIndex == UINT32_MAX; ++i)
+    {
+        if ((typeBits & (1u << i)) && (properties->memoryTypes[i].propertyFlags & required) == required)
+            memoryTypeIndex = i;
+    }
+
+    if (memoryTypeIndex != UINT32_MAX)
+    {
+        VkImportMemoryHostPointerInfoEXT importInfo = {VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT};
+        importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+        importInfo.pHostPointer = ptr;
+
+        // Memory behind an addressable buffer must be allocated addressable
+        VkMemoryAllocateFlagsInfo flagsInfo = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO};
+        flagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+        if (bufferInfo.usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
+            importInfo.pNext = &flagsInfo;
+
+        // The import must cover what the buffer needs, in whole units of the import alignment,
+        // without reaching past the caller's range
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostLimits = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT};
+        VkPhysicalDeviceProperties2 deviceProperties = {VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
+        deviceProperties.pNext = &hostLimits;
+        vkGetPhysicalDeviceProperties2(m_physical_device, &deviceProperties);
+        const VkDeviceSize alignment = std::max<VkDeviceSize>(1, hostLimits.minImportedHostPointerAlignment);
+        const VkDeviceSize importSize = (requirements.size + alignment - 1) / alignment * alignment;
+
+        VkMemoryAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+        allocInfo.pNext = &importInfo;
+        allocInfo.allocationSize = importSize;
+        allocInfo.memoryTypeIndex = memoryTypeIndex;
+        if (importSize <= bufferInfo.size &&
+            vkAllocateMemory(m_device, &allocInfo, nullptr, &memory) == VK_SUCCESS &&
+            vkBindBufferMemory(m_device, buffer, memory, 0) == VK_SUCCESS)
+        {
+            propertyFlags = properties->memoryTypes[memoryTypeIndex].propertyFlags;
+            return true;
+        }
+    }
+
+    releaseHostMemory(buffer, memory);
+    return false;
+}
+
+void MemoryManager::releaseHostMemory(VkBuffer &buffer, VkDeviceMemory &memory)
+{
+    if (buffer != VK_NULL_HANDLE)
+    {
+        vkDestroyBuffer(m_device, buffer, nullptr);
+        buffer = VK_NULL_HANDLE;
+    }
+    if (memory != VK_NULL_HANDLE)
+    {
+        vkFreeMemory(m_device, memory, nullptr);
+        memory = VK_NULL_HANDLE;
+    }
+}
+
+bool MemoryManager::allocatePages(const VkMemoryRequirements &requirements, size_t count, VmaAllocation *pages,
+                                  VmaAllocationInfo *pageInfos)
+{
+    const VkPhysicalDeviceMemoryProperties *properties = nullptr;
+    vmaGetMemoryProperties(m_allocator, &properties);
+
+    // Prefer device-local memory among the types the buffer accepts
+    uint32_t memoryTypeIndex = UINT32_MAX;
+    for (uint32_t i = 0; i < properties->memoryTypeCount; ++i)
+    {
+        if (!(requirements.memoryTypeBits & (1u << i)))
+            continue;
+        if (memoryTypeIndex == UINT32_MAX ||
+            (properties->memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+            memoryTypeIndex = i;
+        if (properties->memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+            break;
+    }
+    if (memoryTypeIndex == UINT32_MAX)
+    {
+        LOG_ERROR("No memory type for sparse pages");
+        return false;
+    }
+
+    const uint32_t heapIndex = properties->memoryTypes[memoryTypeIndex].heapIndex;
+    if (m_budget && !m_budget->reserve(heapIndex, requirements.alignment * count))
+    {
+        LOG_ERROR("Sparse pages rejected: memory budget watermark reached");
+        return false;
+    }
 
+    VkMemoryRequirements pageRequirements = {};
+    pageRequirements.size = requirements.alignment;
+    pageRequirements.alignment = requirements.alignment;
+    pageRequirements.memoryTypeBits = 1u << memoryTypeIndex;
+
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = VMA_MEMORY_USAGE_UNKNOWN;
+    allocInfo.memoryTypeBits = 1u << memoryTypeIndex;
+
+    VkResult result = vmaAllocateMemoryPages(m_allocator, &pageRequirements, &allocInfo, count, pages, pageInfos);
+    check_result(result, "Failed to allocate sparse pages");
+    return result == VK_SUCCESS;
+}
+
+void MemoryManager::freePages(size_t count, const VmaAllocation *pages)
+{
+    if (count == 0)
+        return;
+    {
+        std::unique_lock<std::mutex> lock(m_defrag_mutex);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (m_defrag_sources.count(pages[i]))
+                m_defrag_deferred.push_back({VK_NULL_HANDLE, pages[i]});
+            else
+                vmaFreeMemory(m_allocator, pages[i]);
+        }
+    }
+    if (m_budget)
+        m_budget->notify();
+}
+
+std::shared_future<int> MemoryManager::bindSparse(VkBuffer buffer, const std::vector<VkSparseMemoryBind> &binds,
+                                                  const std::vector<TimelinePoint> &waits, TimelinePoint &signalled)
+{
+    return m_queue_manager->bindSparse(buffer, binds, waits, signalled);
+}
+
+
+
+std::shared_ptr<StagingRing> MemoryManager::getStagingRing()
+{
+    std::unique_lock<std::mutex> lock(m_transfer_mutex);
+    if (!m_staging_ring)
+        m_staging_ring = StagingRing::create(this, m_staging_ring_size);
+    return m_staging_ring;
+}
+
+void MemoryManager::setStagingRingSize(VkDeviceSize size)
+{
+    std::unique_lock<std::mutex> lock(m_transfer_mutex);
+    if (m_staging_ring)
+        LOG_WARNING("Staging ring already created, size change ignored");
+    m_staging_ring_size = size;
+}
 
 MemoryManager::~MemoryManager()
 {
@@ -207,14 +748,30 @@ bool MemoryManager::initialize(VkPhysicalDevice &pDevice, VkDevice &device, size
     allocatorInfo.flags = VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT |
                           VMA_ALLOCATOR_CREATE_KHR_DEDICATED_ALLOCATION_BIT |
                           VMA_ALLOCATOR_CREATE_KHR_MAINTENANCE4_BIT | VMA_ALLOCATOR_CREATE_KHR_MAINTENANCE5_BIT;
+    if (m_buffer_device_address)
+        allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
 
     check_result(vmaCreateAllocator(&allocatorInfo, &m_allocator), "Failed to create VMA allocator");
+    m_budget = MemoryBudget::create(m_allocator, MEMORY_BUDGET_WATERMARK);
+
+    m_transfer_engine = TransferEngine::create(m_queue_manager, m_device);
 
     return true;
 }
 
 void MemoryManager::cleanup()
 {
+    // In-flight copies still reference allocations owned by the allocator
+    m_transfer_engine.reset();
+    m_staging_ring.reset();
+    m_budget.reset();
+
+    if (m_defrag_context != VK_NULL_HANDLE)
+    {
+        vmaEndDefragmentation(m_allocator, m_defrag_context, nullptr);
+        m_defrag_context = VK_NULL_HANDLE;
+    }
+
     if (m_allocator != nullptr)
     {
         vmaDestroyAllocator(m_allocator);
@@ -236,94 +793,309 @@ Buffer::Buffer(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBuff
     initialize(mem_mamanger, size, usage, memory_usage, flags);
 }
 
+Buffer::Buffer(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage, VmaPool pool,
+               VmaAllocationCreateFlags flags)
+    : m_memory_manager(mem_mamanger), m_buffer(VK_NULL_HANDLE), m_allocation(VK_NULL_HANDLE), m_pool(pool)
+{
+    initialize(mem_mamanger, size, usage, VMA_MEMORY_USAGE_UNKNOWN, flags);
+}
+
+Buffer::Buffer(std::shared_ptr<MemoryManager> &mem_mamanger)
+    : m_memory_manager(mem_mamanger), m_buffer(VK_NULL_HANDLE), m_allocation(VK_NULL_HANDLE)
+{
+}
+
 Buffer::~Buffer()
 {
     cleanup();
 }
 
-inline VkBuffer Buffer::getBuffer() const
+VkBuffer Buffer::getBuffer() const
 {
     return m_buffer;
 }
 
-inline VmaAllocation Buffer::getAllocation() const
+VkDeviceAddress Buffer::getDeviceAddress() const
+{
+    VkDeviceAddress base = m_memory_manager->getBufferDeviceAddress(m_buffer);
+    return base ? base + m_offset : 0;
+}
+
+VmaAllocation Buffer::getAllocation() const
 {
     return m_allocation;
 }
 
-void Buffer::copyDataFrom(void *src, size_t size, size_t dst_offset, size_t src_offset, uint32_t dst_access_flag,
-                          uint32_t src_access_flag)
+std::vector<VkBufferMemoryBarrier2> Buffer::takePendingBarriers()
+{
+    std::vector<VkBufferMemoryBarrier2> barriers;
+    std::lock_guard<std::mutex> lock(m_sync->m_use_mutex);
+    barriers.swap(m_sync->m_buffer_memory_barriers);
+    m_sync->m_compute_owned = true;
+    return barriers;
+}
+
+std::vector<TimelinePoint> Buffer::getPendingWaits()
+{
+    std::lock_guard<std::mutex> lock(m_sync->m_use_mutex);
+    return m_sync->m_pending_waits;
+}
+
+void Buffer::addPendingBarriers(const std::vector<VkBufferMemoryBarrier2> &barriers)
+{
+    std::lock_guard<std::mutex> lock(m_sync->m_use_mutex);
+    auto &pending = m_sync->m_buffer_memory_barriers;
+    pending.insert(pending.end(), barriers.begin(), barriers.end());
+}
+
+void Buffer::addPendingWait(const TimelinePoint &point)
+{
+    std::lock_guard<std::mutex> lock(m_sync->m_use_mutex);
+    mergePoint(m_sync->m_pending_waits, point);
+}
+
+void Buffer::pin()
+{
+    std::unique_lock<std::mutex> lock(m_sync->m_use_mutex);
+    m_sync->m_moved.wait(lock, [this] { return !m_sync->m_moving; });
+    ++m_sync->m_pins;
+}
+
+void Buffer::unpin(const TimelinePoint &point)
+{
+    std::unique_lock<std::mutex> lock(m_sync->m_use_mutex);
+    --m_sync->m_pins;
+    if (point.semaphore != VK_NULL_HANDLE)
+        mergePoint(m_sync->m_last_use, point);
+}
+
+bool Buffer::beginMove(std::vector<TimelinePoint> &uses)
+{
+    std::unique_lock<std::mutex> lock(m_use_mutex);
+    if (m_pins != 0 || m_moving || !isMovable())
+        return false;
+    m_moving = true;
+    uses = m_last_use;
+    // Uploads still running on the transfer queue write the source too
+    uses.insert(uses.end(), m_pending_waits.begin(), m_pending_waits.end());
+    return true;
+}
+
+void Buffer::cancelMove()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_use_mutex);
+        m_moving = false;
+    }
+    m_moved.notify_all();
+}
+
+std::shared_future<int> Buffer::copyDataFrom(void *src, size_t size, size_t dst_offset, size_t src_offset,
+                                             uint32_t dst_access_flag, uint32_t src_access_flag)
 {
-    VkBufferMemoryBarrier bufMemBarrier = {};
-    bufMemBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    SubmissionPins pins{this};
+    VkBufferMemoryBarrier2 bufMemBarrier = {};
+    bufMemBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
     bufMemBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     bufMemBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     bufMemBarrier.buffer = m_buffer;
-    bufMemBarrier.offset = dst_offset;
+    bufMemBarrier.offset = m_offset + dst_offset;
     bufMemBarrier.size = size;
+    std::shared_future<int> fut;
     if (getMemoryPropertyFlags() & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
     {
         auto *dst = static_cast<char*>(getPtr()) + dst_offset;
         auto *sdst = std::memcpy(dst, static_cast<char *>(src) + src_offset, size);
-        m_memory_manager->flushMemory(m_allocation, size, dst_offset);
+        m_memory_manager->flushMemory(m_allocation, size, m_offset + dst_offset);
         bufMemBarrier.srcAccessMask = src_access_flag;
         bufMemBarrier.dstAccessMask = dst_access_flag;
+        fut = readyFuture();
     }
     else
     {
-        auto stagingBuffer = Buffer::create(m_memory_manager, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO,
-                       VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
-        stagingBuffer->copyDataFrom(src, size, dst_offset, src_offset, VK_ACCESS_TRANSFER_READ_BIT);
+        auto ring = m_memory_manager->getStagingRing();
+        auto engine = m_memory_manager->getTransferEngine();
+        // Once compute work or a compute-family copy has used the buffer, that family owns it
+        // and the upload stays there rather than needing a release back to the DMA family
+        const bool dma = engine->hasDedicatedTransferQueue() && !m_sync->m_compute_owned.load();
+        // Queued barriers, acquires of earlier uploads included, are meant for the compute
+        // family; a DMA upload leaves them for the next compute use
+        std::vector<VkBufferMemoryBarrier2> barriers;
+        if (!dma)
+            barriers = takePendingBarriers();
+        auto waits = getPendingWaits();
+        std::vector<VkBufferMemoryBarrier2> acquires;
+        size_t copied = 0;
+        while (copied < size)
+        {
+            // Uploads larger than the ring go through in order, one ring-sized chunk at a time
+            if (fut.valid())
+                fut.get();
+            size_t chunk = std::min<size_t>(size - copied, ring->capacity());
+            auto region = ring->acquire(chunk);
+            std::memcpy(region.ptr, static_cast<char *>(src) + src_offset + copied, chunk);
+            ring->flush(region);
+
+            VkBufferCopy copyRegion = {};
+            copyRegion.srcOffset = region.offset;
+            copyRegion.dstOffset = m_offset + dst_offset + copied;
+            copyRegion.size = chunk;
+            TransferEngine::Ticket ticket;
+            try
+            {
+                if (dma)
+                    ticket = engine->upload(region.buffer, m_buffer, {copyRegion}, barriers, waits, {shared_from_this()});
+                else
+                    ticket = engine->copy(region.buffer, m_buffer, {copyRegion}, barriers, waits, {shared_from_this()});
+            }
+            catch (...)
+            {
+                ring->release(region);
+                throw;
+            }
+            fut = ticket.fut;
+            ring->release(region, fut);
+            pins.submitted(ticket.signal);
+            addPendingWait(ticket.signal);
+            acquires.insert(acquires.end(), ticket.acquires.begin(), ticket.acquires.end());
+            barriers.clear();
+            waits.clear();
+            copied += chunk;
+        }
+
+        if (!acquires.empty())
+        {
+            // Uploaded on a dedicated transfer family: the next compute use completes the
+            // ownership transfer instead of a plain barrier
+            addPendingBarriers(acquires);
+            return fut;
+        }
         bufMemBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
         bufMemBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-        // submit memory copy to queue
     }
-    m_buffer_memory_barriers.push_back(bufMemBarrier);
+    bufMemBarrier.srcStageMask = BarrierTracker::stageForAccess(bufMemBarrier.srcAccessMask);
+    bufMemBarrier.dstStageMask = BarrierTracker::stageForAccess(bufMemBarrier.dstAccessMask);
+    addPendingBarriers({bufMemBarrier});
+    return fut;
 }
 
-void Buffer::copyDataFrom(std::shared_ptr<Buffer> src, size_t size, size_t dst_offset, size_t src_offset)
+std::shared_future<int> Buffer::copyDataFrom(std::shared_ptr<Buffer> src, size_t size, size_t dst_offset,
+                                             size_t src_offset)
 {
+    check_condition(src != nullptr, "Buffer::copyDataFrom: source buffer is null");
+
+    SubmissionPins pins{src.get(), this};
+    VkBufferCopy region = {};
+    region.srcOffset = src->m_offset + src_offset;
+    region.dstOffset = m_offset + dst_offset;
+    region.size = size;
 
+    auto barriers = src->takePendingBarriers();
+    auto dst_barriers = takePendingBarriers();
+    barriers.insert(barriers.end(), dst_barriers.begin(), dst_barriers.end());
+    auto waits = src->getPendingWaits();
+    auto dst_waits = getPendingWaits();
+    waits.insert(waits.end(), dst_waits.begin(), dst_waits.end());
+
+    TimelinePoint signalled{VK_NULL_HANDLE, 0};
+    auto fut = m_memory_manager->submitCopy(src->m_buffer, m_buffer, {region}, barriers, waits,
+                                            {src, shared_from_this()}, &signalled);
+    pins.submitted(signalled);
+    return fut;
 }
 
 void Buffer::copyDataTo(void *dst, size_t size, size_t src_offset, size_t dst_offset, uint32_t src_access_flag,
                         uint32_t dst_access_flag)
 {
-    VkBufferMemoryBarrier bufMemBarrier = {};
-    bufMemBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    SubmissionPins pins{this};
+    VkBufferMemoryBarrier2 bufMemBarrier = {};
+    bufMemBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
     bufMemBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     bufMemBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     bufMemBarrier.buffer = m_buffer;
-    bufMemBarrier.offset = src_offset;
+    bufMemBarrier.offset = m_offset + src_offset;
     bufMemBarrier.size = size;
     if (getMemoryPropertyFlags() & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
     {
-        m_memory_manager->flushMemory(m_allocation, size, src_offset);
+        m_memory_manager->flushMemory(m_allocation, size, m_offset + src_offset);
         memcpy(static_cast<char *>(dst) + dst_offset, static_cast<char *>(getPtr()) + src_offset, size);
         bufMemBarrier.srcAccessMask = src_access_flag;
         bufMemBarrier.dstAccessMask = dst_access_flag;
     }
     else
     {
-        auto stagingBuffer =
-            Buffer::create(m_memory_manager, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO,
-                           VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
-
-        bufMemBarrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        bufMemBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        auto ring = m_memory_manager->getStagingRing();
+        auto barriers = takePendingBarriers();
+        auto waits = getPendingWaits();
+        size_t copied = 0;
+        while (copied < size)
+        {
+            size_t chunk = std::min<size_t>(size - copied, ring->capacity());
+            auto region = ring->acquire(chunk);
 
-        stagingBuffer->copyDataTo(dst, size, dst_offset, src_offset, VK_ACCESS_SHADER_WRITE_BIT,
-                                  VK_ACCESS_TRANSFER_READ_BIT);
+            VkBufferCopy copyRegion = {};
+            copyRegion.srcOffset = m_offset + src_offset + copied;
+            copyRegion.dstOffset = region.offset;
+            copyRegion.size = chunk;
+            try
+            {
+                TimelinePoint signalled{VK_NULL_HANDLE, 0};
+                auto fut = m_memory_manager->submitCopy(m_buffer, region.buffer, {copyRegion}, barriers, waits, {},
+                                                        &signalled);
+                pins.submitted(signalled);
+                fut.get();
+            }
+            catch (...)
+            {
+                ring->release(region);
+                throw;
+            }
+            ring->invalidate(region);
+            std::memcpy(static_cast<char *>(dst) + dst_offset + copied, region.ptr, chunk);
+            ring->release(region);
+            barriers.clear();
+            waits.clear();
+            copied += chunk;
+        }
     }
 }
 
-void Buffer::copyDataTo(std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset, size_t src_offset)
+std::shared_future<int> Buffer::copyDataTo(std::shared_ptr<Buffer> dst, size_t size, size_t dst_offset,
+                                           size_t src_offset)
+{
+    VkBufferCopy region = {};
+    region.srcOffset = src_offset;
+    region.dstOffset = dst_offset;
+    region.size = size;
+    return copyDataTo(dst, std::vector<VkBufferCopy>{region});
+}
+
+std::shared_future<int> Buffer::copyDataTo(std::shared_ptr<Buffer> dst, const std::vector<VkBufferCopy> &regions)
 {
-    if (getMemoryPropertyFlags() & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    check_condition(dst != nullptr, "Buffer::copyDataTo: destination buffer is null");
+
+    SubmissionPins pins{this, dst.get()};
+    // Host writes into either buffer must be visible to the transfer
+    auto barriers = takePendingBarriers();
+    auto dst_barriers = dst->takePendingBarriers();
+    barriers.insert(barriers.end(), dst_barriers.begin(), dst_barriers.end());
+    auto waits = getPendingWaits();
+    auto dst_waits = dst->getPendingWaits();
+    waits.insert(waits.end(), dst_waits.begin(), dst_waits.end());
+
+    // Regions are relative to the views; the copy needs VkBuffer offsets
+    std::vector<VkBufferCopy> absolute(regions);
+    for (auto &region : absolute)
     {
-        // actual submission of work
-        //m_memory_manager->copyBuffer(, m_buffer, dst->getBuffer(), size);
+        region.srcOffset += m_offset;
+        region.dstOffset += dst->m_offset;
     }
+
+    TimelinePoint signalled{VK_NULL_HANDLE, 0};
+    auto fut = m_memory_manager->submitCopy(m_buffer, dst->m_buffer, absolute, barriers, waits,
+                                            {shared_from_this(), dst}, &signalled);
+    pins.submitted(signalled);
+    return fut;
 }
 
 void Buffer::initialize(std::shared_ptr<MemoryManager> &device, size_t size, VkBufferUsageFlags usage,
@@ -331,7 +1103,7 @@ void Buffer::initialize(std::shared_ptr<MemoryManager> &device, size_t size, VkB
 {
     // If mapping is required, force host-preferred memory usage
     bool mapping_required = (flags & (VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT));
-    if (memory_usage == VMA_MEMORY_USAGE_AUTO && mapping_required) {
+    if (memory_usage == VMA_MEMORY_USAGE_AUTO && mapping_required && m_pool == VK_NULL_HANDLE) {
         memory_usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
     }
     // Ensure host access flag is set for AUTO usage if mapping is required
@@ -349,7 +1121,12 @@ void Buffer::initialize(std::shared_ptr<MemoryManager> &device, size_t size, VkB
     VmaAllocationCreateInfo allocInfo = {};
     allocInfo.flags = flags;
     allocInfo.usage = memory_usage;
-    m_memory_manager->buildBuffer(bufferInfo, allocInfo, m_buffer, m_allocation, m_allocation_info);
+    allocInfo.pool = m_pool;
+    if (!m_memory_manager->buildBuffer(bufferInfo, allocInfo, m_buffer, m_allocation, m_allocation_info))
+        return;
+    m_usage = usage;
+    m_size = size;
+    m_memory_manager->setAllocationOwner(m_allocation, this);
     m_memory_manager->getVmaMemoryAllocationProperotys(m_allocation, &m_memory_property_flags);
     if (mapping_required && !(m_memory_property_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
         LOG_ERROR("Buffer allocated without HOST_VISIBLE memory but mapping was requested. Allocation will fail. Consider using a staging buffer or adjusting allocation flags.");
@@ -358,6 +1135,60 @@ void Buffer::initialize(std::shared_ptr<MemoryManager> &device, size_t size, VkB
     m_write_descriptor_set.offset = 0;
     m_write_descriptor_set.range = size;
 }
+void Buffer::relocate(VkBuffer buffer, const TimelinePoint &copied)
+{
+    // Everything below is published to pin() callers when the move ends
+    std::unique_lock<std::mutex> lock(m_use_mutex);
+    // The new VkBuffer was written by a copy on the compute family
+    m_compute_owned = true;
+    for (auto &barrier : m_buffer_memory_barriers)
+    {
+        if (barrier.buffer == m_buffer)
+            barrier.buffer = buffer;
+    }
+
+    // Make the defragmentation copy visible to whatever uses the buffer next
+    VkBufferMemoryBarrier2 barrier = {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2};
+    barrier.pNext = nullptr;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+                            VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = buffer;
+    barrier.offset = 0;
+    barrier.size = m_size;
+    m_buffer_memory_barriers.push_back(barrier);
+
+    if (copied.semaphore != VK_NULL_HANDLE)
+        mergePoint(m_pending_waits, copied);
+    // Earlier uses ran on the old VkBuffer
+    m_last_use.clear();
+
+    m_buffer = buffer;
+    m_write_descriptor_set.buffer = buffer;
+    m_memory_manager->getVmaAllocationInfo(m_allocation, &m_allocation_info);
+    ++m_generation;
+    m_moving = false;
+    lock.unlock();
+    m_moved.notify_all();
+}
+
+bool Buffer::isMovable() const
+{
+    const VkBufferUsageFlags copyable = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    const bool acquiring = std::any_of(m_buffer_memory_barriers.begin(), m_buffer_memory_barriers.end(),
+                                       [](const VkBufferMemoryBarrier2 &barrier) {
+                                           return barrier.srcQueueFamilyIndex != barrier.dstQueueFamilyIndex;
+                                       });
+    // A mapped allocation moves its mapping too, leaving pointers from getPtr() dangling
+    const bool mapped = (m_memory_property_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+    return m_buffer != VK_NULL_HANDLE && m_pool == VK_NULL_HANDLE && m_views.load() == 0 &&
+           (m_usage & copyable) == copyable && !acquiring && !mapped;
+}
+
 void Buffer::cleanup()
 {
     if (m_buffer != VK_NULL_HANDLE)
@@ -368,63 +1199,432 @@ void Buffer::cleanup()
     }
 }
 
+std::shared_ptr<BufferView> BufferView::create(std::shared_ptr<Buffer> parent, VkDeviceSize offset,
+                                               VkDeviceSize range)
+{
+    check_condition(parent != nullptr, "BufferView: parent buffer is null");
+    return std::make_shared<BufferView>(parent, offset, range);
+}
+
+BufferView::BufferView(std::shared_ptr<Buffer> parent, VkDeviceSize offset, VkDeviceSize range)
+    : Buffer(parent->m_memory_manager)
+{
+    // A view of a view refers straight to the storage owner, and must stay inside the
+    // intermediate view rather than merely inside the owner
+    if (auto view = std::dynamic_pointer_cast<BufferView>(parent))
+    {
+        check_condition(offset + range <= view->m_write_descriptor_set.range, "BufferView: range exceeds parent view");
+        offset += view->m_offset - view->m_parent->m_offset;
+        parent = view->m_parent;
+    }
+    check_condition(offset + range <= parent->m_write_descriptor_set.range, "BufferView: range exceeds parent");
+
+    m_parent = parent;
+    ++m_parent->m_views;
+    m_buffer = parent->m_buffer;
+    m_allocation = parent->m_allocation;
+    m_allocation_info = parent->m_allocation_info;
+    m_memory_property_flags = parent->m_memory_property_flags;
+    m_offset = parent->m_offset + offset;
+    m_sync = parent->m_sync;
+    m_write_descriptor_set.buffer = m_buffer;
+    m_write_descriptor_set.offset = m_offset;
+    m_write_descriptor_set.range = range;
+}
+
+BufferView::~BufferView()
+{
+    // The storage belongs to the parent; keep ~Buffer from destroying it
+    m_buffer = VK_NULL_HANDLE;
+    m_allocation = VK_NULL_HANDLE;
+    --m_parent->m_views;
+}
+
+void *BufferView::getPtr()
+{
+    auto *base = static_cast<char *>(m_parent->getPtr());
+    return base ? base + (m_offset - m_parent->m_offset) : nullptr;
+}
+
+std::shared_ptr<Buffer> BufferView::getParent() const
+{
+    return m_parent;
+}
+
+void BufferView::cleanup()
+{
+}
+
 std::shared_ptr<SparseBuffer> SparseBuffer::create(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size,
-                                                   VkBufferUsageFlags usage, VmaMemoryUsage memory_usage,
-                                                   VmaAllocationCreateFlags flags)
+                                                   VkBufferUsageFlags usage, bool resident_on_demand)
 {
-    return std::make_shared<SparseBuffer>(mem_mamanger, size, usage, memory_usage, flags);
+    return std::make_shared<SparseBuffer>(mem_mamanger, size, usage, resident_on_demand);
 }
 
 SparseBuffer::SparseBuffer(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage,
-                           VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags)
-    : Buffer(mem_mamanger, size, usage, memory_usage, flags)
+                           bool resident_on_demand)
+    : Buffer(mem_mamanger), m_resident_on_demand(resident_on_demand)
 {
+    initialize(size, usage);
+}
 
+SparseBuffer::~SparseBuffer()
+{
+    cleanup();
 }
 
-void SparseBuffer::initialize(std::shared_ptr<MemoryManager> &mem_mamanger, size_t size, VkBufferUsageFlags usage,
-                              VmaMemoryUsage memory_usage, VmaAllocationCreateFlags flags)
+void SparseBuffer::initialize(size_t size, VkBufferUsageFlags usage)
 {
-    // If mapping is required, force host-preferred memory usage
-    bool mapping_required = (flags & (VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT));
-    if (memory_usage == VMA_MEMORY_USAGE_AUTO && mapping_required) {
-        memory_usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
-    }
-    // Ensure host access flag is set for AUTO usage if mapping is required
-    if (memory_usage == VMA_MEMORY_USAGE_AUTO || memory_usage == VMA_MEMORY_USAGE_AUTO_PREFER_HOST) {
-        if ((flags & (VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT)) == 0 && mapping_required) {
-            flags |= VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
-        }
-    }
     VkBufferCreateInfo bufferInfo = {};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
-    bufferInfo.usage = usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    bufferInfo.usage = usage;
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     bufferInfo.flags = VK_BUFFER_CREATE_SPARSE_BINDING_BIT;
+    if (m_resident_on_demand)
+        bufferInfo.flags |= VK_BUFFER_CREATE_SPARSE_RESIDENCY_BIT;
 
-    VmaAllocationCreateInfo allocInfo = {};
-    allocInfo.usage = memory_usage;
-    allocInfo.flags = flags;
-    m_memory_manager->buildBuffer(bufferInfo, allocInfo, m_buffer, m_allocation, m_allocation_info);
-    m_memory_manager->getVmaMemoryAllocationProperotys(m_allocation, &m_memory_property_flags);
-    // RUNTIME CHECK: Ensure buffer is host-visible if mapping is required
-    if ((flags & (VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT)) &&
-        !(m_memory_property_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
-        LOG_ERROR("SparseBuffer allocated without HOST_VISIBLE memory but mapping was requested. Allocation will fail. Consider using a staging buffer or adjusting allocation flags.");
+    m_memory_manager->buildSparseBuffer(bufferInfo, m_buffer, m_requirements);
+    if (m_buffer == VK_NULL_HANDLE)
+        return;
+
+    m_usage = usage;
+    m_size = size;
+    // Never mapped as a whole: host copies always go through the staging ring
+    m_memory_property_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    const VkDeviceSize page = getPageSize();
+    m_pages.assign((m_requirements.size + page - 1) / page, VK_NULL_HANDLE);
+    m_write_descriptor_set.buffer = m_buffer;
+    m_write_descriptor_set.offset = 0;
+    m_write_descriptor_set.range = size;
+
+    // Without residency support every page must be bound before the buffer is used; if that
+    // fails the buffer is destroyed, so getBuffer() is null like any failed allocation
+    if (!m_resident_on_demand)
+    {
+        int result = -1;
+        try
+        {
+            result = commit(0, size).get();
+        }
+        catch (const std::exception &e)
+        {
+            LOG_ERROR("SparseBuffer: binding memory failed: %s", e.what());
+        }
+        if (result != 0)
+            cleanup();
+    }
+}
+
+std::pair<size_t, size_t> SparseBuffer::pageRange(VkDeviceSize offset, VkDeviceSize size) const
+{
+    check_condition(offset + size <= m_size, "SparseBuffer: range exceeds buffer");
+    const VkDeviceSize page = getPageSize();
+    size_t first = static_cast<size_t>(offset / page);
+    size_t last = std::min(m_pages.size(), static_cast<size_t>((offset + size + page - 1) / page));
+    return {first, last};
+}
+
+std::shared_future<int> SparseBuffer::commit(VkDeviceSize offset, VkDeviceSize size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto [first, last] = pageRange(offset, size);
+    std::vector<size_t> missing;
+    for (size_t p = first; p < last; ++p)
+    {
+        if (m_pages[p] == VK_NULL_HANDLE)
+            missing.push_back(p);
+    }
+    if (missing.empty())
+        return m_last_bind.valid() ? m_last_bind : readyFuture();
+
+    std::vector<VmaAllocation> pages(missing.size(), VK_NULL_HANDLE);
+    std::vector<VmaAllocationInfo> infos(missing.size());
+    if (!m_memory_manager->allocatePages(m_requirements, missing.size(), pages.data(), infos.data()))
+        return failedFuture(VK_ERROR_OUT_OF_DEVICE_MEMORY, "SparseBuffer::commit: no memory for pages");
+
+    const VkDeviceSize page = getPageSize();
+    std::vector<VkSparseMemoryBind> binds(missing.size());
+    for (size_t i = 0; i < missing.size(); ++i)
+    {
+        binds[i].resourceOffset = missing[i] * page;
+        binds[i].size = page;
+        binds[i].memory = infos[i].deviceMemory;
+        binds[i].memoryOffset = infos[i].offset;
+        binds[i].flags = 0;
+    }
+
+    TimelinePoint signal = {};
+    std::shared_future<int> fut;
+    try
+    {
+        fut = m_memory_manager->bindSparse(m_buffer, binds, {}, signal);
+    }
+    catch (...)
+    {
+        m_memory_manager->freePages(pages.size(), pages.data());
+        throw;
+    }
+
+    for (size_t i = 0; i < missing.size(); ++i)
+        m_pages[missing[i]] = pages[i];
+    m_committed += missing.size();
+    addPendingWait(signal);
+    m_last_bind = fut;
+    return fut;
+}
+
+void SparseBuffer::decommit(VkDeviceSize offset, VkDeviceSize size)
+{
+    if (!m_resident_on_demand)
+    {
+        LOG_ERROR("SparseBuffer::decommit: buffer is not resident on demand");
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto [first, last] = pageRange(offset, size);
+    const VkDeviceSize page = getPageSize();
+    std::vector<VmaAllocation> pages;
+    std::vector<VkSparseMemoryBind> binds;
+    for (size_t p = first; p < last; ++p)
+    {
+        if (m_pages[p] == VK_NULL_HANDLE)
+            continue;
+        VkSparseMemoryBind bind = {};
+        bind.resourceOffset = p * page;
+        bind.size = page;
+        bind.memory = VK_NULL_HANDLE;
+        bind.memoryOffset = 0;
+        bind.flags = 0;
+        binds.push_back(bind);
+        pages.push_back(m_pages[p]);
+        m_pages[p] = VK_NULL_HANDLE;
     }
+    if (binds.empty())
+        return;
+
+    // The memory can only be freed once the unbind has executed
+    TimelinePoint signal = {};
+    m_last_bind = m_memory_manager->bindSparse(m_buffer, binds, {}, signal);
+    m_last_bind.wait();
+    m_memory_manager->freePages(pages.size(), pages.data());
+    m_committed -= pages.size();
+}
+
+bool SparseBuffer::isCommitted(VkDeviceSize offset, VkDeviceSize size) const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto [first, last] = pageRange(offset, size);
+    for (size_t p = first; p < last; ++p)
+    {
+        if (m_pages[p] == VK_NULL_HANDLE)
+            return false;
+    }
+    return true;
+}
+
+VkDeviceSize SparseBuffer::getPageSize() const
+{
+    return std::max<VkDeviceSize>(1, m_requirements.alignment);
+}
+
+VkDeviceSize SparseBuffer::getCommittedBytes() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_committed * getPageSize();
 }
 
 void SparseBuffer::cleanup()
 {
-    if (m_buffer != VK_NULL_HANDLE)
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_last_bind.valid())
+        m_last_bind.wait();
+    m_memory_manager->destroySparseBuffer(m_buffer);
+
+    std::vector<VmaAllocation> pages;
+    for (auto page : m_pages)
     {
-        m_memory_manager->destroyBuffer(m_buffer, m_allocation);
-        m_buffer = VK_NULL_HANDLE;
-        m_allocation = VK_NULL_HANDLE;
+        if (page != VK_NULL_HANDLE)
+            pages.push_back(page);
     }
+    m_memory_manager->freePages(pages.size(), pages.data());
+    m_pages.clear();
+    m_committed = 0;
+}
+
+std::shared_ptr<HostBuffer> HostBuffer::create(std::shared_ptr<MemoryManager> &mem_mamanger, void *ptr, size_t size,
+                                               VkBufferUsageFlags usage)
+{
+    return std::make_shared<HostBuffer>(mem_mamanger, ptr, size, usage);
+}
+
+HostBuffer::HostBuffer(std::shared_ptr<MemoryManager> &mem_mamanger, void *ptr, size_t size, VkBufferUsageFlags usage)
+    : Buffer(mem_mamanger)
+{
+    initialize(ptr, size, usage);
 }
 
+HostBuffer::~HostBuffer()
+{
+    cleanup();
+}
 
+void HostBuffer::initialize(void *ptr, size_t size, VkBufferUsageFlags usage)
+{
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if (!m_memory_manager->importHostMemory(ptr, bufferInfo, m_buffer, m_memory, m_memory_property_flags))
+        return;
+
+    m_host_ptr = ptr;
+    m_usage = usage;
+    m_size = size;
+    m_write_descriptor_set.buffer = m_buffer;
+    m_write_descriptor_set.offset = 0;
+    m_write_descriptor_set.range = size;
+}
+
+void *HostBuffer::getPtr()
+{
+    return m_host_ptr;
+}
+
+void HostBuffer::cleanup()
+{
+    m_memory_manager->releaseHostMemory(m_buffer, m_memory);
+    m_host_ptr = nullptr;
+}
+
+std::shared_ptr<ChunkedBuffer> ChunkedBuffer::create(std::vector<std::shared_ptr<Buffer>> chunks,
+                                                     VkDeviceSize chunk_size, VkDeviceSize size)
+{
+    return std::make_shared<ChunkedBuffer>(std::move(chunks), chunk_size, size);
+}
+
+ChunkedBuffer::ChunkedBuffer(std::vector<std::shared_ptr<Buffer>> chunks, VkDeviceSize chunk_size, VkDeviceSize size)
+    : m_chunks(std::move(chunks)), m_chunk_size(chunk_size), m_size(size)
+{
+    check_condition(m_chunk_size > 0, "ChunkedBuffer: chunk size must be non-zero");
+    check_condition(m_chunks.size() == (m_size + m_chunk_size - 1) / m_chunk_size,
+                    "ChunkedBuffer: chunk count does not match size");
+}
+
+template <typename Fn> void ChunkedBuffer::forEachSpan(size_t offset, size_t size, Fn &&fn) const
+{
+    check_condition(offset + size <= m_size, "ChunkedBuffer: range out of bounds");
+    size_t done = 0;
+    while (done < size)
+    {
+        const size_t pos = offset + done;
+        const size_t idx = pos / m_chunk_size;
+        const size_t chunk_offset = pos % m_chunk_size;
+        const size_t bytes = std::min<size_t>(size - done, getChunkSize(idx) - chunk_offset);
+        fn(m_chunks[idx], chunk_offset, done, bytes);
+        done += bytes;
+    }
+}
+
+std::shared_future<int> ChunkedBuffer::copyDataFrom(void *src, size_t size, size_t dst_offset)
+{
+    std::vector<std::shared_future<int>> copies;
+    forEachSpan(dst_offset, size, [&](const std::shared_ptr<Buffer> &chunk, size_t chunk_offset, size_t span_offset,
+                                      size_t bytes) {
+        copies.push_back(chunk->copyDataFrom(src, bytes, chunk_offset, span_offset));
+    });
+
+    // Deferred: the waiter collects the per-chunk results, the first failure wins
+    return std::async(std::launch::deferred, [copies = std::move(copies)]() {
+               int result = 0;
+               for (const auto &copy : copies)
+               {
+                   int status = copy.get();
+                   if (result == 0)
+                       result = status;
+               }
+               return result;
+           })
+        .share();
+}
+
+void ChunkedBuffer::copyDataTo(void *dst, size_t size, size_t src_offset)
+{
+    forEachSpan(src_offset, size, [&](const std::shared_ptr<Buffer> &chunk, size_t chunk_offset, size_t span_offset,
+                                      size_t bytes) { chunk->copyDataTo(dst, bytes, chunk_offset, span_offset); });
+}
+
+size_t ChunkedBuffer::getChunkCount() const
+{
+    return m_chunks.size();
+}
+
+const std::shared_ptr<Buffer> &ChunkedBuffer::getChunk(size_t idx) const
+{
+    check_condition(idx < m_chunks.size(), "ChunkedBuffer::getChunk: index out of range");
+    return m_chunks[idx];
+}
+
+VkDeviceSize ChunkedBuffer::getChunkSize() const
+{
+    return m_chunk_size;
+}
+
+VkDeviceSize ChunkedBuffer::getChunkSize(size_t idx) const
+{
+    return idx + 1 < m_chunks.size() ? m_chunk_size : m_size - m_chunk_size * idx;
+}
+
+VkDeviceSize ChunkedBuffer::getSize() const
+{
+    return m_size;
+}
+
+std::shared_ptr<AddressTable> AddressTable::create(std::shared_ptr<Buffer> table,
+                                                   std::vector<std::shared_ptr<Buffer>> buffers)
+{
+    return std::make_shared<AddressTable>(std::move(table), std::move(buffers));
+}
+
+AddressTable::AddressTable(std::shared_ptr<Buffer> table, std::vector<std::shared_ptr<Buffer>> buffers)
+    : m_table(std::move(table)), m_buffers(std::move(buffers))
+{
+    check_condition(m_table != nullptr, "AddressTable: no table buffer");
+    check_condition(m_table->getBufferInfo()->range >= m_buffers.size() * sizeof(VkDeviceAddress),
+                    "AddressTable: table buffer too small");
+    std::vector<VkDeviceAddress> addresses;
+    addresses.reserve(m_buffers.size());
+    for (const auto &buffer : m_buffers)
+    {
+        if (buffer)
+            buffer->pin();
+        addresses.push_back(buffer ? buffer->getDeviceAddress() : 0);
+    }
+    if (!addresses.empty())
+        m_table->copyDataFrom(addresses.data(), addresses.size() * sizeof(VkDeviceAddress));
+}
+
+AddressTable::~AddressTable()
+{
+    // Uses through the table were recorded as the buffers' last uses when they were submitted
+    for (const auto &buffer : m_buffers)
+    {
+        if (buffer)
+            buffer->unpin({VK_NULL_HANDLE, 0});
+    }
+}
+
+const std::shared_ptr<Buffer> &AddressTable::getTable() const
+{
+    return m_table;
+}
+
+const std::vector<std::shared_ptr<Buffer>> &AddressTable::getBuffers() const
+{
+    return m_buffers;
+}
 
 } // namespace runtime
\ No newline at end of file
@@ -0,0 +1,204 @@
+#include "transfer.h"
+
+#include "error_handling.h"
+#include "queue.h"
+
+#include <chrono>
+#include <iterator>
+
+namespace runtime
+{
+
+std::shared_ptr<TransferEngine> TransferEngine::create(std::shared_ptr<QueueManager> &queue_manager, VkDevice device)
+{
+    return std::make_shared<TransferEngine>(queue_manager, device);
+}
+
+TransferEngine::TransferEngine(std::shared_ptr<QueueManager> &queue_manager, VkDevice device)
+    : m_queue_manager(queue_manager), m_device(device)
+{
+    initialize();
+}
+
+TransferEngine::~TransferEngine()
+{
+    cleanup();
+}
+
+TransferEngine::Ticket TransferEngine::upload(VkBuffer staging, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                                              const std::vector<VkBufferMemoryBarrier2> &barriers,
+                                              const std::vector<TimelinePoint> &waits,
+                                              std::vector<std::shared_ptr<const void>> resources)
+{
+    return record(m_transfer, staging, dst, regions, barriers, waits, std::move(resources),
+                  hasDedicatedTransferQueue());
+}
+
+TransferEngine::Ticket TransferEngine::copy(VkBuffer src, VkBuffer dst, const std::vector<VkBufferCopy> &regions,
+                                            const std::vector<VkBufferMemoryBarrier2> &barriers,
+                                            const std::vector<TimelinePoint> &waits,
+                                            std::vector<std::shared_ptr<const void>> resources)
+{
+    return record(m_compute, src, dst, regions, barriers, waits, std::move(resources), false);
+}
+
+uint32_t TransferEngine::getTransferQueueFamilyIndex() const
+{
+    return m_transfer.queueFamilyIndex;
+}
+
+uint32_t TransferEngine::getComputeQueueFamilyIndex() const
+{
+    return m_compute.queueFamilyIndex;
+}
+
+bool TransferEngine::hasDedicatedTransferQueue() const
+{
+    return m_transfer.queueFamilyIndex != m_compute.queueFamilyIndex;
+}
+
+VkCommandBuffer TransferEngine::beginCommandBuffer(Lane &lane, std::vector<std::shared_ptr<const void>> &retired)
+{
+    while (!lane.inflight.empty() &&
+           lane.inflight.front().fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    {
+        auto &front = lane.inflight.front();
+        lane.free.push_back(front.commandBuffer);
+        std::move(front.resources.begin(), front.resources.end(), std::back_inserter(retired));
+        lane.inflight.pop_front();
+    }
+
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!lane.free.empty())
+    {
+        commandBuffer = lane.free.back();
+        lane.free.pop_back();
+    }
+    else
+    {
+        VkCommandBufferAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+        allocInfo.pNext = nullptr;
+        allocInfo.commandPool = lane.pool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        check_result(vkAllocateCommandBuffers(m_device, &allocInfo, &commandBuffer),
+                     "Failed to allocate transfer command buffer");
+    }
+
+    VkCommandBufferBeginInfo beginInfo = {VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+    beginInfo.pNext = nullptr;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = nullptr;
+    check_result(vkBeginCommandBuffer(commandBuffer, &beginInfo), "Failed to begin transfer command buffer");
+    return commandBuffer;
+}
+
+TransferEngine::Ticket TransferEngine::record(Lane &lane, VkBuffer src, VkBuffer dst,
+                                              const std::vector<VkBufferCopy> &regions,
+                                              const std::vector<VkBufferMemoryBarrier2> &barriers,
+                                              const std::vector<TimelinePoint> &waits,
+                                              std::vector<std::shared_ptr<const void>> resources, bool release)
+{
+    check_condition(!regions.empty(), "TransferEngine: no regions to copy");
+
+    Ticket ticket = {};
+    // Declared before the lock so retired resources are released after it
+    std::vector<std::shared_ptr<const void>> retired;
+    std::unique_lock<std::mutex> lock(lane.mutex);
+    VkCommandBuffer commandBuffer = beginCommandBuffer(lane, retired);
+
+    BarrierTracker tracker;
+    for (const auto &barrier : barriers)
+        tracker.addBarrier(barrier);
+    tracker.flush(commandBuffer);
+
+    vkCmdCopyBuffer(commandBuffer, src, dst, static_cast<uint32_t>(regions.size()), regions.data());
+
+    if (release)
+    {
+        // Hand the written ranges to the compute family; the acquire half goes back to the caller
+        for (const auto &region : regions)
+        {
+            VkBufferMemoryBarrier2 barrier = {VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2};
+            barrier.pNext = nullptr;
+            barrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+            barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+            barrier.dstAccessMask = VK_ACCESS_2_NONE;
+            barrier.srcQueueFamilyIndex = m_transfer.queueFamilyIndex;
+            barrier.dstQueueFamilyIndex = m_compute.queueFamilyIndex;
+            barrier.buffer = dst;
+            barrier.offset = region.dstOffset;
+            barrier.size = region.size;
+            tracker.addBarrier(barrier);
+
+            barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+            barrier.srcAccessMask = VK_ACCESS_2_NONE;
+            barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+            barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+                                    VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            ticket.acquires.push_back(barrier);
+        }
+        tracker.flush(commandBuffer);
+    }
+
+    check_result(vkEndCommandBuffer(commandBuffer), "Failed to end transfer command buffer");
+
+    try
+    {
+        ticket.fut = m_queue_manager->submitDirect(lane.queueFamilyIndex, commandBuffer, waits, ticket.signal);
+    }
+    catch (...)
+    {
+        lane.free.push_back(commandBuffer);
+        throw;
+    }
+    lane.inflight.push_back({commandBuffer, ticket.fut, std::move(resources)});
+    return ticket;
+}
+
+void TransferEngine::initializeLane(Lane &lane, uint32_t queueFamilyIndex)
+{
+    check_condition(queueFamilyIndex != UINT32_MAX, "TransferEngine: no queue family supports transfers");
+    lane.queueFamilyIndex = queueFamilyIndex;
+
+    VkCommandPoolCreateInfo poolInfo = {VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+    poolInfo.pNext = nullptr;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndex;
+    check_result(vkCreateCommandPool(m_device, &poolInfo, nullptr, &lane.pool), "Failed to create transfer command pool");
+}
+
+void TransferEngine::cleanupLane(Lane &lane)
+{
+    std::deque<Inflight> retired;
+    std::unique_lock<std::mutex> lock(lane.mutex);
+    for (auto &inflight : lane.inflight)
+    {
+        if (inflight.fut.valid())
+            inflight.fut.wait();
+    }
+    retired.swap(lane.inflight);
+    lane.free.clear();
+
+    if (lane.pool != VK_NULL_HANDLE)
+    {
+        vkDestroyCommandPool(m_device, lane.pool, nullptr);
+        lane.pool = VK_NULL_HANDLE;
+    }
+}
+
+bool TransferEngine::initialize()
+{
+    initializeLane(m_transfer, m_queue_manager->getDedicatedQueueFamilyIndex(VK_QUEUE_TRANSFER_BIT));
+    initializeLane(m_compute, m_queue_manager->getQueueFamilyIndex(VK_QUEUE_COMPUTE_BIT));
+    return true;
+}
+
+void TransferEngine::cleanup()
+{
+    cleanupLane(m_transfer);
+    cleanupLane(m_compute);
+}
+
+} // namespace runtime
@@ -0,0 +1,563 @@
+#include "weight_loader.h"
+
+#include "config.h"
+#include "device.h"
+#include "error_handling.h"
+#include "storage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace runtime
+{
+
+// Just enough JSON for a safetensors header: objects, arrays, strings and integers
+static void skipSpace(std::string_view json, size_t &pos)
+{
+    while (pos < json.size() && (json[pos] == ' ' || json[pos] == '\t' || json[pos] == '\n' || json[pos] == '\r'))
+        ++pos;
+}
+
+static bool expect(std::string_view json, size_t &pos, char c)
+{
+    skipSpace(json, pos);
+    if (pos >= json.size() || json[pos] != c)
+        return false;
+    ++pos;
+    return true;
+}
+
+static bool parseString(std::string_view json, size_t &pos, std::string &out)
+{
+    if (!expect(json, pos, '"'))
+        return false;
+    out.clear();
+    while (pos < json.size() && json[pos] != '"')
+    {
+        char c = json[pos++];
+        if (c == '\\')
+        {
+            if (pos >= json.size())
+                return false;
+            c = json[pos++];
+            switch (c)
+            {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'u':
+                // Tensor names are ASCII in practice; keep the escape as written
+                out += "\\u";
+                continue;
+            default: break;
+            }
+        }
+        out += c;
+    }
+    return expect(json, pos, '"');
+}
+
+static bool parseInteger(std::string_view json, size_t &pos, int64_t &out)
+{
+    skipSpace(json, pos);
+    const size_t start = pos;
+    if (pos < json.size() && json[pos] == '-')
+        ++pos;
+    int64_t value = 0;
+    while (pos < json.size() && json[pos] >= '0' && json[pos] <= '9')
+        value = value * 10 + (json[pos++] - '0');
+    if (pos == start || (json[start] == '-' && pos == start + 1))
+        return false;
+    out = json[start] == '-' ? -value : value;
+    return true;
+}
+
+static bool parseIntegerArray(std::string_view json, size_t &pos, std::vector<int64_t> &out)
+{
+    if (!expect(json, pos, '['))
+        return false;
+    out.clear();
+    if (expect(json, pos, ']'))
+        return true;
+    do
+    {
+        int64_t value;
+        if (!parseInteger(json, pos, value))
+            return false;
+        out.push_back(value);
+    } while (expect(json, pos, ','));
+    return expect(json, pos, ']');
+}
+
+static bool skipValue(std::string_view json, size_t &pos)
+{
+    skipSpace(json, pos);
+    if (pos >= json.size())
+        return false;
+    std::string ignored;
+    switch (json[pos])
+    {
+    case '"':
+        return parseString(json, pos, ignored);
+    case '{':
+    case '[': {
+        const char close = json[pos] == '{' ? '}' : ']';
+        ++pos;
+        if (expect(json, pos, close))
+            return true;
+        do
+        {
+            if (close == '}' && (!parseString(json, pos, ignored) || !expect(json, pos, ':')))
+                return false;
+            if (!skipValue(json, pos))
+                return false;
+        } while (expect(json, pos, ','));
+        return expect(json, pos, close);
+    }
+    default:
+        // Numbers and literals
+        while (pos < json.size() && json[pos] != ',' && json[pos] != '}' && json[pos] != ']')
+            ++pos;
+        return true;
+    }
+}
+
+static size_t dtypeSize(const std::string &dtype)
+{
+    static const std::unordered_map<std::string, size_t> sizes = {
+        {"F64", 8}, {"F32", 4},  {"F16", 2}, {"BF16", 2}, {"F8_E4M3", 1}, {"F8_E5M2", 1}, {"I64", 8}, {"I32", 4},
+        {"I16", 2}, {"I8", 1},   {"U64", 8}, {"U32", 4},  {"U16", 2},     {"U8", 1},      {"BOOL", 1}};
+    auto it = sizes.find(dtype);
+    return it != sizes.end() ? it->second : 0;
+}
+
+std::shared_ptr<WeightLoader> WeightLoader::create(const std::string &path)
+{
+    return std::make_shared<WeightLoader>(path);
+}
+
+WeightLoader::WeightLoader(const std::string &path)
+    : m_path(path), m_readers(WEIGHT_LOADER_READERS), m_chunk_size(WEIGHT_LOADER_CHUNK_SIZE),
+      m_max_in_flight(WEIGHT_LOADER_MAX_IN_FLIGHT)
+{
+    if (!initialize(path))
+        cleanup();
+}
+
+WeightLoader::~WeightLoader()
+{
+    cleanup();
+}
+
+bool WeightLoader::initialize(const std::string &path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        LOG_ERROR("WeightLoader: cannot open %s", path.c_str());
+        return false;
+    }
+    m_file = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        LOG_ERROR("WeightLoader: cannot read the size of %s", path.c_str());
+        return false;
+    }
+    m_size = static_cast<size_t>(size.QuadPart);
+    m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = static_cast<const uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    m_fd = ::open(path.c_str(), O_RDONLY);
+    if (m_fd < 0)
+    {
+        LOG_ERROR("WeightLoader: cannot open %s", path.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || st.st_size == 0)
+    {
+        LOG_ERROR("WeightLoader: cannot read the size of %s", path.c_str());
+        return false;
+    }
+    m_size = static_cast<size_t>(st.st_size);
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (data != MAP_FAILED)
+    {
+        m_data = static_cast<const uint8_t *>(data);
+        madvise(data, m_size, MADV_SEQUENTIAL);
+    }
+#endif
+    if (!m_data)
+    {
+        LOG_ERROR("WeightLoader: cannot map %s", path.c_str());
+        return false;
+    }
+
+    // 8-byte little-endian header length, then the JSON header, then the tensor data
+    uint64_t headerSize = 0;
+    if (m_size < sizeof(headerSize))
+    {
+        LOG_ERROR("WeightLoader: %s is too small to be a safetensors file", path.c_str());
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(headerSize); ++i)
+        headerSize |= static_cast<uint64_t>(m_data[i]) << (8 * i);
+    if (headerSize > m_size - sizeof(headerSize))
+    {
+        LOG_ERROR("WeightLoader: header of %s runs past the end of the file", path.c_str());
+        return false;
+    }
+
+    std::string_view header(reinterpret_cast<const char *>(m_data + sizeof(headerSize)), headerSize);
+    if (!parseHeader(header, sizeof(headerSize) + headerSize))
+    {
+        LOG_ERROR("WeightLoader: malformed header in %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool WeightLoader::parseHeader(std::string_view header, size_t dataOffset)
+{
+    size_t pos = 0;
+    if (!expect(header, pos, '{'))
+        return false;
+    if (expect(header, pos, '}'))
+        return true;
+
+    std::string name, key;
+    do
+    {
+        if (!parseString(header, pos, name) || !expect(header, pos, ':'))
+            return false;
+        if (name == "__metadata__")
+        {
+            if (!skipValue(header, pos))
+                return false;
+            continue;
+        }
+
+        TensorInfo info{};
+        std::vector<int64_t> offsets;
+        if (!expect(header, pos, '{'))
+            return false;
+        do
+        {
+            if (!parseString(header, pos, key) || !expect(header, pos, ':'))
+                return false;
+            bool ok;
+            if (key == "dtype")
+                ok = parseString(header, pos, info.dtype);
+            else if (key == "shape")
+                ok = parseIntegerArray(header, pos, info.shape);
+            else if (key == "data_offsets")
+                ok = parseIntegerArray(header, pos, offsets);
+            else
+                ok = skipValue(header, pos);
+            if (!ok)
+                return false;
+        } while (expect(header, pos, ','));
+        if (!expect(header, pos, '}'))
+            return false;
+
+        if (offsets.size() != 2 || offsets[0] < 0 || offsets[1] < offsets[0] ||
+            dataOffset + static_cast<size_t>(offsets[1]) > m_size)
+        {
+            LOG_ERROR("WeightLoader: tensor %s has invalid data offsets", name.c_str());
+            return false;
+        }
+        info.offset = dataOffset + static_cast<size_t>(offsets[0]);
+        info.size = static_cast<size_t>(offsets[1] - offsets[0]);
+
+        if (size_t element = dtypeSize(info.dtype))
+        {
+            size_t count = 1;
+            for (int64_t dim : info.shape)
+                count *= static_cast<size_t>(std::max<int64_t>(dim, 0));
+            if (count * element != info.size)
+                LOG_WARNING("WeightLoader: tensor %s holds %zu bytes but its shape needs %zu", name.c_str(),
+                            info.size, count * element);
+        }
+        m_tensors.emplace(name, std::move(info));
+    } while (expect(header, pos, ','));
+    return expect(header, pos, '}');
+}
+
+void WeightLoader::cleanup()
+{
+#ifdef _WIN32
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+    m_mapping = nullptr;
+    m_file = nullptr;
+#else
+    if (m_data)
+        munmap(const_cast<uint8_t *>(m_data), m_size);
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+#endif
+    m_data = nullptr;
+    m_size = 0;
+    m_tensors.clear();
+}
+
+bool WeightLoader::isOpen() const
+{
+    return m_data != nullptr;
+}
+
+const std::map<std::string, WeightLoader::TensorInfo> &WeightLoader::getTensors() const
+{
+    return m_tensors;
+}
+
+const void *WeightLoader::getData(const std::string &name) const
+{
+    auto it = m_tensors.find(name);
+    return it != m_tensors.end() ? m_data + it->second.offset : nullptr;
+}
+
+void WeightLoader::setReaderCount(size_t readers)
+{
+    m_readers = std::max<size_t>(1, readers);
+}
+
+void WeightLoader::setChunkSize(size_t bytes)
+{
+    m_chunk_size = std::max<size_t>(1, bytes);
+}
+
+void WeightLoader::setMaxInFlight(size_t bytes)
+{
+    m_max_in_flight = std::max<size_t>(1, bytes);
+}
+
+std::unordered_map<std::string, std::shared_ptr<Buffer>> WeightLoader::load(const std::shared_ptr<Device> &device,
+                                                                            const std::vector<std::string> &names)
+{
+    std::unordered_map<std::string, std::shared_ptr<Buffer>> buffers;
+    if (!isOpen())
+        return buffers;
+
+    std::vector<const std::pair<const std::string, TensorInfo> *> tensors;
+    if (names.empty())
+    {
+        for (const auto &entry : m_tensors)
+            tensors.push_back(&entry);
+    }
+    else
+    {
+        for (const auto &name : names)
+        {
+            auto it = m_tensors.find(name);
+            if (it == m_tensors.end())
+                LOG_WARNING("WeightLoader: no tensor named %s", name.c_str());
+            else
+                tensors.push_back(&*it);
+        }
+    }
+
+    // Per tensor: copies into one Buffer update its synchronization state and must not
+    // overlap, and any failed chunk fails the whole tensor
+    struct Upload
+    {
+        const std::string *name;
+        std::mutex lock;
+        std::atomic<bool> failed{false};
+    };
+    struct Job
+    {
+        Buffer *buffer;
+        Upload *upload;
+        const uint8_t *src;
+        size_t offset;
+        size_t bytes;
+    };
+    std::vector<Job> jobs;
+    std::deque<Upload> uploads;
+    for (const auto *entry : tensors)
+    {
+        const TensorInfo &info = entry->second;
+        auto buffer = info.size ? device->createWorkingBuffer(info.size, true) : nullptr;
+        buffers[entry->first] = buffer;
+        if (!buffer)
+        {
+            if (info.size)
+                LOG_ERROR("WeightLoader: cannot allocate %zu bytes for %s", info.size, entry->first.c_str());
+            continue;
+        }
+        Upload &upload = uploads.emplace_back();
+        upload.name = &entry->first;
+        for (size_t offset = 0; offset < info.size; offset += m_chunk_size)
+            jobs.push_back({buffer.get(), &upload, m_data + info.offset + offset, offset,
+                            std::min(m_chunk_size, info.size - offset)});
+    }
+
+    std::mutex budgetMutex;
+    std::condition_variable budgetFreed;
+    size_t inFlight = 0;
+    std::atomic<size_t> next{0};
+    const size_t maxInFlight = std::max(m_max_in_flight, m_chunk_size);
+    // First error outside a copy; rethrown once every reader has been joined
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto fail = [&](std::exception_ptr e) {
+        std::unique_lock<std::mutex> lock(errorMutex);
+        if (!error)
+            error = e;
+        next = jobs.size();
+    };
+    auto release = [&](size_t bytes) {
+        {
+            std::unique_lock<std::mutex> lock(budgetMutex);
+            inFlight -= bytes;
+        }
+        budgetFreed.notify_all();
+    };
+
+    auto reader = [&]() {
+        struct Pending
+        {
+            std::shared_future<int> done;
+            size_t bytes;
+            Upload *upload;
+        };
+        std::deque<Pending> pending;
+        // Release the budget of finished copies; with block, wait for the oldest one first
+        auto retire = [&](bool block) {
+            while (!pending.empty())
+            {
+                Pending &front = pending.front();
+                if (!block && front.done.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                    break;
+                try
+                {
+                    if (front.done.get() != 0)
+                        front.upload->failed = true;
+                }
+                catch (const std::exception &e)
+                {
+                    LOG_ERROR("WeightLoader: upload of %s failed: %s", front.upload->name->c_str(), e.what());
+                    front.upload->failed = true;
+                }
+                release(front.bytes);
+                pending.pop_front();
+                block = false;
+            }
+        };
+
+        try
+        {
+            for (size_t i = next++; i < jobs.size(); i = next++)
+            {
+                const Job &job = jobs[i];
+                retire(false);
+                {
+                    std::unique_lock<std::mutex> lock(budgetMutex);
+                    while (inFlight > 0 && inFlight + job.bytes > maxInFlight)
+                    {
+                        if (pending.empty())
+                            budgetFreed.wait(lock);
+                        else
+                        {
+                            lock.unlock();
+                            retire(true);
+                            lock.lock();
+                        }
+                    }
+                    inFlight += job.bytes;
+                }
+                if (job.upload->failed)
+                {
+                    release(job.bytes);
+                    continue;
+                }
+
+                // Fault the pages in before serializing on the tensor so disk reads overlap
+                volatile uint8_t sink = 0;
+                for (size_t offset = 0; offset < job.bytes; offset += 4096)
+                    sink = sink + job.src[offset];
+
+                std::shared_future<int> done;
+                try
+                {
+                    std::unique_lock<std::mutex> lock(job.upload->lock);
+                    done = job.buffer->copyDataFrom(const_cast<uint8_t *>(job.src), job.bytes, job.offset);
+                }
+                catch (const std::exception &e)
+                {
+                    // Staging, submission or validation failed; the tensor is dropped, the rest continue
+                    LOG_ERROR("WeightLoader: upload of %s failed: %s", job.upload->name->c_str(), e.what());
+                    job.upload->failed = true;
+                    release(job.bytes);
+                    continue;
+                }
+                pending.push_back({std::move(done), job.bytes, job.upload});
+            }
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+        }
+        while (!pending.empty())
+            retire(true);
+    };
+
+    std::vector<std::thread> readers;
+    const size_t count = std::min(m_readers, std::max<size_t>(1, jobs.size()));
+    try
+    {
+        for (size_t i = 1; i < count; ++i)
+            readers.emplace_back(reader);
+    }
+    catch (...)
+    {
+        // Fewer readers than asked for; the ones started and this thread still finish the jobs
+        LOG_WARNING("WeightLoader: started %zu of %zu reader threads", readers.size() + 1, count);
+    }
+    reader();
+    for (auto &thread : readers)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+
+    for (const auto &upload : uploads)
+    {
+        if (upload.failed)
+        {
+            LOG_ERROR("WeightLoader: %s was not loaded", upload.name->c_str());
+            buffers[*upload.name] = nullptr;
+        }
+    }
+    return buffers;
+}
+
+} // namespace runtime
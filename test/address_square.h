@@ -0,0 +1,56 @@
+#pragma once
+const uint32_t address_square[] = {
+	0x07230203,0x00010600,0x0008000b,0x00000039,0x00000000,0x00020011,0x00000001,0x00020011,
+	0x000014e3,0x0009000a,0x5f565053,0x5f52484b,0x73796870,0x6c616369,0x6f74735f,0x65676172,
+	0x6675625f,0x00726566,0x0006000b,0x00000001,0x4c534c47,0x6474732e,0x3035342e,0x00000000,
+	0x0003000e,0x000014e4,0x00000001,0x0007000f,0x00000005,0x00000002,0x6e69616d,0x00000000,
+	0x00000003,0x00000004,0x00060010,0x00000002,0x00000011,0x00000400,0x00000001,0x00000001,
+	0x00030003,0x00000002,0x000001cc,0x00070004,0x455f4c47,0x625f5458,0x65666675,0x65725f72,
+	0x65726566,0x0065636e,0x00040005,0x00000002,0x6e69616d,0x00000000,0x00040005,0x00000005,
+	0x65646e69,0x00000078,0x00080005,0x00000003,0x475f6c67,0x61626f6c,0x766e496c,0x7461636f,
+	0x496e6f69,0x00000044,0x00040005,0x00000006,0x61726150,0x0000736d,0x00040006,0x00000006,
+	0x00000000,0x00637273,0x00050006,0x00000006,0x00000001,0x6c626174,0x00000065,0x00050006,
+	0x00000006,0x00000002,0x6e756f63,0x00000074,0x00040005,0x00000007,0x616f6c46,0x00007374,
+	0x00040006,0x00000007,0x00000000,0x00000076,0x00040005,0x00000008,0x6c626154,0x00000065,
+	0x00050006,0x00000008,0x00000000,0x7074756f,0x00737475,0x00050005,0x00000009,0x4674754f,
+	0x74616f6c,0x00000073,0x00040006,0x00000009,0x00000000,0x00000076,0x00030005,0x00000004,
+	0x00000000,0x00040047,0x00000003,0x0000000b,0x0000001c,0x00050048,0x00000006,0x00000000,
+	0x00000023,0x00000000,0x00050048,0x00000006,0x00000001,0x00000023,0x00000008,0x00050048,
+	0x00000006,0x00000002,0x00000023,0x00000010,0x00030047,0x00000006,0x00000002,0x00040047,
+	0x0000000a,0x00000006,0x00000004,0x00040048,0x00000007,0x00000000,0x00000018,0x00050048,
+	0x00000007,0x00000000,0x00000023,0x00000000,0x00030047,0x00000007,0x00000002,0x00040047,
+	0x0000000b,0x00000006,0x00000008,0x00040048,0x00000008,0x00000000,0x00000018,0x00050048,
+	0x00000008,0x00000000,0x00000023,0x00000000,0x00030047,0x00000008,0x00000002,0x00040047,
+	0x0000000c,0x00000006,0x00000004,0x00040048,0x00000009,0x00000000,0x00000019,0x00050048,
+	0x00000009,0x00000000,0x00000023,0x00000000,0x00030047,0x00000009,0x00000002,0x00020013,
+	0x0000000d,0x00030021,0x0000000e,0x0000000d,0x00040015,0x0000000f,0x00000020,0x00000000,
+	0x00040020,0x00000010,0x00000007,0x0000000f,0x00040017,0x00000011,0x0000000f,0x00000003,
+	0x00040020,0x00000012,0x00000001,0x00000011,0x0004003b,0x00000012,0x00000003,0x00000001,
+	0x0004002b,0x0000000f,0x00000013,0x00000000,0x00040020,0x00000014,0x00000001,0x0000000f,
+	0x00030016,0x00000015,0x00000020,0x0003001d,0x0000000a,0x00000015,0x0003001e,0x00000007,
+	0x0000000a,0x00040020,0x00000016,0x000014e5,0x00000007,0x0003001d,0x0000000c,0x00000015,
+	0x0003001e,0x00000009,0x0000000c,0x00040020,0x00000017,0x000014e5,0x00000009,0x0003001d,
+	0x0000000b,0x00000017,0x0003001e,0x00000008,0x0000000b,0x00040020,0x00000018,0x000014e5,
+	0x00000008,0x0005001e,0x00000006,0x00000016,0x00000018,0x0000000f,0x00040020,0x00000019,
+	0x00000009,0x00000006,0x0004003b,0x00000019,0x00000004,0x00000009,0x00040015,0x0000001a,
+	0x00000020,0x00000001,0x0004002b,0x0000001a,0x0000001b,0x00000000,0x0004002b,0x0000001a,
+	0x0000001c,0x00000001,0x0004002b,0x0000001a,0x0000001d,0x00000002,0x00040020,0x0000001e,
+	0x00000009,0x0000000f,0x00020014,0x0000001f,0x00040020,0x00000020,0x00000009,0x00000016,
+	0x00040020,0x00000021,0x000014e5,0x00000015,0x00040020,0x00000022,0x00000009,0x00000018,
+	0x00040020,0x00000023,0x000014e5,0x00000017,0x00050036,0x0000000d,0x00000002,0x00000000,
+	0x0000000e,0x000200f8,0x00000024,0x0004003b,0x00000010,0x00000005,0x00000007,0x00050041,
+	0x00000014,0x00000025,0x00000003,0x00000013,0x0004003d,0x0000000f,0x00000026,0x00000025,
+	0x0003003e,0x00000005,0x00000026,0x0004003d,0x0000000f,0x00000027,0x00000005,0x00050041,
+	0x0000001e,0x00000028,0x00000004,0x0000001d,0x0004003d,0x0000000f,0x00000029,0x00000028,
+	0x000500b0,0x0000001f,0x0000002a,0x00000027,0x00000029,0x000300f7,0x0000002b,0x00000000,
+	0x000400fa,0x0000002a,0x0000002c,0x0000002b,0x000200f8,0x0000002c,0x00050041,0x00000022,
+	0x0000002d,0x00000004,0x0000001c,0x0004003d,0x00000018,0x0000002e,0x0000002d,0x00060041,
+	0x00000023,0x0000002f,0x0000002e,0x0000001b,0x0000001b,0x0006003d,0x00000017,0x00000030,
+	0x0000002f,0x00000002,0x00000008,0x0004003d,0x0000000f,0x00000031,0x00000005,0x00050041,
+	0x00000020,0x00000032,0x00000004,0x0000001b,0x0004003d,0x00000016,0x00000033,0x00000032,
+	0x0004003d,0x0000000f,0x00000034,0x00000005,0x00060041,0x00000021,0x00000035,0x00000033,
+	0x0000001b,0x00000034,0x0006003d,0x00000015,0x00000036,0x00000035,0x00000002,0x00000004,
+	0x00050085,0x00000015,0x00000037,0x00000036,0x00000036,0x00060041,0x00000021,0x00000038,
+	0x00000030,0x0000001b,0x00000031,0x0005003e,0x00000038,0x00000037,0x00000002,0x00000004,
+	0x000200f9,0x0000002b,0x000200f8,0x0000002b,0x000100fd,0x00010038
+};
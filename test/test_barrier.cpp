@@ -0,0 +1,181 @@
+#include "barrier.h"
+#include "test_utils.h"
+#include <cstdint>
+#include <vector>
+
+using namespace runtime;
+using namespace vkrt::test;
+
+// The tracker never dereferences buffer handles, so any non-null value will do
+static VkBuffer fakeBuffer(uintptr_t id)
+{
+    return reinterpret_cast<VkBuffer>(id);
+}
+
+static BufferAccess shaderRead(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+    return {buffer, offset, size, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT};
+}
+
+static BufferAccess shaderWrite(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+    return {buffer, offset, size, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT};
+}
+
+static BufferAccess transferRead(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+    return {buffer, offset, size, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT};
+}
+
+static BufferAccess transferWrite(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+    return {buffer, offset, size, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT};
+}
+
+class BarrierOverlapTest : public Test {
+public:
+    BarrierOverlapTest(std::string name) : Test(name) {}
+    void run() override {
+        BarrierTracker tracker;
+        VkBuffer buffer = fakeBuffer(1);
+        TEST_ASSERT(!tracker.access(shaderWrite(buffer, 0, 100)), "A first write has nothing to wait on");
+        TEST_ASSERT(tracker.access(shaderRead(buffer, 50, 100)), "Read-after-write needs a barrier");
+
+        auto barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1, "Expected one barrier");
+        TEST_ASSERT(barriers[0].buffer == buffer, "Barrier on the wrong buffer");
+        TEST_ASSERT(barriers[0].offset == 50 && barriers[0].size == 50, "Barrier should cover the overlap only");
+        TEST_ASSERT(barriers[0].srcAccessMask == VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT &&
+                        barriers[0].dstAccessMask == VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
+                    "Barrier should make the write visible to the read");
+        TEST_ASSERT(!tracker.hasPending(), "takePending should leave nothing queued");
+
+        // Another buffer is tracked independently
+        TEST_ASSERT(!tracker.access(shaderRead(fakeBuffer(2), 0, 100)), "Untouched buffer needs no barrier");
+    }
+};
+REGISTER_TEST(BarrierOverlapTest);
+
+class BarrierAdjacentTest : public Test {
+public:
+    BarrierAdjacentTest(std::string name) : Test(name) {}
+    void run() override {
+        BarrierTracker tracker;
+        VkBuffer buffer = fakeBuffer(1);
+        tracker.access(shaderWrite(buffer, 0, 100));
+        TEST_ASSERT(!tracker.access(shaderRead(buffer, 100, 100)), "Reading the next range needs no barrier");
+        TEST_ASSERT(!tracker.access(shaderWrite(buffer, 200, 100)), "Writing the next range needs no barrier");
+        TEST_ASSERT(!tracker.hasPending(), "Adjacent ranges must not queue barriers");
+    }
+};
+REGISTER_TEST(BarrierAdjacentTest);
+
+class BarrierReadAfterReadTest : public Test {
+public:
+    BarrierReadAfterReadTest(std::string name) : Test(name) {}
+    void run() override {
+        BarrierTracker tracker;
+        VkBuffer buffer = fakeBuffer(1);
+        tracker.access(shaderRead(buffer, 0, 100));
+        TEST_ASSERT(!tracker.access(shaderRead(buffer, 0, 100)), "Read-after-read needs no barrier");
+        TEST_ASSERT(!tracker.access(shaderRead(buffer, 50, 100)), "Overlapping reads need no barrier");
+        TEST_ASSERT(!tracker.hasPending(), "Reads must not queue barriers");
+
+        // Once a read has waited on a write, further reads of the same kind do not wait again
+        tracker.access(shaderWrite(buffer, 0, 100));
+        TEST_ASSERT(tracker.access(shaderRead(buffer, 0, 100)), "First read after the write needs a barrier");
+        tracker.takePending();
+        TEST_ASSERT(!tracker.access(shaderRead(buffer, 0, 100)), "Second read is already covered");
+        TEST_ASSERT(tracker.access(transferRead(buffer, 0, 100)), "A read from another stage still needs a barrier");
+    }
+};
+REGISTER_TEST(BarrierReadAfterReadTest);
+
+class BarrierWriteAfterReadTest : public Test {
+public:
+    BarrierWriteAfterReadTest(std::string name) : Test(name) {}
+    void run() override {
+        BarrierTracker tracker;
+        VkBuffer buffer = fakeBuffer(1);
+        tracker.access(shaderRead(buffer, 0, 100));
+        TEST_ASSERT(tracker.access(transferWrite(buffer, 0, 100)), "Write-after-read needs a barrier");
+
+        auto barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1, "Expected one barrier");
+        TEST_ASSERT(barriers[0].srcStageMask == VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT &&
+                        barriers[0].dstStageMask == VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    "Barrier should order the read before the write");
+        TEST_ASSERT(barriers[0].srcAccessMask == VK_ACCESS_2_NONE,
+                    "Write-after-read is an execution dependency only");
+
+        // The write replaced the readers, so the next read waits on the write
+        TEST_ASSERT(tracker.access(shaderRead(buffer, 0, 100)), "Read after the new write needs a barrier");
+        barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1 && barriers[0].srcAccessMask == VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    "Read should wait on the transfer write");
+    }
+};
+REGISTER_TEST(BarrierWriteAfterReadTest);
+
+class BarrierWriteReadWriteTest : public Test {
+public:
+    BarrierWriteReadWriteTest(std::string name) : Test(name) {}
+    void run() override {
+        BarrierTracker tracker;
+        VkBuffer buffer = fakeBuffer(1);
+        // Transfer write, compute read, transfer write: the second write must wait for the read too
+        tracker.access(transferWrite(buffer, 0, 100));
+        TEST_ASSERT(tracker.access(shaderRead(buffer, 0, 100)), "Read-after-write needs a barrier");
+        tracker.takePending();
+        TEST_ASSERT(tracker.access(transferWrite(buffer, 0, 100)), "Write after the read needs a barrier");
+
+        auto barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1, "Expected one barrier");
+        TEST_ASSERT(barriers[0].srcStageMask ==
+                        (VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT),
+                    "Barrier should wait on the earlier write and the read in between");
+        TEST_ASSERT(barriers[0].srcAccessMask == VK_ACCESS_2_TRANSFER_WRITE_BIT &&
+                        barriers[0].dstStageMask == VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    "Barrier should make the earlier write available to the new one");
+    }
+};
+REGISTER_TEST(BarrierWriteReadWriteTest);
+
+class BarrierPartialOverlapTest : public Test {
+public:
+    BarrierPartialOverlapTest(std::string name) : Test(name) {}
+    void run() override {
+        BarrierTracker tracker;
+        VkBuffer buffer = fakeBuffer(1);
+        // A transfer fills [0, 100), then a shader rewrites the middle, splitting the range
+        tracker.access(transferWrite(buffer, 0, 100));
+        TEST_ASSERT(tracker.access(shaderWrite(buffer, 25, 50)), "Write-after-write needs a barrier");
+        auto barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1 && barriers[0].offset == 25 && barriers[0].size == 50,
+                    "Write-after-write barrier should cover the overwritten middle only");
+
+        // Each piece remembers its own last writer
+        tracker.access(shaderRead(buffer, 0, 10));
+        barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1 && barriers[0].srcStageMask == VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    "Head of the range was last written by the transfer");
+        tracker.access(shaderRead(buffer, 30, 10));
+        barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1 && barriers[0].srcStageMask == VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                    "Middle of the range was last written by the shader");
+        tracker.access(shaderRead(buffer, 80, 10));
+        barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1 && barriers[0].srcStageMask == VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    "Tail of the range was last written by the transfer");
+
+        // A read spanning every piece waits only on those not read yet, with one widened barrier
+        TEST_ASSERT(tracker.access(shaderRead(buffer, 0, 100)), "Spanning read needs a barrier");
+        barriers = tracker.takePending();
+        TEST_ASSERT(barriers.size() == 1 && barriers[0].offset == 10 && barriers[0].size == 90,
+                    "Barrier should start after the piece already read");
+        TEST_ASSERT(barriers[0].srcStageMask ==
+                        (VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT),
+                    "Barrier should wait on both writers");
+    }
+};
+REGISTER_TEST(BarrierPartialOverlapTest);
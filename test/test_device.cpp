@@ -3,6 +3,12 @@
 #include "logging.h"
 #include "storage.h"
 #include "runtime.h"
+#include "queue.h"
+#include "device_features.h"
+#include "pipeline_cache.h"
+#include "program.h"
+#include "square.h"
+#include <filesystem>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
@@ -115,6 +121,203 @@ public:
 };
 REGISTER_TEST(CommandPoolManagerTest);
 
+class CommandGraphReplayTest : public DeviceTestBase {
+public:
+    CommandGraphReplayTest(std::string name) : DeviceTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        const size_t count = 1024;
+        const size_t bufferSize = count * sizeof(float);
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        std::vector<float> data(count, 2.0f);
+        auto a = device->createWorkingBuffer(bufferSize);
+        auto b = device->createWorkingBuffer(bufferSize);
+        a->copyDataFrom(data.data(), bufferSize);
+
+        // a -> b -> a, so every replay raises a to the fourth power
+        auto forward = device->createProgram(code, count);
+        forward->Arg(a, 0);
+        forward->Arg(b, 1);
+        auto backward = device->createProgram(code, count);
+        backward->Arg(b, 0);
+        backward->Arg(a, 1);
+
+        auto poolManager = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        poolManager->beginCapture();
+        TEST_ASSERT(poolManager->isCapturing(), "Capture did not start");
+        forward->setup(poolManager);
+        backward->setup(poolManager);
+        auto graph = poolManager->endCapture();
+        TEST_ASSERT(!poolManager->isCapturing(), "Capture did not end");
+        TEST_ASSERT(graph != nullptr, "Capture produced no graph");
+        TEST_ASSERT(graph->getDispatchCount() == 2, "Capture should hold both dispatches");
+
+        std::vector<float> result(count, 0.0f);
+        auto first = device->submit(graph);
+        TEST_ASSERT(first.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "First replay timed out");
+        a->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 16.0f && result.back() == 16.0f, "Wrong output after the first replay");
+
+        auto second = device->submit(graph);
+        TEST_ASSERT(second.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "Second replay timed out");
+        a->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 65536.0f && result.back() == 65536.0f, "Wrong output after the second replay");
+
+        // Dropping the graph with a replay still queued waits for it to finish
+        device->submit(graph);
+        graph.reset();
+    }
+};
+REGISTER_TEST(CommandGraphReplayTest);
+
+class SubmitNotReadyTest : public DeviceTestBase {
+public:
+    SubmitNotReadyTest(std::string name) : DeviceTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        const size_t count = 1024;
+        const size_t bufferSize = count * sizeof(float);
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        auto fast = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+
+        // The slow pool's only recording thread is blocked until released
+        auto recorder = ThreadPool::create(1);
+        std::promise<void> release;
+        std::shared_future<void> released = release.get_future().share();
+        recorder->enqueue([released] { released.wait(); });
+        auto slow = CommandPoolManager::create(recorder, device->getDevice(), fast->getQueueFamilyIndex(),
+                                               fast->getQueueFamilyProperties());
+
+        std::vector<std::shared_ptr<Program>> programs;
+        std::vector<std::shared_ptr<Buffer>> outputs;
+        for (auto &pool : {slow, fast}) {
+            std::vector<float> data(count, static_cast<float>(programs.size() + 2));
+            auto input = device->createWorkingBuffer(bufferSize);
+            auto output = device->createWorkingBuffer(bufferSize);
+            input->copyDataFrom(data.data(), bufferSize);
+            auto program = device->createProgram(code, count);
+            program->Arg(input, 0);
+            program->Arg(output, 1);
+            program->setup(pool);
+            programs.push_back(program);
+            outputs.push_back(output);
+        }
+        TEST_ASSERT(!slow->is_ready(), "The blocked pool should still be recording");
+
+        // Queued first, the slow pool must not hold back the ready one
+        auto slowDone = device->submit({slow}, 0);
+        auto fastDone = device->submit({fast, fast}, 0);
+        bool fastFinished = fastDone.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+        bool slowPending = slowDone.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+        release.set_value();
+        TEST_ASSERT(fastFinished, "Ready work was held back by a pool still recording");
+        TEST_ASSERT(slowPending, "Work was submitted before its pool finished recording");
+        TEST_ASSERT(slowDone.wait_for(std::chrono::seconds(5)) == std::future_status::ready,
+                    "Deferred work was not submitted once its pool became ready");
+
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            std::vector<float> result(count, 0.0f);
+            outputs[i]->copyDataTo(result.data(), bufferSize);
+            const float expected = static_cast<float>((i + 2) * (i + 2));
+            TEST_ASSERT(result.front() == expected && result.back() == expected,
+                        "Wrong output for pool " + std::to_string(i));
+        }
+    }
+};
+REGISTER_TEST(SubmitNotReadyTest);
+
+class SubmitDuplicatePoolTest : public DeviceTestBase {
+public:
+    SubmitDuplicatePoolTest(std::string name) : DeviceTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        const size_t count = 1024;
+        const size_t bufferSize = count * sizeof(float);
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        std::vector<float> data(count, 3.0f);
+        auto input = device->createWorkingBuffer(bufferSize);
+        auto output = device->createWorkingBuffer(bufferSize);
+        input->copyDataFrom(data.data(), bufferSize);
+        auto program = device->createProgram(code, count);
+        program->Arg(input, 0);
+        program->Arg(output, 1);
+        auto pool = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        program->setup(pool);
+
+        // The same pool listed twice, then queued again with nothing new recorded: its
+        // primary is submitted once and every future still completes
+        auto first = device->submit({pool, pool}, 0);
+        auto second = device->submit({pool}, 0);
+        TEST_ASSERT(first.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "First submit timed out");
+        TEST_ASSERT(second.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "Second submit timed out");
+
+        // A pool with nothing recorded completes without submitting anything
+        auto empty = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        TEST_ASSERT(device->submit({empty}, 0).wait_for(std::chrono::seconds(5)) == std::future_status::ready,
+                    "Submitting an empty pool timed out");
+
+        std::vector<float> result(count, 0.0f);
+        output->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 9.0f && result.back() == 9.0f, "Wrong output after duplicate submits");
+    }
+};
+REGISTER_TEST(SubmitDuplicatePoolTest);
+
+class EpochRingTest : public DeviceTestBase {
+public:
+    EpochRingTest(std::string name) : DeviceTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        const size_t count = 1024;
+        const size_t bufferSize = count * sizeof(float);
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        std::vector<float> data(count, 2.0f);
+        std::vector<std::shared_ptr<Buffer>> buffers;
+        for (int i = 0; i < 4; ++i)
+            buffers.push_back(device->createWorkingBuffer(bufferSize));
+        buffers[0]->copyDataFrom(data.data(), bufferSize);
+
+        // Each program squares buffer i into buffer i + 1
+        std::vector<std::shared_ptr<Program>> programs;
+        for (int i = 0; i < 3; ++i) {
+            auto program = device->createProgram(code, count);
+            program->Arg(buffers[i], 0);
+            program->Arg(buffers[i + 1], 1);
+            programs.push_back(program);
+        }
+        auto pool = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+
+        // Epoch N+1 is recorded while epoch N has not been submitted; both go out in order
+        programs[0]->setup(pool);
+        TEST_ASSERT(pool->waitForReady(std::chrono::seconds(5)), "First epoch was not recorded");
+        programs[1]->setup(pool);
+        auto first = device->submit({pool}, 0);
+
+        // Epoch N+2 is recorded while the previous submission may still be queued or running
+        programs[2]->setup(pool);
+        auto second = device->submit({pool}, 0);
+        TEST_ASSERT(first.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "First submit timed out");
+        TEST_ASSERT(second.wait_for(std::chrono::seconds(5)) == std::future_status::ready, "Second submit timed out");
+
+        std::vector<float> result(count, 0.0f);
+        buffers[3]->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 256.0f && result.back() == 256.0f, "Epochs ran out of order or were lost");
+    }
+};
+REGISTER_TEST(EpochRingTest);
+
 class ThreadPoolCreationTest : public Test {
 public:
     ThreadPoolCreationTest(std::string name) : Test(name) {}
@@ -174,3 +377,27 @@ REGISTER_TEST(BufferDataTransferTest);
 
 // Replace any Buffer::map/unmap/getMappedData with Buffer::getPtr(), and use copyDataFrom/copyDataTo for data transfer.
 // Use Device::getComputePoolManager(size_t idx, VkQueueFlagBits flags) and Device::getDevice() with no arguments.
+
+class PipelineCachePersistTest : public DeviceTestBase {
+public:
+    PipelineCachePersistTest(std::string name) : DeviceTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        const auto dir = std::filesystem::temp_directory_path() / "vkrt_pipeline_cache_test";
+        std::filesystem::remove_all(dir);
+        {
+            auto cache = PipelineCache::create(device->getDevice(), device->getDeviceFeatures(), dir);
+            TEST_ASSERT(!cache->isWarm(), "A fresh directory should give a cold cache");
+            TEST_ASSERT(cache->save(), "Saving the pipeline cache failed");
+            TEST_ASSERT(std::filesystem::exists(cache->getPath()), "Pipeline cache file was not written");
+        }
+        auto reloaded = PipelineCache::create(device->getDevice(), device->getDeviceFeatures(), dir);
+        TEST_ASSERT(reloaded->isWarm(), "Saved pipeline cache was not loaded");
+        reloaded.reset();
+        std::filesystem::remove_all(dir);
+    }
+};
+REGISTER_TEST(PipelineCachePersistTest);
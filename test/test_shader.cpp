@@ -4,7 +4,13 @@
 #include "storage.h"
 #include "runtime.h"
 #include "program.h"
+#include "square.h"
+#include "scale.h"
+#include "address_square.h"
+#include "device_features.h"
+#include <cstddef>
 #include <vector>
+#include <thread>
 #include <iostream>
 
 using namespace runtime;
@@ -67,3 +73,387 @@ public:
 REGISTER_TEST(ProgramExecutionTest);
 
 // Replace Buffer::map/unmap/getMappedData with Buffer::getPtr(), and use copyDataFrom/copyDataTo for data transfer.
+
+class ShaderTestBase : public Test {
+public:
+    ShaderTestBase(std::string name) : Test(name) {}
+    void setup() override {
+        runtime = Runtime::create();
+        if (runtime && runtime->deviceCount() > 0) {
+            auto devices = runtime->pullDevices();
+            if (!devices.empty())
+                device = devices[0];
+        }
+    }
+    void teardown() override {
+        device.reset();
+        runtime.reset();
+    }
+protected:
+    std::shared_ptr<Runtime> runtime;
+    std::shared_ptr<Device> device;
+};
+
+class ProgramBatchCompileTest : public ShaderTestBase {
+public:
+    ProgramBatchCompileTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        std::vector<ProgramDesc> descs(16, ProgramDesc{code, 1024});
+        auto futures = device->createProgramsAsync(descs);
+        TEST_ASSERT(futures.size() == descs.size(), "One future per shader expected");
+        for (auto &future : futures)
+            TEST_ASSERT(future.get() != nullptr, "Concurrent program creation failed");
+    }
+};
+REGISTER_TEST(ProgramBatchCompileTest);
+
+class ProgramCacheTest : public ShaderTestBase {
+public:
+    ProgramCacheTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        auto first = device->createProgram(code, 1024);
+        auto second = device->createProgram(code, 512);
+        TEST_ASSERT(first != nullptr && second != nullptr, "Program creation failed");
+        TEST_ASSERT(first->getPipelineState() == second->getPipelineState(),
+                    "Identical shaders should share one pipeline");
+        TEST_ASSERT(device->getProgramCache()->getHitCount() >= 1, "Second program should hit the cache");
+    }
+};
+REGISTER_TEST(ProgramCacheTest);
+
+class SpecializationTest : public ShaderTestBase {
+public:
+    SpecializationTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        Specialization a, b;
+        a.set(0u, 64u).set("TILE", 1.5f).set(2u, true);
+        b.set(2u, true).set("TILE", 1.5f).set(0u, 64u);
+        TEST_ASSERT(a == b, "Specializations with the same values should compare equal");
+        b.set(0u, 32u);
+        TEST_ASSERT(!(a == b), "Different values should not compare equal");
+
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        auto plain = device->createProgram(code, 1024);
+        auto specialized = device->createProgram(code, 1024, 1, 1, Specialization().set(0u, 64u));
+        auto again = device->createProgram(code, 1024, 1, 1, Specialization().set(0u, 64u));
+        TEST_ASSERT(plain->getPipelineState() != specialized->getPipelineState(),
+                    "A specialization should get its own pipeline");
+        TEST_ASSERT(specialized->getPipelineState() == again->getPipelineState(),
+                    "Identical specializations should share a pipeline");
+    }
+};
+REGISTER_TEST(SpecializationTest);
+
+class PushConstantTest : public ShaderTestBase {
+public:
+    PushConstantTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        auto program = device->createProgram(code, 1);
+        const VkPushConstantRange &range = program->getPipelineState()->getPushConstantRange();
+        TEST_ASSERT(range.size == 0, "A shader without a push-constant block should get an empty range");
+
+        // Out of range writes are rejected, so the dispatch records no push constants and
+        // still runs as if the call had not been made
+        program->setPushConstants(uint32_t(1024));
+        const size_t bufferSize = 1024 * sizeof(float);
+        std::vector<float> data(1024, 5.0f), result(1024, 0.0f);
+        auto input = device->createWorkingBuffer(bufferSize);
+        auto output = device->createWorkingBuffer(bufferSize);
+        input->copyDataFrom(data.data(), bufferSize);
+        program->Arg(input, 0);
+        program->Arg(output, 1);
+        auto pool = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        output->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 25.0f && result.back() == 25.0f,
+                    "A rejected push-constant write should leave the dispatch unchanged");
+    }
+};
+REGISTER_TEST(PushConstantTest);
+
+class PushConstantScaleTest : public ShaderTestBase {
+public:
+    PushConstantScaleTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        // out[i] = in[i] * scale for i < count; see scale.comp
+        struct Params {
+            float scale;
+            uint32_t count;
+        };
+        const size_t count = 1024;
+        const size_t bufferSize = count * sizeof(float);
+        std::vector<uint32_t> code(scale, scale + (sizeof(scale) / sizeof(uint32_t)));
+        auto program = device->createProgram(code, 1);
+        const VkPushConstantRange &range = program->getPipelineState()->getPushConstantRange();
+        TEST_ASSERT(range.offset == 0 && range.size == sizeof(Params), "Push-constant range should cover Params");
+        TEST_ASSERT(range.stageFlags & VK_SHADER_STAGE_COMPUTE_BIT, "Push constants should reach the compute stage");
+
+        std::vector<float> data(count), result(count, -1.0f);
+        for (size_t i = 0; i < count; ++i)
+            data[i] = static_cast<float>(i);
+        auto input = device->createWorkingBuffer(bufferSize);
+        auto output = device->createWorkingBuffer(bufferSize);
+        input->copyDataFrom(data.data(), bufferSize);
+        output->copyDataFrom(result.data(), bufferSize);
+        program->Arg(input, 0);
+        program->Arg(output, 1);
+
+        program->setPushConstants(Params{3.0f, 1000});
+        // Past the end of the block: rejected, leaving count as set
+        program->setPushConstants(uint32_t(1), sizeof(Params));
+        auto pool = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        output->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result[1] == 3.0f && result[999] == 2997.0f, "Output not scaled by the pushed factor");
+        TEST_ASSERT(result[1000] == -1.0f && result[1023] == -1.0f, "Invocations past the pushed count wrote output");
+
+        // Updating one member keeps the other
+        program->setPushConstants(0.5f, offsetof(Params, scale));
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        output->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result[2] == 1.0f && result[999] == 499.5f && result[1000] == -1.0f,
+                    "Partial push-constant update not applied");
+    }
+};
+REGISTER_TEST(PushConstantScaleTest);
+
+class BulkBindTest : public ShaderTestBase {
+public:
+    BulkBindTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        auto program = device->createProgram(code, 1024);
+        const auto &templates = program->getPipelineState()->getUpdateTemplates();
+        TEST_ASSERT(!templates.empty() && templates[0] != VK_NULL_HANDLE,
+                    "A set of storage buffers should get an update template");
+
+        const size_t bufferSize = 1024 * sizeof(float);
+        std::vector<float> data(1024, 3.0f), result(1024, 0.0f);
+        auto input = device->createWorkingBuffer(bufferSize);
+        auto output = device->createWorkingBuffer(bufferSize);
+        input->copyDataFrom(data.data(), bufferSize);
+        auto pool = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        program->bind({input, output});
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        output->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 9.0f && result.back() == 9.0f, "Wrong output through bulk-bound buffers");
+
+        // Rebind only the output; the input binding is kept
+        auto other = device->createWorkingBuffer(bufferSize);
+        program->bind({nullptr, other});
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        other->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 9.0f && result.back() == 9.0f, "Rebound output was not written");
+
+        // Rebinding the input to the first output chains the two
+        program->bind({output, nullptr});
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        other->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result.front() == 81.0f && result.back() == 81.0f, "Rebound input was not read");
+    }
+};
+REGISTER_TEST(BulkBindTest);
+
+class ChunkedDispatchTest : public ShaderTestBase {
+public:
+    ChunkedDispatchTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        // One workgroup squares a 1024-float chunk; four chunks mean four dispatches
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        auto program = device->createProgram(code, 1);
+        const size_t chunkSize = 1024 * sizeof(float);
+        const size_t bufferSize = chunkSize * 4;
+        auto input = device->createChunkedBuffer(bufferSize, chunkSize);
+        auto output = device->createChunkedBuffer(bufferSize, chunkSize);
+        TEST_ASSERT(input != nullptr && output != nullptr, "Chunked buffer creation failed");
+        TEST_ASSERT(input->getChunkCount() == 4, "Unexpected chunk count");
+
+        std::vector<float> data(bufferSize / sizeof(float)), result(data.size(), 0.0f);
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = static_cast<float>(i % 64);
+        input->copyDataFrom(data.data(), bufferSize).wait();
+
+        auto pool = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        program->Arg(input, 0);
+        program->Arg(output, 1);
+        // A whole buffer on the writable output would be written by every chunk's dispatch
+        auto whole = device->createWorkingBuffer(bufferSize);
+        std::vector<float> zeros(data.size(), 0.0f);
+        whole->copyDataFrom(zeros.data(), bufferSize);
+        program->Arg(whole, 1);
+
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        output->copyDataTo(result.data(), bufferSize);
+        for (size_t i = 0; i < data.size(); ++i)
+            TEST_ASSERT(result[i] == data[i] * data[i], "Wrong output from a chunked dispatch");
+        whole->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result == zeros, "A rejected unchunked output should not be bound");
+    }
+};
+REGISTER_TEST(ChunkedDispatchTest);
+
+class PushDescriptorTest : public ShaderTestBase {
+public:
+    PushDescriptorTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        std::vector<uint32_t> code(square, square + (sizeof(square) / sizeof(uint32_t)));
+        auto program = device->createProgram(code, 1024, 1, 1, {}, BindingMode::PushDescriptors);
+        if (!device->getDeviceFeatures().supportsPushDescriptors()) {
+            TEST_ASSERT(program->getPipelineState()->getBindingMode() == BindingMode::DescriptorSets,
+                        "Without the extension the Program should fall back to descriptor sets");
+            std::cout << "Skipping test: VK_KHR_push_descriptor not supported" << std::endl;
+            return;
+        }
+        TEST_ASSERT(program->getPipelineState()->getBindingMode() == BindingMode::PushDescriptors,
+                    "Program should use push descriptors");
+
+        // One Program, three threads, each with its own pool and output. The first two read
+        // their own inputs; the third shares the first thread's input, so the upload that
+        // filled it has to be waited on by both dispatches. It records after the first one,
+        // which takes the input's pending barriers, and is submitted after it.
+        const size_t bufferSize = 1024 * sizeof(float);
+        const float values[] = {2.0f, 3.0f};
+        std::vector<std::shared_ptr<Buffer>> inputs, outputs;
+        for (float value : values) {
+            std::vector<float> data(1024, value);
+            inputs.push_back(device->createWorkingBuffer(bufferSize));
+            inputs.back()->copyDataFrom(data.data(), bufferSize);
+        }
+        inputs.push_back(inputs[0]);
+
+        std::vector<std::shared_ptr<CommandPoolManager>> pools;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < inputs.size(); ++t) {
+            pools.push_back(device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT));
+            outputs.push_back(device->createWorkingBuffer(bufferSize));
+        }
+        auto record = [&](size_t t) {
+            program->dispatch(pools[t], {inputs[t], outputs[t]});
+        };
+        threads.emplace_back(record, 0);
+        threads.emplace_back(record, 1);
+        threads[0].join();
+        threads.emplace_back(record, 2);
+        for (size_t t = 1; t < threads.size(); ++t)
+            threads[t].join();
+        device->submit(pools, 0);
+        for (auto &pool : pools)
+            pool->wait();
+
+        const float expected[] = {4.0f, 9.0f, 4.0f};
+        std::vector<float> result(1024, 0.0f);
+        for (size_t t = 0; t < outputs.size(); ++t) {
+            outputs[t]->copyDataTo(result.data(), bufferSize);
+            TEST_ASSERT(result.front() == expected[t] && result.back() == expected[t],
+                        "Wrong output from a concurrent push-descriptor dispatch");
+        }
+    }
+};
+REGISTER_TEST(PushDescriptorTest);
+
+class AddressArgTest : public ShaderTestBase {
+public:
+    AddressArgTest(std::string name) : ShaderTestBase(name) {}
+    void run() override {
+        if (!device) {
+            std::cout << "Skipping test: No suitable device for testing" << std::endl;
+            return;
+        }
+        if (!device->getDeviceFeatures().supportsBufferDeviceAddress()) {
+            TEST_ASSERT(device->createAddressTable({}) == nullptr, "Address tables need bufferDeviceAddress");
+            std::cout << "Skipping test: bufferDeviceAddress not supported" << std::endl;
+            return;
+        }
+        // Squares src into the first buffer of the table for i < count; see address_square.comp
+        const size_t count = 1024;
+        const size_t bufferSize = count * sizeof(float);
+        std::vector<uint32_t> code(address_square, address_square + (sizeof(address_square) / sizeof(uint32_t)));
+        auto program = device->createProgram(code, 1);
+        const VkPushConstantRange &range = program->getPipelineState()->getPushConstantRange();
+        TEST_ASSERT(range.offset == 0 && range.size == 20, "Push-constant range should cover two pointers and count");
+
+        std::vector<float> data(count), result(count, -1.0f);
+        for (size_t i = 0; i < count; ++i)
+            data[i] = static_cast<float>(i);
+        auto input = device->createWorkingBuffer(bufferSize);
+        auto output = device->createWorkingBuffer(bufferSize);
+        auto other = device->createWorkingBuffer(bufferSize);
+        input->copyDataFrom(data.data(), bufferSize);
+        output->copyDataFrom(result.data(), bufferSize);
+        other->copyDataFrom(result.data(), bufferSize);
+
+        auto table = device->createAddressTable({output});
+        TEST_ASSERT(table != nullptr && table->getBuffers().size() == 1, "Address table creation failed");
+        program->ArgAddress(input, 0);
+        program->ArgAddress(table, 1);
+        program->setPushConstants(uint32_t(1000), 16);
+        // Slot 2 would end past the block and overwrite count; it is rejected
+        program->ArgAddress(other, 2);
+        auto pool = device->getComputePoolManager(0, VK_QUEUE_COMPUTE_BIT);
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        output->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result[3] == 9.0f && result[999] == 998001.0f, "Output not written through the patched addresses");
+        TEST_ASSERT(result[1000] == -1.0f && result[1023] == -1.0f, "Rejected address slot changed count");
+
+        // A new table in the same slot is patched in on the next dispatch
+        program->ArgAddress(device->createAddressTable({other}), 1);
+        program->setup(pool);
+        device->submit({pool}, 0);
+        pool->wait();
+        other->copyDataTo(result.data(), bufferSize);
+        TEST_ASSERT(result[3] == 9.0f && result[999] == 998001.0f, "Output not written through the new table");
+        TEST_ASSERT(result[1000] == -1.0f, "Invocations past count wrote output");
+    }
+};
+REGISTER_TEST(AddressArgTest);